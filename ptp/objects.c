@@ -30,6 +30,14 @@
 //=======
 #include <linux/uio.h>
 #include <linux/pagemap.h>
+#include <linux/completion.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/sort.h>
+#include <linux/writeback.h>
 #include "ptp.h"              
 #include "ptpfs.h"
 
@@ -40,11 +48,512 @@
 } while (0)
 #endif
 
-#define PASSPORT_FREE 0xff
-DECLARE_MUTEX (ptp_passport_mutex);
-unsigned char passport=PASSPORT_FREE;
+/*
+ * The passport serializes readdir, lookup, readpage, direct IO and put_inode
+ * of one mount.  Callers passing the same flag share it: readpage takes it
+ * for every page and ptpfs_release gives it back once.  Waiters sleep on
+ * passport_wait and are woken as soon as it is released.
+ */
+void ptpfs_passport_get(struct ptpfs_sb_info *sb_info, int flag)
+{
+	spin_lock(&sb_info->passport_lock);
+	while (sb_info->passport != PASSPORT_FREE && sb_info->passport != flag)
+	{
+		spin_unlock(&sb_info->passport_lock);
+		wait_event(sb_info->passport_wait,
+		           sb_info->passport == PASSPORT_FREE || sb_info->passport == flag);
+		spin_lock(&sb_info->passport_lock);
+	}
+	sb_info->passport = flag;
+	spin_unlock(&sb_info->passport_lock);
+}
 
-static int ptpfs_get_dir_data(struct inode *inode)
+//	background work only runs while nobody else holds the passport
+int ptpfs_passport_tryget(struct ptpfs_sb_info *sb_info, int flag)
+{
+	int ret = 0;
+
+	spin_lock(&sb_info->passport_lock);
+	if (sb_info->passport == PASSPORT_FREE)
+	{
+		sb_info->passport = flag;
+		ret = 1;
+	}
+	spin_unlock(&sb_info->passport_lock);
+	return ret;
+}
+
+/*
+ * ptpfs_bus_busy:
+ * a GetObject or SendObject data phase is open between two passport holders.
+ * Any transaction would abort it, background work waits.
+ */
+int ptpfs_bus_busy(struct ptpfs_sb_info *sb_info)
+{
+	return sb_info->read_condition == 1 || (sb_info->upload && sb_info->upload->streaming);
+}
+
+void ptpfs_passport_put(struct ptpfs_sb_info *sb_info)
+{
+	spin_lock(&sb_info->passport_lock);
+	sb_info->passport = PASSPORT_FREE;
+	spin_unlock(&sb_info->passport_lock);
+	wake_up_all(&sb_info->passport_wait);
+}
+
+//=========================================================================
+//	ObjectInfo cache
+//
+//	readdir already fetched the ObjectInfo of every child; lookup and the
+//	inode setup take it from here instead of asking the device again.
+//	Entries are dropped by device events and by create/mkdir/unlink.
+//=========================================================================
+static struct ptpfs_oi_node *__ptpfs_oi_find(struct ptpfs_sb_info *sb_info, __u32 handle)
+{
+	struct rb_node *n = sb_info->oi_cache.rb_node;
+	struct ptpfs_oi_node *oi;
+
+	while (n)
+	{
+		oi = rb_entry(n, struct ptpfs_oi_node, node);
+		if (handle < oi->handle)
+			n = n->rb_left;
+		else if (handle > oi->handle)
+			n = n->rb_right;
+		else
+			return oi;
+	}
+	return NULL;
+}
+
+static void __ptpfs_oi_erase(struct ptpfs_sb_info *sb_info, struct ptpfs_oi_node *oi)
+{
+	rb_erase(&oi->node, &sb_info->oi_cache);
+	sb_info->oi_count--;
+	if (oi->info.filename)
+		kfree(oi->info.filename);
+	kfree(oi);
+}
+
+//	copy of object is cached, object itself is left to the caller
+void ptpfs_oi_insert(struct ptpfs_sb_info *sb_info, __u32 handle, struct ptp_object_info *object)
+{
+	struct rb_node **p = &sb_info->oi_cache.rb_node;
+	struct rb_node *parent = NULL;
+	struct ptpfs_oi_node *oi, *old;
+
+	oi = kmalloc(sizeof(struct ptpfs_oi_node), GFP_KERNEL);
+	if (oi == NULL)
+		return;
+	oi->handle = handle;
+	oi->info = *object;
+	oi->info.keywords = NULL;
+	if (object->filename)
+	{
+		oi->info.filename = kmalloc(strlen(object->filename)+1, GFP_KERNEL);
+		if (oi->info.filename == NULL)
+		{
+			kfree(oi);
+			return;
+		}
+		strcpy(oi->info.filename, object->filename);
+	}
+
+	down(&sb_info->oi_sem);
+	old = __ptpfs_oi_find(sb_info, handle);
+	if (old)
+		__ptpfs_oi_erase(sb_info, old);
+	if (sb_info->oi_count >= PTPFS_OI_CACHE_MAX)
+	{
+		up(&sb_info->oi_sem);
+		if (oi->info.filename)
+			kfree(oi->info.filename);
+		kfree(oi);
+		return;
+	}
+	while (*p)
+	{
+		parent = *p;
+		if (handle < rb_entry(parent, struct ptpfs_oi_node, node)->handle)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&oi->node, parent, p);
+	rb_insert_color(&oi->node, &sb_info->oi_cache);
+	sb_info->oi_count++;
+	up(&sb_info->oi_sem);
+}
+
+void ptpfs_oi_forget(struct ptpfs_sb_info *sb_info, __u32 handle)
+{
+	struct ptpfs_oi_node *oi;
+
+	down(&sb_info->oi_sem);
+	oi = __ptpfs_oi_find(sb_info, handle);
+	if (oi)
+		__ptpfs_oi_erase(sb_info, oi);
+	up(&sb_info->oi_sem);
+}
+
+void ptpfs_oi_clear(struct ptpfs_sb_info *sb_info)
+{
+	struct rb_node *n;
+
+	down(&sb_info->oi_sem);
+	while ((n = rb_first(&sb_info->oi_cache)) != NULL)
+		__ptpfs_oi_erase(sb_info, rb_entry(n, struct ptpfs_oi_node, node));
+	up(&sb_info->oi_sem);
+}
+
+/*
+ * ptpfs_getobjectinfo:
+ * ptp_getobjectinfo() served from the cache when possible.  object gets its
+ * own filename either way, free it with ptp_free_object_info().
+ */
+__u16 ptpfs_getobjectinfo(struct ptpfs_sb_info *sb_info, __u32 handle, struct ptp_object_info *object)
+{
+	struct ptpfs_oi_node *oi;
+	__u16 ret;
+
+	down(&sb_info->oi_sem);
+	oi = __ptpfs_oi_find(sb_info, handle);
+	if (oi)
+	{
+		*object = oi->info;
+		if (oi->info.filename)
+		{
+			object->filename = kmalloc(strlen(oi->info.filename)+1, GFP_KERNEL);
+			if (object->filename)
+				strcpy(object->filename, oi->info.filename);
+		}
+		up(&sb_info->oi_sem);
+		return PTP_RC_OK;
+	}
+	up(&sb_info->oi_sem);
+
+	ret = ptp_getobjectinfo(sb_info, handle, object);
+	if (ret == PTP_RC_OK)
+		ptpfs_oi_insert(sb_info, handle, object);
+	return ret;
+}
+//=========================================================================
+
+/*
+ * dircache entries are kept sorted by handle.  The handle is the readdir
+ * cookie (PTPFS_DIR_COOKIE), so a getdents that stopped half way resumes at
+ * the same entry even if the dircache was dropped and listed again.
+ */
+static int ptpfs_dircache_cmp(const void *a, const void *b)
+{
+	__u32 ha = ((const struct ptpfs_dirinode_fileinfo *)a)->handle;
+	__u32 hb = ((const struct ptpfs_dirinode_fileinfo *)b)->handle;
+
+	if (ha < hb)
+		return -1;
+	return ha > hb;
+}
+
+static void ptpfs_dircache_sort(struct ptpfs_inode_data *ptpfs_data)
+{
+	sort(ptpfs_data->data.dircache.file_info, ptpfs_data->data.dircache.num_files,
+	     sizeof(struct ptpfs_dirinode_fileinfo), ptpfs_dircache_cmp, NULL);
+}
+
+//	index of the first entry at or after readdir position pos
+static int ptpfs_dircache_seek(struct ptpfs_inode_data *ptpfs_data, loff_t pos)
+{
+	int lo = 0;
+	int hi = ptpfs_data->data.dircache.num_files;
+	int mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (PTPFS_DIR_COOKIE(ptpfs_data->data.dircache.file_info[mid].handle) < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+//=========================================================================
+//	whole tree snapshot
+//
+//	With snapshot=1 the first folder listing fetches GetObjectHandles with
+//	association 0 (every object of the storage) and the ObjectInfo of each,
+//	then all later folders are cut out of that list by parent_object.  Any
+//	object or store event makes it stale, folders are then listed one by one
+//	again.
+//=========================================================================
+static int ptpfs_snap_cmp(const void *a, const void *b)
+{
+	const struct ptpfs_snap_entry *ea = a;
+	const struct ptpfs_snap_entry *eb = b;
+
+	if (ea->parent != eb->parent)
+		return ea->parent < eb->parent ? -1 : 1;
+	if (ea->storage != eb->storage)
+		return ea->storage < eb->storage ? -1 : 1;
+	if (ea->handle != eb->handle)
+		return ea->handle < eb->handle ? -1 : 1;
+	return 0;
+}
+
+void ptpfs_snapshot_drop(struct ptpfs_sb_info *sb_info, int state)
+{
+	int x;
+
+	down(&sb_info->snap_sem);
+	for (x = 0; x < sb_info->snap_n; x++)
+		kfree(sb_info->snap[x].filename);
+	if (sb_info->snap)
+		ptp_seg_free((unsigned char *)sb_info->snap);
+	sb_info->snap = NULL;
+	sb_info->snap_n = 0;
+	sb_info->snap_state = state;
+	up(&sb_info->snap_sem);
+}
+
+static int ptpfs_snapshot_storage(struct ptpfs_sb_info *sb_info, __u32 storage, int *max)
+{
+	struct ptp_object_handles objects;
+	struct ptp_object_info object;
+	struct ptpfs_snap_entry *e;
+	__u32 x;
+
+	objects.n = 0;
+	objects.handles = NULL;
+	if (ptp_getobjecthandles(sb_info, storage, 0x000000, 0x000000, &objects) != PTP_RC_OK)
+		return -EIO;
+
+	if (sb_info->snap_n + objects.n > *max)
+	{
+		int size;
+
+		*max = sb_info->snap_n + objects.n;
+		size = *max*sizeof(struct ptpfs_snap_entry);
+		e = (struct ptpfs_snap_entry *)(size > PTP_SEG_KMALLOC_MAX ? vmalloc(size) : kmalloc(size, GFP_KERNEL));
+		if (e == NULL)
+		{
+			ptp_free_object_handles(&objects);
+			return -ENOMEM;
+		}
+		if (sb_info->snap)
+		{
+			memcpy(e, sb_info->snap, sb_info->snap_n*sizeof(struct ptpfs_snap_entry));
+			ptp_seg_free((unsigned char *)sb_info->snap);
+		}
+		sb_info->snap = e;
+	}
+
+	for (x = 0; x < objects.n; x++)
+	{
+		memset(&object,0,sizeof(object));
+		if (ptpfs_getobjectinfo(sb_info, objects.handles[x], &object) != PTP_RC_OK)
+		{
+			ptp_free_object_handles(&objects);
+			return -EIO;
+		}
+		e = &sb_info->snap[sb_info->snap_n++];
+		e->parent = object.parent_object;
+		e->storage = object.storage_id;
+		e->handle = objects.handles[x];
+		e->mode = DT_REG;
+		if (object.object_format==PTP_OFC_Association && object.association_type == PTP_AT_GenericFolder)
+			e->mode = DT_DIR;
+		e->filename = object.filename;
+		object.filename = NULL;
+		ptp_free_object_info(&object);
+	}
+	ptp_free_object_handles(&objects);
+	return 0;
+}
+
+//	caller holds snap_sem
+static int ptpfs_snapshot_load(struct ptpfs_sb_info *sb_info)
+{
+	__u32 *ids;
+	int max = 0;
+	int ret = 0;
+	int x;
+	int n;
+
+	down(&sb_info->storage_sem);
+	n = ptpfs_storage_get(sb_info, 0);
+	if (n <= 0)
+	{
+		up(&sb_info->storage_sem);
+		return -EIO;
+	}
+	ids = kmalloc(n*sizeof(__u32), GFP_KERNEL);
+	if (ids == NULL)
+	{
+		up(&sb_info->storage_sem);
+		return -ENOMEM;
+	}
+	for (x = 0; x < n; x++)
+		ids[x] = sb_info->storages[x].id;
+	up(&sb_info->storage_sem);
+
+	for (x = 0; x < n && !ret; x++)
+		ret = ptpfs_snapshot_storage(sb_info, ids[x], &max);
+	kfree(ids);
+	if (ret)
+		return ret;
+
+	sort(sb_info->snap, sb_info->snap_n, sizeof(struct ptpfs_snap_entry), ptpfs_snap_cmp, NULL);
+	sb_info->snap_state = PTPFS_SNAP_LOADED;
+	return 0;
+}
+
+//	fill the dircache from the snapshot, 0 if there is none to use
+static int ptpfs_get_dir_snapshot(struct inode *inode)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(inode->i_sb);
+	struct ptpfs_inode_data* ptpfs_data = PTPFSINO(inode);
+	struct ptpfs_dirinode_fileinfo* finfo;
+	struct ptpfs_snap_entry key;
+	int lo, hi, mid;
+	int n;
+	int x;
+
+	if (!sb_info->snapshot || sb_info->snap_state == PTPFS_SNAP_DROPPED)
+		return 0;
+
+	down(&sb_info->snap_sem);
+	if (sb_info->snap_state == PTPFS_SNAP_NONE && ptpfs_snapshot_load(sb_info))
+	{
+		up(&sb_info->snap_sem);
+		ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+		return 0;
+	}
+	if (sb_info->snap_state != PTPFS_SNAP_LOADED)
+	{
+		up(&sb_info->snap_sem);
+		return 0;
+	}
+
+	// children of the folder are one run of the sorted snapshot
+	key.parent = ptpfs_data->type == INO_TYPE_DIR ? inode->i_ino : 0;
+	key.storage = ptpfs_data->type == INO_TYPE_DIR ? ptpfs_data->storage : inode->i_ino;
+	key.handle = 0;
+	lo = 0;
+	hi = sb_info->snap_n;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (ptpfs_snap_cmp(&sb_info->snap[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (n = 0; lo + n < sb_info->snap_n; n++)
+	{
+		if (sb_info->snap[lo+n].parent != key.parent || sb_info->snap[lo+n].storage != key.storage)
+			break;
+	}
+
+	finfo = (struct ptpfs_dirinode_fileinfo*)kmalloc((n ? n : 1)*sizeof(struct ptpfs_dirinode_fileinfo), GFP_KERNEL);
+	if (finfo == NULL)
+	{
+		up(&sb_info->snap_sem);
+		return 0;
+	}
+	memset(finfo,0,(n ? n : 1)*sizeof(struct ptpfs_dirinode_fileinfo));
+	for (x = 0; x < n; x++)
+	{
+		struct ptpfs_snap_entry *e = &sb_info->snap[lo+x];
+
+		finfo[x].handle = e->handle;
+		finfo[x].mode = e->mode;
+		if (e->filename)
+		{
+			finfo[x].filename = kmalloc(strlen(e->filename)+1, GFP_KERNEL);
+			if (finfo[x].filename == NULL)
+				break;
+			strcpy(finfo[x].filename, e->filename);
+		}
+	}
+	up(&sb_info->snap_sem);
+	if (x < n)
+	{
+		while (x--)
+			kfree(finfo[x].filename);
+		kfree(finfo);
+		return 0;
+	}
+
+	// already in handle order
+	ptpfs_data->data.dircache.file_info = finfo;
+	ptpfs_data->data.dircache.num_files = n;
+	ptpfs_data->data.dircache.max_files = n ? n : 1;
+	list_add(&ptpfs_data->dir_list, &sb_info->dir_list);
+	return 1;
+}
+//=========================================================================
+
+/*
+ * fill the dircache with one MTP GetObjectPropList instead of a
+ * GetObjectInfo per child.  Returns 0 if the device refused it, the caller
+ * then lists the folder the PTP way.
+ */
+static int ptpfs_get_dir_proplist(struct inode *inode)
+{
+    struct ptpfs_inode_data* ptpfs_data = PTPFSINO(inode);
+    struct ptpfs_dirinode_fileinfo* finfo;
+    struct ptp_object_list list;
+    struct ptp_object_info *object;
+    __u32 parent = ptpfs_data->type == INO_TYPE_DIR ? inode->i_ino : 0x00000000;
+    __u32 x;
+    int n = 0;
+    int max;
+
+    memset(&list,0,sizeof(list));
+    if (ptp_getobjectproplist(PTPFSSB(inode->i_sb), parent, 1, &list) != PTP_RC_OK)
+        return 0;
+
+    max = list.n ? list.n : 1;
+    finfo = (struct ptpfs_dirinode_fileinfo*)kmalloc(max*sizeof(struct ptpfs_dirinode_fileinfo), GFP_KERNEL);
+    if (finfo == NULL)
+    {
+        ptp_free_object_list(&list);
+        return 0;
+    }
+    for (x = 0; x < list.n; x++)
+    {
+        object = &list.objects[x];
+        ptpfs_oi_insert(PTPFSSB(inode->i_sb), list.handles[x], object);
+        if (list.handles[x] == parent || object->filename == NULL)	// depth 1 may list the folder itself
+            continue;
+        if (ptpfs_data->type == INO_TYPE_STGDIR &&
+            (object->storage_id != inode->i_ino || object->parent_object != 0))
+            continue;
+        if (ptpfs_data->type == INO_TYPE_DIR && object->parent_object != parent)
+            continue;
+
+        finfo[n].filename = object->filename;
+        finfo[n].handle = list.handles[x];
+        finfo[n].mode = DT_REG;
+        if (object->object_format==PTP_OFC_Association && object->association_type == PTP_AT_GenericFolder)
+            finfo[n].mode = DT_DIR;
+        object->filename = NULL;
+        n++;
+    }
+    ptp_free_object_list(&list);
+
+    ptpfs_data->data.dircache.file_info = finfo;
+    ptpfs_data->data.dircache.num_files = n;
+    ptpfs_data->data.dircache.max_files = max;
+    ptpfs_dircache_sort(ptpfs_data);
+    list_add(&ptpfs_data->dir_list, &PTPFSSB(inode->i_sb)->dir_list);
+    return 1;
+}
+
+static void ptpfs_delete_hide(struct ptpfs_sb_info *sb_info, struct ptpfs_inode_data *ptpfs_data);
+
+static int ptpfs_load_dir_data(struct inode *inode)
 {
     int x;
     struct ptpfs_inode_data* ptpfs_data = PTPFSINO(inode);
@@ -53,6 +562,12 @@ static int ptpfs_get_dir_data(struct inode *inode)
  
     if (ptpfs_data->data.dircache.file_info == NULL) //
 	{ 
+		if (ptpfs_get_dir_snapshot(inode))
+			return 1;
+		if (ptp_operation_issupported(PTPFSSB(inode->i_sb), PTP_OC_MTP_GetObjectPropList) &&
+		    ptpfs_get_dir_proplist(inode))
+			return 1;
+
 		struct ptp_object_handles objects;
        objects.n = 0;
        objects.handles = NULL;
@@ -83,12 +598,13 @@ static int ptpfs_get_dir_data(struct inode *inode)
             return 0;
         	}
         memset(ptpfs_data->data.dircache.file_info,0,size);
+        ptpfs_data->data.dircache.max_files = objects.n;
 printk("\n<ptp module> %s do ptp_getobjectinfo %d times inode=0x%p\n",__func__,objects.n,inode);
         for (x = 0; x < objects.n; x++)
        		 {
             struct ptp_object_info object;
             memset(&object,0,sizeof(object));
-            if (ptp_getobjectinfo(PTPFSSB(inode->i_sb),objects.handles[x],&object)!=PTP_RC_OK)
+            if (ptpfs_getobjectinfo(PTPFSSB(inode->i_sb),objects.handles[x],&object)!=PTP_RC_OK)
             		{
                 ptpfs_free_inode_data(inode);
                 ptp_free_object_handles(&objects);
@@ -114,202 +630,757 @@ printk("\n<ptp module> %s do ptp_getobjectinfo %d times inode=0x%p\n",__func__,o
         	  }
 printk("<ptp module> %s do ptp_getobjectinfo %d times inode=0x%p end\n",__func__,objects.n,inode);
         ptp_free_object_handles(&objects);
+        ptpfs_dircache_sort(ptpfs_data);
+        list_add(&ptpfs_data->dir_list, &PTPFSSB(inode->i_sb)->dir_list);
         }
     return 1;
 }
 
+//	a fresh listing still shows what unlink queued for ptpfs_delete_work()
+static int ptpfs_get_dir_data(struct inode *inode)
+{
+	if (PTPFSINO(inode)->data.dircache.file_info != NULL)
+		return 1;
+	if (!ptpfs_load_dir_data(inode))
+		return 0;
+	ptpfs_delete_hide(PTPFSSB(inode->i_sb), PTPFSINO(inode));
+	return 1;
+}
+
 
-static int ptpfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
+
+//=========================================================================
+//	dircache name index
+//=========================================================================
+static void ptpfs_dircache_name_drop(struct ptpfs_inode_data *ptpfs_data)
 {
+	if (ptpfs_data->data.dircache.name_index)
+		ptp_seg_free((unsigned char *)ptpfs_data->data.dircache.name_index);
+	ptpfs_data->data.dircache.name_index = NULL;
+	ptpfs_data->data.dircache.name_mask = 0;
+}
 
-	//printk(KERN_INFO "===== %s ===== \n",  __FUNCTION__);
-	int flag = 5;	// ptpfs_readdir
-checkagain2:
-        down(&ptp_passport_mutex);
-        if(passport==PASSPORT_FREE)
-        {
-                passport=flag;
-                up(&ptp_passport_mutex);
-        }
-        else if(passport!=flag)
-        {
-                up(&ptp_passport_mutex);
-                msleep(1000);
-//printk("david1222: %s(%d) goto checkagain2 filp=%p pass=%d\n",__func__,__LINE__,filp,passport);
-                goto checkagain2;
-        }
-        else
-                up(&ptp_passport_mutex);
+static void __ptpfs_dircache_name_add(struct ptpfs_inode_data *ptpfs_data, int x)
+{
+	int *index = ptpfs_data->data.dircache.name_index;
+	int mask = ptpfs_data->data.dircache.name_mask;
+	unsigned int slot = ptpfs_data->data.dircache.file_info[x].name_hash & mask;
 
-    struct inode *inode = filp->f_dentry->d_inode;
-    struct dentry *dentry = filp->f_dentry;
-    struct ptpfs_inode_data* ptpfs_data = PTPFSINO(inode);
-    int offset = filp->f_pos;
-    int offset2 = filp->f_pos;
-    int file_numbers;
-    ino_t ino;
+	while (index[slot])
+		slot = (slot + 1) & mask;
+	index[slot] = x + 1;
+}
+
+static void ptpfs_dircache_name_set(struct ptpfs_dirinode_fileinfo *finfo)
+{
+	finfo->name_len = finfo->filename ? strlen(finfo->filename) : 0;
+	finfo->name_hash = full_name_hash((unsigned char *)(finfo->filename ? finfo->filename : ""), finfo->name_len);
+}
+
+//	table is kept at most half full so probes stay short
+static int ptpfs_dircache_name_build(struct ptpfs_inode_data *ptpfs_data)
+{
+	int n = ptpfs_data->data.dircache.num_files;
+	int slots = PTPFS_NAME_INDEX_MIN;
+	int size;
 	int x;
 
-	/*
-	if (filp->f_version == inode->i_version && offset)
+	while (slots < n*2)
+		slots <<= 1;
+	size = slots*sizeof(int);
+	if (size > PTP_SEG_KMALLOC_MAX)
+		ptpfs_data->data.dircache.name_index = (int *)vmalloc(size);
+	else
+		ptpfs_data->data.dircache.name_index = (int *)kmalloc(size, GFP_KERNEL);
+	if (ptpfs_data->data.dircache.name_index == NULL)
+		return -ENOMEM;
+	memset(ptpfs_data->data.dircache.name_index, 0, size);
+	ptpfs_data->data.dircache.name_mask = slots - 1;
+
+	for (x = 0; x < n; x++)
 	{
-		return filp->f_pos;
+		ptpfs_dircache_name_set(&ptpfs_data->data.dircache.file_info[x]);
+		__ptpfs_dircache_name_add(ptpfs_data, x);
 	}
-	*/
-	filp->f_version = inode->i_version;
+	return 0;
+}
 
-	switch (offset)
+//	file_info index of the entry called name, -1 if there is none
+static int ptpfs_dircache_lookup(struct ptpfs_inode_data *ptpfs_data, const unsigned char *name, int len)
+{
+	struct ptpfs_dirinode_fileinfo *finfo;
+	unsigned int hash = full_name_hash(name, len);
+	unsigned int slot;
+	int x;
+
+	if (ptpfs_data->data.dircache.name_index == NULL)
 	{
-		case 0:
-			if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) //add "." and ".." to dirent
-			{				
-       		break;
-			}			
-			offset++;
-			filp->f_pos++;
-	        // fall through 
-		case 1:
-			spin_lock(&dcache_lock);
-			ino = dentry->d_parent->d_inode->i_ino;
-			spin_unlock(&dcache_lock);  					//same as parent_ino
-//			ino = parent_ino(dentry); 
-			if (filldir(dirent, "..", 2, offset, ino, DT_DIR) < 0)
-			{
-				break;
-			}
-			filp->f_pos++;
-			offset++;
-		default:
-			if (!ptpfs_get_dir_data(inode))
+		if (ptpfs_dircache_name_build(ptpfs_data))
+		{
+			//	no memory for the index, fall back to a scan
+			for (x = 0; x < ptpfs_data->data.dircache.num_files; x++)
 			{
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-				return filp->f_pos;
+				finfo = &ptpfs_data->data.dircache.file_info[x];
+				if (finfo->filename && strlen(finfo->filename) == len && !memcmp(finfo->filename, name, len))
+					return x;
 			}
-	       filp->f_pos+=2;
+			return -1;
+		}
+	}
 
-    			file_numbers = ptpfs_data->data.dircache.num_files;
-			/*
-			if(offset2>=(file_numbers-1))
-				return 0;
-			*/
-			if(offset2)
-			{
-			
-	       			filp->f_pos-=2;
-				offset2-=4;
-			}
-			for (x = offset2; x < ptpfs_data->data.dircache.num_files; x++)
-			{
-				if (filldir(dirent, 
-                        ptpfs_data->data.dircache.file_info[x].filename, 
-                        strlen(ptpfs_data->data.dircache.file_info[x].filename), 
-                        filp->f_pos, 
-                        ptpfs_data->data.dircache.file_info[x].handle ,
-                        ptpfs_data->data.dircache.file_info[x].mode) < 0)
-				{
-					ptpfs_free_inode_data(inode);
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-					return filp->f_pos;
-				}
-				filp->f_pos++;
-			}
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-			return filp->f_pos;
+	slot = hash & ptpfs_data->data.dircache.name_mask;
+	while ((x = ptpfs_data->data.dircache.name_index[slot]) != 0)
+	{
+		finfo = &ptpfs_data->data.dircache.file_info[x-1];
+		if (finfo->name_hash == hash && finfo->name_len == len && !memcmp(finfo->filename, name, len))
+			return x-1;
+		slot = (slot + 1) & ptpfs_data->data.dircache.name_mask;
 	}
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-	return filp->f_pos;
+	return -1;
 }
 
-static struct dentry * ptpfs_lookup(struct inode *dir, struct dentry *dentry,struct nameidata *nd)
+//	create conflict check, the device itself happily takes duplicate names
+static int ptpfs_dircache_exists(struct inode *dir, struct qstr *name)
 {
-    
-    //printk(KERN_INFO "===== %s =====\n",  __FUNCTION__);
+	if (!ptpfs_get_dir_data(dir))
+		return 0;
+	return ptpfs_dircache_lookup(PTPFSINO(dir), name->name, name->len) >= 0;
+}
 
-	int flag = 15;	// ptpfs_lookup
-checkagain2:
-        down(&ptp_passport_mutex);
-        if(passport==PASSPORT_FREE)
-        {
-                passport=flag;
-                up(&ptp_passport_mutex);
-        }
-        else if(passport!=flag)
-        {
-                up(&ptp_passport_mutex);
-                msleep(1000);
-//printk("david1222: %s(%d) goto checkagain2 dir=%p pass=%d\n",__func__,__LINE__,dir,passport);
-                goto checkagain2;
-        }
-        else
-                up(&ptp_passport_mutex);
+//=========================================================================
+//	dircache patching
+//=========================================================================
+static int ptpfs_dircache_find(struct ptpfs_inode_data *ptpfs_data, __u32 handle)
+{
+	int x = ptpfs_dircache_seek(ptpfs_data, PTPFS_DIR_COOKIE(handle));
+
+	if (x < ptpfs_data->data.dircache.num_files && ptpfs_data->data.dircache.file_info[x].handle == handle)
+		return x;
+	return -1;
+}
 
+//	takes over filename on success
+static int ptpfs_dircache_add(struct ptpfs_inode_data *ptpfs_data, char *filename, __u32 handle, int mode)
+{
+	struct ptpfs_dirinode_fileinfo *finfo;
+	int n = ptpfs_data->data.dircache.num_files;
 	int x;
-    struct ptpfs_inode_data* ptpfs_data = PTPFSINO(dir);
 
-	if (!ptpfs_get_dir_data(dir))
+	if (n == ptpfs_data->data.dircache.max_files)
 	{
-		d_add(dentry, NULL);
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-		return NULL;
+		int max = n ? n*2 : 16;
+
+		finfo = (struct ptpfs_dirinode_fileinfo*)kmalloc(max*sizeof(struct ptpfs_dirinode_fileinfo), GFP_KERNEL);
+		if (finfo == NULL)
+			return -ENOMEM;
+		memcpy(finfo, ptpfs_data->data.dircache.file_info, n*sizeof(struct ptpfs_dirinode_fileinfo));
+		kfree(ptpfs_data->data.dircache.file_info);
+		ptpfs_data->data.dircache.file_info = finfo;
+		ptpfs_data->data.dircache.max_files = max;
 	}
-	if (ptpfs_data->type != INO_TYPE_DIR  && ptpfs_data->type != INO_TYPE_STGDIR)
+	// new handles are usually the biggest, otherwise keep the handle order
+	x = ptpfs_dircache_seek(ptpfs_data, PTPFS_DIR_COOKIE(handle));
+	finfo = &ptpfs_data->data.dircache.file_info[x];
+	if (x < n)
 	{
-		d_add(dentry, NULL);
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-		return NULL;
+		memmove(finfo + 1, finfo, (n-x)*sizeof(struct ptpfs_dirinode_fileinfo));
+		ptpfs_dircache_name_drop(ptpfs_data);		// indexes moved
+	}
+	finfo->filename = filename;
+	finfo->handle = handle;
+	finfo->mode = mode;
+	ptpfs_data->data.dircache.num_files++;
+
+	if (ptpfs_data->data.dircache.name_index)
+	{
+		if (ptpfs_data->data.dircache.num_files*2 > ptpfs_data->data.dircache.name_mask + 1)
+			ptpfs_dircache_name_drop(ptpfs_data);		// rebuilt bigger on the next lookup
+		else
+		{
+			ptpfs_dircache_name_set(finfo);
+			__ptpfs_dircache_name_add(ptpfs_data, n);
+		}
+	}
+	return 0;
+}
+
+//	keeps the handle order of the other entries
+static void ptpfs_dircache_remove(struct ptpfs_inode_data *ptpfs_data, int x)
+{
+	struct ptpfs_dirinode_fileinfo *finfo = ptpfs_data->data.dircache.file_info;
+
+	kfree(finfo[x].filename);
+	ptpfs_data->data.dircache.num_files--;
+	memmove(&finfo[x], &finfo[x+1], (ptpfs_data->data.dircache.num_files-x)*sizeof(struct ptpfs_dirinode_fileinfo));
+	ptpfs_dircache_name_drop(ptpfs_data);		// indexes moved, rebuilt on the next lookup
+}
+
+static int ptpfs_object_dtype(struct ptp_object_info *object)
+{
+	if (object->object_format==PTP_OFC_Association && object->association_type == PTP_AT_GenericFolder)
+		return DT_DIR;
+	return DT_REG;
+}
+
+//	is this dircache the one listing the object ?
+static int ptpfs_dircache_is_parent(struct ptpfs_inode_data *ptpfs_data, struct ptp_object_info *object)
+{
+	if (object->parent_object == 0)
+		return ptpfs_data->type == INO_TYPE_STGDIR && ptpfs_data->inode->i_ino == object->storage_id;
+	return ptpfs_data->type == INO_TYPE_DIR && ptpfs_data->inode->i_ino == object->parent_object;
+}
+
+static void ptpfs_event_drop_all(struct ptpfs_sb_info *sb_info)
+{
+	struct ptpfs_inode_data *d, *n;
+
+	ptpfs_oi_clear(sb_info);
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	list_for_each_entry_safe(d, n, &sb_info->dir_list, dir_list)
+	{
+		d->inode->i_version++;
+		ptpfs_free_inode_data(d->inode);
 	}
-	for (x = 0; x < ptpfs_data->data.dircache.num_files; x++)
+}
+
+//	ObjectAdded and ObjectInfoChanged: put the entry where the device says it is now
+//	and refresh ino (if not NULL) from the new object info
+static void ptpfs_event_object_changed(struct ptpfs_sb_info *sb_info, __u32 handle, struct inode *ino)
+{
+	struct ptpfs_inode_data *d;
+	struct ptp_object_info object;
+	char *name;
+	int x;
+
+	ptpfs_oi_forget(sb_info, handle);
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	memset(&object,0,sizeof(object));
+	if (ptp_getobjectinfo(sb_info, handle, &object) != PTP_RC_OK)
+		return;
+	ptpfs_oi_insert(sb_info, handle, &object);
+
+	list_for_each_entry(d, &sb_info->dir_list, dir_list)
 	{
-		if (!memcmp(ptpfs_data->data.dircache.file_info[x].filename,dentry->d_name.name,dentry->d_name.len))
+		x = ptpfs_dircache_find(d, handle);
+		if (!ptpfs_dircache_is_parent(d, &object))
 		{
-			struct ptp_object_info object;
-			memset(&object,0,sizeof(object)); 
-			if (ptp_getobjectinfo(PTPFSSB(dir->i_sb),ptpfs_data->data.dircache.file_info[x].handle,&object)!=PTP_RC_OK)
+			if (x >= 0)		// moved away
 			{
-				d_add(dentry, NULL);
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-				return NULL;
-			}			
+				ptpfs_dircache_remove(d, x);
+				d->inode->i_version++;
+			}
+			continue;
+		}
+		if (object.filename == NULL)	// empty name, or it could not be allocated
+			continue;
+
+		name = kmalloc(strlen(object.filename)+1, GFP_KERNEL);
+		if (name == NULL)
+			continue;
+		strcpy(name, object.filename);
+		if (x >= 0)
+		{
+			kfree(d->data.dircache.file_info[x].filename);
+			d->data.dircache.file_info[x].filename = name;
+			d->data.dircache.file_info[x].mode = ptpfs_object_dtype(&object);
+		}
+		else if (ptpfs_dircache_add(d, name, handle, ptpfs_object_dtype(&object)))
+		{
+			kfree(name);
+		}
+		d->inode->i_version++;
+	}
+	if (ino)
+		ptpfs_refresh_inode(ino, &object);
+	ptp_free_object_info(&object);
+}
+
+static void ptpfs_event_object_removed(struct ptpfs_sb_info *sb_info, __u32 handle)
+{
+	struct ptpfs_inode_data *d, *n;
+	int x;
+
+	ptpfs_oi_forget(sb_info, handle);
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	list_for_each_entry_safe(d, n, &sb_info->dir_list, dir_list)
+	{
+		if (d->type == INO_TYPE_DIR && d->inode->i_ino == handle)
+		{
+			ptpfs_free_inode_data(d->inode);	// the folder itself
+			continue;
+		}
+		x = ptpfs_dircache_find(d, handle);
+		if (x >= 0)
+		{
+			ptpfs_dircache_remove(d, x);
+			d->inode->i_version++;
+		}
+	}
+}
+
+static void ptpfs_event_store_removed(struct ptpfs_sb_info *sb_info, __u32 storage)
+{
+	struct ptpfs_inode_data *d, *n;
+
+	ptpfs_oi_clear(sb_info);
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	list_for_each_entry_safe(d, n, &sb_info->dir_list, dir_list)
+	{
+		if (d->storage == storage || (d->type == INO_TYPE_STGDIR && d->inode->i_ino == storage))
+			ptpfs_free_inode_data(d->inode);
+	}
+}
+
+/*
+ * ptpfs_event_work:
+ * handle the events queued by the interrupt URB.  Directory caches that are
+ * loaded are patched in place, so a new shot shows up without re-listing
+ * the folder.
+ */
+void ptpfs_event_work(void *data)
+{
+	struct ptpfs_sb_info *sb_info = data;
+	struct ptp_event ev;
+	struct inode *ino;
+	int ret;
+	int flag = 21;	// ptpfs_event_work
+
+	while ((ret = ptp_event_get(sb_info, &ev)) != 0)
+	{
+		ptpfs_passport_get(sb_info, flag);
+
+		ino = NULL;
+		if (ret < 0)
+			ev.code = PTP_EC_DeviceReset;	// lost events, forget every dircache
+		switch (ev.code)
+		{
+			case PTP_EC_ObjectInfoChanged:
+				ino = ilookup(sb_info->sb, ev.param1);
+				// fall through
+			case PTP_EC_ObjectAdded:
+				ptpfs_event_object_changed(sb_info, ev.param1, ino);
+				break;
+			case PTP_EC_ObjectRemoved:
+				ino = ilookup(sb_info->sb, ev.param1);
+				if (ino)
+					ino->i_nlink = 0;
+				ptpfs_event_object_removed(sb_info, ev.param1);
+				break;
+			case PTP_EC_StoreRemoved:
+				ptpfs_event_store_removed(sb_info, ev.param1);
+				// fall through
+			case PTP_EC_StoreAdded:
+				ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+				down(&sb_info->storage_sem);
+				ptpfs_storage_forget(sb_info);
+				up(&sb_info->storage_sem);
+				sb_info->sb->s_root->d_inode->i_version++;
+				break;
+			case PTP_EC_DeviceReset:
+				down(&sb_info->storage_sem);
+				ptpfs_storage_forget(sb_info);
+				up(&sb_info->storage_sem);
+				ptpfs_event_drop_all(sb_info);
+				break;
+		}
+
+		ptpfs_passport_put(sb_info);
+
+		// iput takes the passport in ptpfs_put_inode
+		if (ino)
+			iput(ino);
+	}
+}
+//=========================================================================
+
+
+//=========================================================================
+//	metadata crawler
+//
+//	Walks every storage after mount and fills the ObjectInfo cache, so the
+//	first ls -R only pays one GetObjectHandles per folder.  It runs at nice
+//	19 and takes the passport for one transaction at a time, only when
+//	nobody else holds it.
+//=========================================================================
+struct ptpfs_crawl_entry
+{
+	__u32 storage;
+	__u32 handle;					// 0 : root of the storage
+};
+
+struct ptpfs_crawl_stack
+{
+	struct ptpfs_crawl_entry *e;
+	int n;
+	int max;
+};
+
+static int ptpfs_crawl_push(struct ptpfs_crawl_stack *st, __u32 storage, __u32 handle)
+{
+	struct ptpfs_crawl_entry *e;
+
+	if (st->n == st->max)
+	{
+		int max = st->max ? st->max*2 : 64;
+
+		e = (struct ptpfs_crawl_entry *)kmalloc(max*sizeof(struct ptpfs_crawl_entry), GFP_KERNEL);
+		if (e == NULL)
+			return -ENOMEM;
+		if (st->e)
+		{
+			memcpy(e, st->e, st->n*sizeof(struct ptpfs_crawl_entry));
+			kfree(st->e);
+		}
+		st->e = e;
+		st->max = max;
+	}
+	st->e[st->n].storage = storage;
+	st->e[st->n].handle = handle;
+	st->n++;
+	return 0;
+}
+
+/*
+ * wait for an idle device and take the passport, 0 when asked to stop.
+ * Foreground callers still sleeping on passport_wait go first, they would
+ * lose the race for a passport the crawler just gave back.
+ */
+static int ptpfs_crawl_wait(struct ptpfs_sb_info *sb_info)
+{
+	int flag = 23;	// ptpfs_crawl
+
+	while (!kthread_should_stop())
+	{
+		if (!waitqueue_active(&sb_info->passport_wait) && ptpfs_passport_tryget(sb_info, flag))
+		{
+			if (!ptpfs_bus_busy(sb_info))
+				return 1;
+			ptpfs_passport_put(sb_info);
+		}
+		msleep_interruptible(PTPFS_CRAWL_BACKOFF_MS);
+	}
+	return 0;
+}
+
+static void ptpfs_crawl_done(struct ptpfs_sb_info *sb_info)
+{
+	ptpfs_passport_put(sb_info);
+	cond_resched();
+}
+
+//	one GetObjectPropList for the whole folder
+static int ptpfs_crawl_proplist(struct ptpfs_sb_info *sb_info, struct ptpfs_crawl_stack *st,
+                                struct ptpfs_crawl_entry *dir)
+{
+	struct ptp_crawl_progress *progress = &sb_info->usb_device->crawl;
+	struct ptp_object_list list;
+	struct ptp_object_info *object;
+	__u32 x;
+	__u16 ret;
+
+	if (!ptpfs_crawl_wait(sb_info))
+		return -EINTR;
+	memset(&list,0,sizeof(list));
+	ret = ptp_getobjectproplist(sb_info, dir->handle, 1, &list);
+	ptpfs_crawl_done(sb_info);
+	if (ret != PTP_RC_OK)
+		return -EIO;
+
+	for (x = 0; x < list.n; x++)
+	{
+		object = &list.objects[x];
+		if (list.handles[x] == dir->handle)
+			continue;
+		ptpfs_oi_insert(sb_info, list.handles[x], object);
+		progress->objects++;
+		// handle 0 lists the root of every storage
+		if (object->storage_id != dir->storage)
+			continue;
+		if (ptpfs_object_dtype(object) == DT_DIR && !ptpfs_crawl_push(st, dir->storage, list.handles[x]))
+			progress->pending++;
+	}
+	ptp_free_object_list(&list);
+	return 0;
+}
+
+//	GetObjectHandles, then a GetObjectInfo per child that is not cached yet
+static int ptpfs_crawl_handles(struct ptpfs_sb_info *sb_info, struct ptpfs_crawl_stack *st,
+                               struct ptpfs_crawl_entry *dir)
+{
+	struct ptp_crawl_progress *progress = &sb_info->usb_device->crawl;
+	struct ptp_object_handles objects;
+	struct ptp_object_info object;
+	__u32 x;
+	__u16 ret;
+
+	if (!ptpfs_crawl_wait(sb_info))
+		return -EINTR;
+	objects.n = 0;
+	objects.handles = NULL;
+	ret = ptp_getobjecthandles(sb_info, dir->storage, 0x000000, dir->handle ? dir->handle : 0xffffffff, &objects);
+	ptpfs_crawl_done(sb_info);
+	if (ret != PTP_RC_OK)
+		return -EIO;
+
+	for (x = 0; x < objects.n; x++)
+	{
+		if (!ptpfs_crawl_wait(sb_info))
+		{
+			ptp_free_object_handles(&objects);
+			return -EINTR;
+		}
+		memset(&object,0,sizeof(object));
+		ret = ptpfs_getobjectinfo(sb_info, objects.handles[x], &object);
+		ptpfs_crawl_done(sb_info);
+		if (ret != PTP_RC_OK)
+		{
+			progress->errors++;
+			continue;
+		}
+		progress->objects++;
+		if (ptpfs_object_dtype(&object) == DT_DIR && !ptpfs_crawl_push(st, dir->storage, objects.handles[x]))
+			progress->pending++;
+		ptp_free_object_info(&object);
+	}
+	ptp_free_object_handles(&objects);
+	return 0;
+}
+
+static int ptpfs_crawl(void *data)
+{
+	struct ptpfs_sb_info *sb_info = data;
+	struct ptp_crawl_progress *progress = &sb_info->usb_device->crawl;
+	struct ptpfs_crawl_stack st;
+	struct ptpfs_crawl_entry dir;
+	int proplist;
+	int ret = 0;
+	int x;
+	int n;
+
+	set_user_nice(current, 19);
+	memset(&st,0,sizeof(st));
+	memset(progress,0,sizeof(*progress));
+	progress->state = PTP_CRAWL_RUNNING;
+	proplist = ptp_operation_issupported(sb_info, PTP_OC_MTP_GetObjectPropList);
+
+	if (ptpfs_crawl_wait(sb_info))
+	{
+		down(&sb_info->storage_sem);
+		n = ptpfs_storage_get(sb_info, 0);
+		for (x = 0; x < n; x++)
+		{
+			if (!ptpfs_crawl_push(&st, sb_info->storages[x].id, 0))
+				progress->pending++;
+		}
+		up(&sb_info->storage_sem);
+		ptpfs_crawl_done(sb_info);
+	}
+
+	while (st.n && !kthread_should_stop())
+	{
+		dir = st.e[--st.n];
+		progress->pending--;
+		if (proplist)
+			ret = ptpfs_crawl_proplist(sb_info, &st, &dir);
+		else
+			ret = ptpfs_crawl_handles(sb_info, &st, &dir);
+		if (ret == -EINTR)
+			break;
+		if (ret)
+			progress->errors++;
+		else
+			progress->folders++;
+	}
+	kfree(st.e);
+	progress->pending = 0;
+	progress->state = PTP_CRAWL_DONE;
+
+	// kthread_stop() must find us alive
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop())
+	{
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+int ptpfs_crawl_start(struct ptpfs_sb_info *sb_info)
+{
+	struct task_struct *task;
+
+	if (!sb_info->crawl)
+		return 0;
+	task = kthread_run(ptpfs_crawl, sb_info, "ptpfs_crawl");
+	if (IS_ERR(task))
+	{
+		printk("===== ptpfs_crawl_start error, no crawler =====\n");
+		return PTR_ERR(task);
+	}
+	sb_info->crawl_task = task;
+	return 0;
+}
+
+void ptpfs_crawl_stop(struct ptpfs_sb_info *sb_info)
+{
+	if (sb_info->crawl_task == NULL)
+		return;
+	kthread_stop(sb_info->crawl_task);
+	sb_info->crawl_task = NULL;
+	sb_info->usb_device->crawl.state = PTP_CRAWL_IDLE;
+}
+
+
+static int ptpfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
+{
+
+	//printk(KERN_INFO "===== %s ===== \n",  __FUNCTION__);
+	int flag = 5;	// ptpfs_readdir
+	ptpfs_passport_get(PTPFSSB(filp->f_dentry->d_inode->i_sb), flag);
+
+    struct inode *inode = filp->f_dentry->d_inode;
+    struct dentry *dentry = filp->f_dentry;
+    struct ptpfs_inode_data* ptpfs_data = PTPFSINO(inode);
+    struct ptpfs_dirinode_fileinfo *finfo;
+    loff_t offset = filp->f_pos;
+    loff_t cookie;
+    ino_t ino;
+	int x;
+
+	filp->f_version = inode->i_version;
 
-			int mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
-			if (object.object_format==PTP_OFC_Association && object.association_type == PTP_AT_GenericFolder)
+	switch (offset)
+	{
+		case 0:
+			if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) //add "." and ".." to dirent
+			{				
+       		break;
+			}			
+			offset++;
+			filp->f_pos++;
+	        // fall through 
+		case 1:
+			spin_lock(&dcache_lock);
+			ino = dentry->d_parent->d_inode->i_ino;
+			spin_unlock(&dcache_lock);  					//same as parent_ino
+//			ino = parent_ino(dentry); 
+			if (filldir(dirent, "..", 2, offset, ino, DT_DIR) < 0)
+			{
+				break;
+			}
+			filp->f_pos++;
+			offset++;
+		default:
+			if (!ptpfs_get_dir_data(inode))
 			{
-				mode |= S_IFDIR; 
+	ptpfs_passport_put(PTPFSSB(filp->f_dentry->d_inode->i_sb));
+				return filp->f_pos;
 			}
-			else
+			// f_pos is the cookie of the next entry, the dircache stays for the next call
+			for (x = ptpfs_dircache_seek(ptpfs_data, filp->f_pos); x < ptpfs_data->data.dircache.num_files; x++)
 			{
-				mode |= S_IFREG;
+				finfo = &ptpfs_data->data.dircache.file_info[x];
+				cookie = PTPFS_DIR_COOKIE(finfo->handle);
+				if (filldir(dirent, finfo->filename, strlen(finfo->filename), cookie, finfo->handle, finfo->mode) < 0)
+					break;
+				filp->f_pos = cookie + 1;
 			}
-			struct inode *newi = ptpfs_get_inode(dir->i_sb, mode  , 0,ptpfs_data->data.dircache.file_info[x].handle);
-			PTPFSINO(newi)->parent = dir;
-			ptpfs_set_inode_info(newi,&object);
-			//atomic_inc(&newi->i_count);    // New dentry reference 
-			d_add(dentry, newi);
-			ptp_free_object_info(&object); //kfree(object->filename) & kfree(object->keywords) 
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-			return NULL;
+	ptpfs_passport_put(PTPFSSB(filp->f_dentry->d_inode->i_sb));
+			return filp->f_pos;
+	}
+	ptpfs_passport_put(PTPFSSB(filp->f_dentry->d_inode->i_sb));
+	return filp->f_pos;
+}
+
+/*
+ * ptpfs_d_revalidate:
+ * d_time is the i_version of the parent when the dentry was looked up.
+ * create, unlink and device events bump it; only then is the name checked
+ * against the dircache again.
+ */
+static int ptpfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+	struct ptpfs_inode_data* ptpfs_data = PTPFSINO(dir);
+	int flag = 15;	// ptpfs_lookup
+	int valid = 0;
+	int x;
+
+	if (dentry->d_time == dir->i_version)
+		return 1;
+
+	ptpfs_passport_get(PTPFSSB(dir->i_sb), flag);
+	if (ptpfs_get_dir_data(dir))
+	{
+		x = ptpfs_dircache_lookup(ptpfs_data, dentry->d_name.name, dentry->d_name.len);
+		if (dentry->d_inode)
+			valid = x >= 0 && ptpfs_data->data.dircache.file_info[x].handle == dentry->d_inode->i_ino;
+		else
+			valid = x < 0;
+	}
+	if (valid)
+		dentry->d_time = dir->i_version;
+	ptpfs_passport_put(PTPFSSB(dir->i_sb));
+	return valid;
+}
+
+struct dentry_operations ptpfs_dentry_operations = {
+	d_revalidate:	ptpfs_d_revalidate,
+};
+
+static struct dentry * ptpfs_lookup(struct inode *dir, struct dentry *dentry,struct nameidata *nd)
+{
+    
+    //printk(KERN_INFO "===== %s =====\n",  __FUNCTION__);
+
+	int flag = 15;	// ptpfs_lookup
+	ptpfs_passport_get(PTPFSSB(dir->i_sb), flag);
+
+	int x;
+    struct ptpfs_inode_data* ptpfs_data = PTPFSINO(dir);
+
+	// negative dentries are cached too, ptpfs_d_revalidate() checks both kinds
+	dentry->d_op = &ptpfs_dentry_operations;
+	dentry->d_time = dir->i_version;
+
+	if (!ptpfs_get_dir_data(dir))
+	{
+	ptpfs_passport_put(PTPFSSB(dir->i_sb));
+		return ERR_PTR(-EIO);
+	}
+	if (ptpfs_data->type != INO_TYPE_DIR  && ptpfs_data->type != INO_TYPE_STGDIR)
+	{
+		d_add(dentry, NULL);
+	ptpfs_passport_put(PTPFSSB(dir->i_sb));
+		return NULL;
+	}
+	x = ptpfs_dircache_lookup(ptpfs_data, dentry->d_name.name, dentry->d_name.len);
+	if (x >= 0)
+	{
+		struct ptp_object_info object;
+		memset(&object,0,sizeof(object)); 
+		if (ptpfs_getobjectinfo(PTPFSSB(dir->i_sb),ptpfs_data->data.dircache.file_info[x].handle,&object)!=PTP_RC_OK)
+		{
+		ptpfs_passport_put(PTPFSSB(dir->i_sb));
+			return ERR_PTR(-EIO);
+		}			
+
+		struct inode *newi = ptpfs_iget(dir->i_sb, ptpfs_data->data.dircache.file_info[x].handle, &object);
+		if (newi == NULL)
+		{
+			ptp_free_object_info(&object);
+		ptpfs_passport_put(PTPFSSB(dir->i_sb));
+			return ERR_PTR(-ENOMEM);
 		}
+		PTPFSINO(newi)->parent = dir;
+		d_add(dentry, newi);
+		ptp_free_object_info(&object); //kfree(object->filename) & kfree(object->keywords) 
+		ptpfs_passport_put(PTPFSSB(dir->i_sb));
+		return NULL;
 	}
 	d_add(dentry, NULL);
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
+	ptpfs_passport_put(PTPFSSB(dir->i_sb));
 	return NULL;
 
 }
@@ -323,26 +1394,25 @@ static int offset_read(struct ptpfs_sb_info *sb_info, struct ptp_data_buffer *bu
 
 	for ( k = 1; k <= MAX_SEG_NUM-1; k++ ){
 		if ( buf->blocks[k].block_size != 0 && k != buf->record_blocks) {
-			kfree(buf->blocks[k].block);
+			ptp_seg_free(buf->blocks[k].block);
 			buf->blocks[k].block_size = 0;
 		}			
 	}
 
 //	printk("offset_read start : %d, end : %d\n", start, end);
 	for (x = start; x <= end; x++ ){			
-		memset(buf->blocks[r].block,0,MAX_SEG_SIZE);
 		if (buf->blocks[r].block == NULL){
 			printk("==== release function ! kmalloc error! ====\n");			
 			return 0;
 		}
-		ret=ptp_io_read(sb_info,buf->blocks[r].block,MAX_SEG_SIZE);
+		ret=ptp_stream_read(sb_info,buf->blocks[r].block,sb_info->seg_size);
 		if (ret < 0){
-			printk("==== release function ! ptp_io_read error ! ====\n");
+			printk("==== release function ! ptp_stream_read error ! ====\n");
 			return 0;
 		}
 
 		if ( (reserve == 0) && (x == buf->num_seg-1) ) 
-			kfree(buf->blocks[r].block);
+			ptp_seg_free(buf->blocks[r].block);
 	}
 	return 1;
 }
@@ -352,23 +1422,7 @@ static int ptpfs_file_readpage(struct file *filp, struct page *page)
 	int flag = 0;	// buffer IO
 	char *buffer_d = NULL;
 
-checkagain1:
-        down(&ptp_passport_mutex);
-        if(passport==PASSPORT_FREE)
-        {
-                passport=flag;
-                up(&ptp_passport_mutex);
-        }
-        else if(passport!=flag)
-        {
-                up(&ptp_passport_mutex);
-                msleep(1000);
-//printk("david1222: %s(%d) goto checkagain1 filp=%p pass=%d\n",__func__,__LINE__,filp,passport);
-                goto checkagain1;
-        }
-        else
-                up(&ptp_passport_mutex);
-
+	ptpfs_passport_get(PTPFSSB(filp->f_dentry->d_sb), flag);
 
 	return ptpfs_file_readpages(filp, page, NULL, 0, flag);
 }
@@ -386,23 +1440,10 @@ static ssize_t ptp_direct_IO(int rw, struct kiocb *iocb,
 
 		int err=0;
 
-checkagain:
-        down(&ptp_passport_mutex);
-        if(passport==PASSPORT_FREE)
-        {
-                passport=flag;
-                up(&ptp_passport_mutex);
-        }
-        else if(passport!=flag)
-        {
-                up(&ptp_passport_mutex);
-                msleep(1000);
-//printk("david1222: %s(%d) goto checkagain inode=%p pass=%d\n",__func__,__LINE__,inode,passport);
-                goto checkagain;
-        }
-        else
-                up(&ptp_passport_mutex);
-
+		// writes go through the page cache, see ptpfs_upload_flush()
+		if (rw == WRITE)
+			return -EINVAL;
+		ptpfs_passport_get(PTPFSSB(inode->i_sb), flag);
 
 		err = !access_ok(VERIFY_READ, (void __user*)iov->iov_base, iov->iov_len);
 		if (err)
@@ -436,46 +1477,115 @@ checkagain:
 		return total;
 }
 
-static int ptpfs_file_readpages
-(struct file *filp, struct page *page, char *buffer_d, int offset_d,int flag)
+//	the next transaction drains the running GetObject stream, forget the filps' pointers to it
+static void ptpfs_forget_stream(struct ptpfs_sb_info *sb_info, struct file *filp)
 {
-	//	printk(KERN_INFO "%s\n",  __FUNCTION__);
+	if (sb_info->read_condition != 1)
+		return;
+	if (filp->private_data == sb_info->private_data)
+		filp->private_data = NULL;
+	if (sb_info->filp_temp && sb_info->filp_temp->private_data == sb_info->private_data)
+		sb_info->filp_temp->private_data = NULL;
+	sb_info->filp_temp = NULL;
+}
 
-	struct ptpfs_sb_info *sb_info = PTPFSSB(filp->f_dentry->d_sb);
-	int ret = -EFAULT;
-	int offset_back = 0;
-	int read_over = 0; // if this is a new open file or just seek back, we read the transmitting data first.
-	int offset_same = 0;
+//	GetPartialObject takes a 32 bit offset, pages past this go through GetObject
+#define PTPFS_PARTIAL_LIMIT	0xffffffffULL
+
+//	is this page somewhere else than the next one of the filp's GetObject stream ?
+static int ptpfs_is_random(struct file *filp, loff_t pos)
+{
+	struct ptp_data_buffer *data = filp->private_data;
+
+	if (!data)
+		return pos != 0;
+	return pos < data->offset || pos > data->offset + PAGE_SIZE;
+}
 
-	int offset;
 /*
-checkagain:
-	down(&ptp_passport_mutex);
-	if(passport==PASSPORT_FREE)
+ * Serve one page with GetPartialObject.  A seek no longer drains the stream
+ * and restarts GetObject from byte 0, it costs one transaction of PAGE_SIZE.
+ */
+static int ptpfs_read_partial(struct file *filp, struct page *page, char *buffer_d, loff_t offset, int flag)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct ptpfs_sb_info *sb_info = PTPFSSB(inode->i_sb);
+	struct ptp_data_buffer data;
+	int size = min_t(loff_t, inode->i_size - offset, PAGE_SIZE);
+	char *buffer;
+	int pos = 0;
+	int x;
+
+	memset(&data,0,sizeof(data));
+	ptpfs_forget_stream(sb_info, filp);
+	if (ptp_getpartialobject(sb_info, inode->i_ino, (__u32)offset, size, &data) != PTP_RC_OK)
+	{
+		printk(KERN_INFO "ptp_getpartialobject error !\n");
+		if (data.blocks)
+			ptp_free_data_buffer(&data);
+		if (flag == 0)
+		{
+			SetPageError(page);
+			unlock_page(page);
+		}
+		return -EIO;
+	}
+
+	if (flag == 0)
+		buffer = kmap_atomic(page,KM_USER0);
+	else
+		buffer = buffer_d;
+	for (x = 0; x < data.num_blocks && pos < size; x++)
 	{
-		passport=flag;
-		up(&ptp_passport_mutex);
+		int toCopy = min(size - pos, data.blocks[x].block_size);
+		memcpy(&buffer[pos], data.blocks[x].block, toCopy);
+		pos += toCopy;
 	}
-	else if(passport!=flag)
+	ptp_free_data_buffer(&data);
+
+	if (flag == 0)
 	{
-		up(&ptp_passport_mutex);
-		msleep(1000);
-		goto checkagain;
+		memset(&buffer[pos], 0, PAGE_SIZE - pos);
+		kunmap_atomic(buffer, KM_USER0);
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+		unlock_page(page);
 	}
-	else
-		up(&ptp_passport_mutex);
-*/	
+	return 0;
+}
+
+static int ptpfs_file_readpages
+(struct file *filp, struct page *page, char *buffer_d, int offset_d,int flag)
+{
+	//	printk(KERN_INFO "%s\n",  __FUNCTION__);
+
+	struct ptpfs_sb_info *sb_info = PTPFSSB(filp->f_dentry->d_sb);
+	int ret = -EFAULT;
+	int offset_back = 0;
+	int read_over = 0; // if this is a new open file or just seek back, we read the transmitting data first.
+	int offset_same = 0;
+
+	int offset;
+	loff_t pos;
 	if (flag == 0){
 		offset = page->index << PAGE_CACHE_SHIFT;		// PAGE_CACHE_SHIFT = 4KB	
+		pos = (loff_t)page->index << PAGE_CACHE_SHIFT;
 		if (!PageLocked(page))
 			PAGE_BUG(page);
 	}
 	else{
 		offset = offset_d;
+		pos = offset_d;
 	}
 	struct inode *inode;	
 	inode = filp->f_dentry->d_inode;
 
+	/*	not the next page of this filp's stream: read just this page instead of
+		draining the stream and discarding data up to the target offset */
+	if (ptp_operation_issupported(sb_info, PTP_OC_GetPartialObject) &&
+	    pos + PAGE_SIZE <= PTPFS_PARTIAL_LIMIT && ptpfs_is_random(filp, pos))
+		return ptpfs_read_partial(filp, page, buffer_d, pos, flag);
+
 	if (sb_info->error_transmit == 1)
 	{
 		printk("go error\n");
@@ -519,31 +1629,11 @@ checkagain:
 
 
 	if ( read_over ){
-		struct ptp_data_buffer *buf = sb_info->private_data;
-		int x;
-		int k;
-		int r = buf->record_blocks;				
-
-		if (!offset_read(sb_info, buf, buf->num_blocks+1, buf->num_seg, 0)){
-			printk("offset_read error !!\n");
+		// cancel the stream (drain it if the device rejects the cancel)
+		if (ptp_stream_abort(sb_info) < 0){
+			printk("ptp_stream_abort error !!\n");
 			goto error;
 		}
-		sb_info->read_condition = 2;
-		if (buf->num_blocks < buf->num_seg){	//if they are the same, response was already read.
-			down(&sb_info->usb_device->sem);
-			ret = ptp_usb_getresp(buf->sb_temp, buf->ptp_temp);
-			if(ret < 0){
-				printk(KERN_INFO "can't get response !!!!!\n");
-				goto error;
-			}
-			up (&sb_info->usb_device->sem);
-		}
-
-		kfree(buf->ptp_temp);			
-		kfree(buf->blocks);
-		kfree(buf);
-		buf = NULL;		
-		sb_info->private_data = NULL;
 		if (read_over == 1)		
 			filp->private_data = NULL;
 	}
@@ -559,13 +1649,13 @@ checkagain:
 			int seek_block;
 			int count_temp = 0;	
 			int i;
-			if( (offset-PTP_USB_BULK_PAYLOAD_LEN) % MAX_SEG_SIZE == 0 ){
-				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/MAX_SEG_SIZE+1;
-				count_temp = PTP_USB_BULK_PAYLOAD_LEN + (seek_block-1)*MAX_SEG_SIZE;
+			if( (offset-PTP_USB_BULK_PAYLOAD_LEN) % sb_info->seg_size == 0 ){
+				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/sb_info->seg_size+1;
+				count_temp = PTP_USB_BULK_PAYLOAD_LEN + (seek_block-1)*sb_info->seg_size;
 			}
 			else{
-				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/MAX_SEG_SIZE+2;
-				count_temp = PTP_USB_BULK_PAYLOAD_LEN + (seek_block-2)*MAX_SEG_SIZE;
+				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/sb_info->seg_size+2;
+				count_temp = PTP_USB_BULK_PAYLOAD_LEN + (seek_block-2)*sb_info->seg_size;
 			}
 
 			if (!offset_read(sb_info, buf2, buf2->num_blocks+1, seek_block, 1)){
@@ -631,15 +1721,15 @@ checkagain:
 	{
 			struct ptp_data_buffer *buf3 = (struct ptp_data_buffer *)(filp->private_data);
 			int seek_block;	// seek_block indicates which block we have to find, not a range
-			int remainder = (offset-PTP_USB_BULK_PAYLOAD_LEN) % MAX_SEG_SIZE;
+			int remainder = (offset-PTP_USB_BULK_PAYLOAD_LEN) % sb_info->seg_size;
 			
 			if( remainder == 0 ){
-				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/MAX_SEG_SIZE+1;	// +1 means include block[0]
+				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/sb_info->seg_size+1;	// +1 means include block[0]
 			}
 			else {
-				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/MAX_SEG_SIZE+2;	// +2 means include block[0] and remainder.
+				seek_block = (offset-PTP_USB_BULK_PAYLOAD_LEN)/sb_info->seg_size+2;	// +2 means include block[0] and remainder.
 			}
-			kfree(buf3->blocks[0].block);
+			ptp_seg_free(buf3->blocks[0].block);
 			buf3->blocks[0].block_size = 0;
 
 			int i;
@@ -647,20 +1737,19 @@ checkagain:
 			int r = buf3->record_blocks;
 			// block[0] was read in ptp_getobject
 
-			buf3->blocks[r].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-			buf3->blocks[r].block_size = MAX_SEG_SIZE;
+			buf3->blocks[r].block = ptp_seg_alloc(sb_info);
+			buf3->blocks[r].block_size = sb_info->seg_size;
 
 
 			int count_temp = PTP_USB_BULK_PAYLOAD_LEN;
 			for (i = 1; i <= seek_block; i++ )
 			{	
-				memset(buf3->blocks[r].block,0,MAX_SEG_SIZE);
-				ret=ptp_io_read(sb_info,buf3->blocks[r].block,MAX_SEG_SIZE);
+				ret=ptp_stream_read(sb_info,buf3->blocks[r].block,sb_info->seg_size);
 				if(ret < 0)
 					goto error;
 			
 				if (i != seek_block){
-					count_temp += MAX_SEG_SIZE;
+					count_temp += sb_info->seg_size;
 				}
 			}
 			sb_info->read_condition = 1;
@@ -691,14 +1780,13 @@ checkagain:
 
     /* read the contents of the file from the server into the page */
 	int block = data->record_blocks;  
-	data->offset = offset; 
+	data->offset = pos;
 
 	//when block = 0, to read next block first 
 	if(block == 0)
 	{
-		data->blocks[1].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-		data->blocks[1].block_size = MAX_SEG_SIZE;
-		memset(data->blocks[1].block,0,MAX_SEG_SIZE);
+		data->blocks[1].block = ptp_seg_alloc(sb_info);
+		data->blocks[1].block_size = sb_info->seg_size;
 
 		if (data->blocks[1].block == NULL)
 		{
@@ -706,7 +1794,7 @@ checkagain:
 			ret = -EFAULT;
 			goto error;
 		}
-		ret=ptp_io_read(PTPFSSB(inode->i_sb),data->blocks[1].block,MAX_SEG_SIZE);
+		ret=ptp_stream_read(PTPFSSB(inode->i_sb),data->blocks[1].block,sb_info->seg_size);
 		if (ret < 0)
 		{
 			printk("===== ERROR_2 =====\n");
@@ -728,12 +1816,11 @@ checkagain:
 	if (toCopy > 0)	
 	{		
 		if (offset_same == 1)
-			memcpy(buffer,&sb_info->buffer,toCopy);
+			memcpy(buffer,sb_info->buffer,toCopy);
 		else
 		{
-			memset(&sb_info->buffer, 0, sizeof((int)PAGE_SIZE));
 			memcpy(buffer,&data->blocks[block].block[offset],toCopy);
-			memcpy(&sb_info->buffer[0],data->blocks[block].block,toCopy);	
+			memcpy(sb_info->buffer,buffer,toCopy);	
 		}
 	}
 
@@ -754,15 +1841,14 @@ checkagain:
 
 	if(data->blocks[block_next].block_size == 0 && data->num_blocks < data->num_seg) //not yet read next block
 	{
-		data->blocks[block_next].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-		data->blocks[block_next].block_size = MAX_SEG_SIZE;
-		memset(data->blocks[block_next].block,0,MAX_SEG_SIZE);
+		data->blocks[block_next].block = ptp_seg_alloc(sb_info);
+		data->blocks[block_next].block_size = sb_info->seg_size;
 		if (data->blocks[block_next].block == NULL)
 		{
 			ret = -EFAULT;
 			goto error;
 		}
-		ret=ptp_io_read(PTPFSSB(inode->i_sb),data->blocks[block_next].block,MAX_SEG_SIZE);
+		ret=ptp_stream_read(PTPFSSB(inode->i_sb),data->blocks[block_next].block,sb_info->seg_size);
 		if (ret < 0)
 		{
 			goto error;
@@ -791,7 +1877,7 @@ checkagain:
 		if (offset_same == 0)
 		{
 			memcpy(&buffer[pos],data->blocks[block].block,toCopy);
-			memcpy(&sb_info->buffer[pos],data->blocks[block].block,toCopy);	
+			memcpy(&sb_info->buffer[pos],&buffer[pos],toCopy);	
 		}
 		data->record_blocks = block;
 
@@ -817,7 +1903,7 @@ checkagain:
 	}
 	if(cross_block != -1)
 	{
-		kfree(data->blocks[cross_block].block);
+		ptp_seg_free(data->blocks[cross_block].block);
 		data->count += data->blocks[cross_block].block_size;
 		data->blocks[cross_block].block_size = 0;
 	}
@@ -842,6 +1928,7 @@ checkagain:
 
     error:
 	//sb_info->error_transmit = 1;
+	ptp_ring_stop(sb_info);
 	if (flag == 0)
 	{
 		SetPageError(page);
@@ -851,304 +1938,1061 @@ checkagain:
 } 
 
 
-static ssize_t ptpfs_write(struct file *filp, const char *buf, size_t count, loff_t *ppos)
+/*
+ * Read a run of locked, consecutive page cache pages with GetPartialObject.
+ * The data phase is received straight into the pages, the container header
+ * goes to a small buffer in ptp_getpartialobject_pages.  Pages that can't be
+ * served that way go through ptpfs_file_readpage.
+ */
+static void ptpfs_read_run(struct file *filp, struct page **run, int nr_run)
 {
-    //printk(KERN_INFO "%s   pos: %d   count:%d\n",  __FUNCTION__,(int)*ppos,count);
-    struct ptp_data_buffer *data=(struct ptp_data_buffer*)filp->private_data;
-
-    struct ptp_block *blocks = kmalloc(sizeof(struct ptp_block)*(data->num_blocks+1), GFP_KERNEL);
-
-    if (data->blocks) memcpy(blocks,data->blocks,sizeof(struct ptp_block)*data->num_blocks);
-    blocks[data->num_blocks].block_size=count;
-    blocks[data->num_blocks].block = kmalloc(count, GFP_KERNEL);
-    memcpy(blocks[data->num_blocks].block,buf,count);
-    if (data->blocks) kfree(data->blocks);
-    data->blocks = blocks;
-    data->num_blocks++;
-    *ppos += count;
-    return count;
-}
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct ptpfs_sb_info *sb_info = PTPFSSB(inode->i_sb);
+	loff_t pos = (loff_t)run[0]->index << PAGE_CACHE_SHIFT;
+	__u32 offset;
+	__u32 length;
+	__u32 got = 0;
+	int x;
 
+	if (!ptp_operation_issupported(sb_info, PTP_OC_GetPartialObject) || pos >= inode->i_size ||
+	    pos + PAGE_CACHE_SIZE > PTPFS_PARTIAL_LIMIT)
+		goto fallback;
+	offset = (__u32)pos;
 
-static int ptpfs_release(struct inode *ino, struct file *filp)
-{
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
-    //printk(KERN_INFO "%s    object:%X    dcount: %d\n",  __FUNCTION__,ino->i_ino, filp->f_dentry->d_count);
-	/*
-	if (data)
+	//	the first page has no previous page to absorb the header packet, copy it
+	if (offset < ptp_pages_bias(sb_info))
 	{
-		switch (filp->f_flags & O_ACCMODE)
+		ptpfs_read_partial(filp, run[0], NULL, offset, 0);
+		run++;
+		nr_run--;
+		offset += PAGE_CACHE_SIZE;
+		if (nr_run == 0 || offset >= inode->i_size)
 		{
-			case O_RDWR:
-				printk("======== O_RDWR =======\n");		//read, write
-			case O_WRONLY:
-			{
-				printk("======== O_WRONLY =======\n");		//write only
-				struct ptp_object_info object;
-				memset(&object,0,sizeof(object));
-				if (ptp_getobjectinfo(PTPFSSB(ino->i_sb),ino->i_ino,&object)!=PTP_RC_OK)
-				{
-					ptp_free_data_buffer(data);
-					kfree(data);
-					return -EPERM;
-				}
-
-				ptp_deleteobject(PTPFSSB(ino->i_sb),ino->i_ino,0); //
-				int count = 0;
-				int x;
-
-				for (x = 0; x < data->num_blocks; x++)
-				{
-					count += data->blocks[x].block_size;
-				}
-
+			for (x = 0; x < nr_run; x++)
+				ptpfs_file_readpage(filp, run[x]);
+			return;
+		}
+	}
 
-                int storage = object.storage_id;
-                int parent = object.parent_object;
-                int handle = ino->i_ino;
-                object.object_compressed_size=count;
-                int ret = ptp_sendobjectinfo(PTPFSSB(ino->i_sb), &storage, &parent, &handle, &object); //
-                ret = ptp_sendobject(PTPFSSB(ino->i_sb),data,count); //
+	length = min_t(loff_t, inode->i_size - offset, (loff_t)nr_run << PAGE_CACHE_SHIFT);
+	ptpfs_forget_stream(sb_info, filp);
+	if (ptp_getpartialobject_pages(sb_info, inode->i_ino, run, nr_run, offset, length, &got) != PTP_RC_OK ||
+	    got < length)
+		goto fallback;
 
-                ino->i_size = count;
-                ino->i_mtime = CURRENT_TIME;
-                ptpfs_free_inode_data(ino);//uncache
-                ptpfs_free_inode_data(PTPFSINO(ino) -> parent);//uncache
+	for (x = 0; x < nr_run; x++)
+	{
+		__u32 filled = (x << PAGE_CACHE_SHIFT) < got ? got - (x << PAGE_CACHE_SHIFT) : 0;
 
-                //the inode number will change.  Kill this inode so next dir lookup will create a new one
-                dput(filp->f_dentry);
-                //iput(ino);
-			}
-			break;
+		if (filled < PAGE_CACHE_SIZE)
+		{
+			char *buffer = kmap_atomic(run[x], KM_USER0);
+			memset(&buffer[filled], 0, PAGE_CACHE_SIZE - filled);
+			kunmap_atomic(buffer, KM_USER0);
 		}
-	
-		if(data->get_object == 1 && data->num_blocks != 0)  //open,but not readpage
-		{	
-			printk("====== open , but not readpage ======\n");
-
-			int result ;
-			int x;
-			int ret;
-			//========================
-			for (x = 1; x < data->num_seg; x++ )
-			{				
-				if (x == 1)
-				{
-					data->blocks[1].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-					data->blocks[1].block_size = MAX_SEG_SIZE;
-				}
+		flush_dcache_page(run[x]);
+		SetPageUptodate(run[x]);
+		unlock_page(run[x]);
+	}
+	return;
 
-				data->blocks[1].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-				data->blocks[1].block_size = MAX_SEG_SIZE;
-				
-				memset(data->blocks[1].block,0,MAX_SEG_SIZE);
+	fallback:
+	for (x = 0; x < nr_run; x++)
+		ptpfs_file_readpage(filp, run[x]);
+}
 
-				if (data->blocks[1].block == NULL)
-				{
-					printk("==== release function ! kmalloc error! ====\n");
-					ptp_free_data_buffer(data);
-					return PTP_ERROR_IO;
-				}
-				ret=ptp_io_read(PTPFSSB(ino->i_sb),data->blocks[1].block,MAX_SEG_SIZE);
-				if (ret < 0)
-				{
-					printk("==== release function ! ptp_io_read error ! ====\n");
-					ptp_free_data_buffer(data);
-					return PTP_ERROR_IO;
-				}
-				
-				//data->num_blocks++;
-				if (x == data->num_seg-1) 
-					kfree(data->blocks[1].block);
-			}
+#define PTPFS_RA_MAX_PAGES	64
 
-			down(&PTPFSSB(ino->i_sb)->usb_device->sem);
-			result = ptp_usb_getresp(data->sb_temp, data->ptp_temp);
-			up (&PTPFSSB(ino->i_sb)->usb_device->sem);
-			//========================
-			printk("========= result : %x =========\n",result);
-			if(result < 0)
-				printk("can't get response !!!!!\n");
+static int ptpfs_readpages(struct file *filp, struct address_space *mapping,
+                           struct list_head *pages, unsigned nr_pages)
+{
+	int flag = 0;	// buffer IO, shares the passport with readpage
+	struct page *run[PTPFS_RA_MAX_PAGES];
+	int nr_run = 0;
+	unsigned x;
+	int y;
 
-			kfree(data->blocks[0].block);
-			kfree(data->blocks);
+	ptpfs_passport_get(PTPFSSB(filp->f_dentry->d_sb), flag);
 
-			kfree(data->ptp_temp);			
+	// the list is in reverse index order
+	for (x = 0; x < nr_pages; x++)
+	{
+		struct page *page = list_entry(pages->prev, struct page, lru);
 
-			
-		//	data->ptp_temp = NULL;
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL))
+		{
+			page_cache_release(page);
+			continue;
 		}
-		else
-			ptp_free_data_buffer(data);
-
-		kfree(data);
-		data = NULL;
+		if (nr_run && (run[nr_run-1]->index+1 != page->index || nr_run == PTPFS_RA_MAX_PAGES))
+		{
+			ptpfs_read_run(filp, run, nr_run);
+			for (y = 0; y < nr_run; y++)
+				page_cache_release(run[y]);
+			nr_run = 0;
+		}
+		run[nr_run++] = page;
+	}
+	if (nr_run)
+	{
+		ptpfs_read_run(filp, run, nr_run);
+		for (y = 0; y < nr_run; y++)
+			page_cache_release(run[y]);
 	}
-	*/
 	return 0;
 }
 
 
+//=========================================================================
+//	upload
+//
+//	PTP has no way to write into an object, so the object of a written file
+//	is replaced: SendObjectInfo with the final size, SendObject, then
+//	DeleteObject of the old one.  Writes only dirty the page cache;
+//	ptpfs_upload_flush() sends the whole file once, at fsync or close.  When ftruncate() gave the
+//	size first, writeback streams the written part of the file while the
+//	writer is still going (ptpfs_writepages()).  Every page is clean once
+//	it is sent, so a stream that fails can't start over: the file reports
+//	-EIO until it is truncated to 0.
+//=========================================================================
 
-struct mime_map
+/*
+ * ptpfs_setattr:
+ * truncate in the page cache, the object is replaced at close.  Growing a
+ * file before writing it announces the upload size.
+ */
+static int ptpfs_setattr(struct dentry *d, struct iattr *a)
 {
-    char *ext;
-    int type;
-};                    
-const struct mime_map mime_map[] = {
-    {"txt",PTP_OFC_Text},
-    {"mp3",PTP_OFC_MP3},
-    {"mpg",PTP_OFC_MPEG},
-    {"wav",PTP_OFC_WAV},
-    {"avi",PTP_OFC_AVI},
-    {"asf",PTP_OFC_ASF},
-    {"jpg",PTP_OFC_EXIF_JPEG},
-    {"tif",PTP_OFC_TIFF},
-    {"bmp",PTP_OFC_BMP},
-    {"gif",PTP_OFC_GIF},
-    {"pcd",PTP_OFC_PCD},
-    {"pct",PTP_OFC_PICT},
-    {"png",PTP_OFC_PNG},
-    {0,0},
-};
-
+	struct inode *ino = d->d_inode;
+	int error = inode_change_ok(ino, a);
 
+	if (error)
+		return error;
+	if (a->ia_valid & ATTR_SIZE)
+	{
+		if (a->ia_size != ino->i_size)
+		{
+			error = vmtruncate(ino, a->ia_size);
+			if (error)
+				return error;
+			if (a->ia_size < PTPFSINO(ino)->data.file.on_device)
+				PTPFSINO(ino)->data.file.on_device = a->ia_size;
+		}
+		PTPFSINO(ino)->data.file.size = a->ia_size;
+		PTPFSINO(ino)->data.file.dirty = 1;
+		if (a->ia_size == 0)
+			PTPFSINO(ino)->data.file.lost = 0;
+		a->ia_valid &= ~ATTR_SIZE;
+	}
+	return inode_setattr(ino, a);
+}
 
+static __u32 ptpfs_create_handle(struct inode *dir, struct qstr *name);
 
-static inline int get_format(unsigned char *filename, int l)
+static struct ptp_upload *ptpfs_upload_new(struct inode *ino)
 {
-    char buf[4];
-    int x;
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	struct ptp_upload *upload = kmalloc(sizeof(struct ptp_upload), GFP_KERNEL);
 
-	//printk(KERN_INFO "===== %s =====\n",  __FUNCTION__);
-    while (l)
-    {
-        l--;
-        if (filename[l] == '.')
-        {
-            filename = &filename[l];
-            l = 0;
-            if (strlen(filename) > 4 || strlen(filename) == 1)
-            {
-                return PTP_OFC_Undefined;
-            }
-            filename++;
-            for (x = 0; x < strlen(filename); x++)
-            {
-                buf[x] = __tolower(filename[x]);
-            }
-            buf[strlen(filename)] = 0;
-            const struct mime_map *map = mime_map;
-            while (map->ext)
-            {
-                if (!strcmp(buf,map->ext))
-                {
-                    return map->type;
-                }
-                map++;
-            }
-        }
-    }
-    return PTP_OFC_Undefined;
+	if (upload == NULL)
+		return NULL;
+	memset(upload,0,sizeof(struct ptp_upload));
+	upload->inode = ino;
+	upload->old = ino->i_ino;
+	upload->size = i_size_read(ino);
+	PTPFSINO(ino)->data.file.streamed = 0;
+	PTPFSINO(ino)->data.file.rewound = 0;
+	sb_info->upload = upload;
+	return upload;
 }
 
-static int ptpfs_create(struct inode *dir,struct dentry *d,int i) 
+static void ptpfs_upload_free(struct ptpfs_sb_info *sb_info)
 {
-    //printk(KERN_INFO "%s   %s %d\n",__FUNCTION__,d->d_name.name,i);
-    __u32 storage;
-    __u32 parent;
-    __u32 handle;
-    struct ptp_object_info objectinfo;
-    memset(&objectinfo,0,sizeof(objectinfo));
+	struct ptp_upload *upload = sb_info->upload;
 
-    storage = PTPFSINO(dir)->storage;
-    if (PTPFSINO(dir)->type == INO_TYPE_STGDIR)
-    {
-        parent = 0xffffffff;
-    }
-    else
-    {
-        parent = dir->i_ino;
-    }
+	PTPFSINO(upload->inode)->data.file.streamed = 0;
+	if (upload->buf)
+		ptp_seg_free(upload->buf);	// cancelled, ptp_upload_finish() was not reached
+	kfree(upload);
+	sb_info->upload = NULL;
+}
 
-    objectinfo.filename = (unsigned char *)d->d_name.name;
-    objectinfo.object_format=get_format((unsigned char *)d->d_name.name,d->d_name.len);
-    objectinfo.object_compressed_size=0;
+//	the listing of the directory of ino changed, the alias pins the directory
+static void ptpfs_upload_dir_changed(struct inode *ino)
+{
+	struct dentry *d = d_find_alias(ino);
 
-    int ret = ptp_sendobjectinfo(PTPFSSB(dir->i_sb), &storage, &parent, &handle, &objectinfo);
+	if (d == NULL)
+		return;
+	ptpfs_free_inode_data(d->d_parent->d_inode);//uncache
+	d->d_parent->d_inode->i_version++;
+	dput(d);
+}
 
-    if (ret == PTP_RC_OK)
-    {
-        struct ptp_data_buffer data;
-        struct ptp_block block;
-        unsigned char buf[10];
+/*
+ * ptpfs_upload_announce:
+ * SendObjectInfo for an object of upload->size bytes next to the old one,
+ * which is only deleted once the new one is complete.  A responder that
+ * refuses a second object of the same name gets the old one deleted first.
+ */
+static __u16 ptpfs_upload_announce(struct inode *ino, struct ptp_upload *upload)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	struct ptp_object_info object;
+	struct dentry *d;
+	__u32 storage;
+	__u32 parent;
+	__u32 handle = 0;
+	__u16 ret;
+
+	memset(&object,0,sizeof(object));
+	ret = ptpfs_getobjectinfo(sb_info, upload->old, &object);
+	if (ret != PTP_RC_OK)
+		return ret;
+	upload->old_size = object.object_compressed_size;
+
+	storage = object.storage_id;
+	parent = object.parent_object ? object.parent_object : 0xffffffff;
+	object.object_compressed_size = upload->size > 0xffffffffULL ? 0xffffffff : (__u32)upload->size;
+	ptp_event_added(sb_info);	// older ObjectAdded are not ours
+	ret = ptp_sendobjectinfo(sb_info, &storage, &parent, &handle, &object);
+	if (ret != PTP_RC_OK && ptp_deleteobject(sb_info, upload->old, 0) == PTP_RC_OK)
+	{
+		ptpfs_oi_forget(sb_info, upload->old);
+		ptpfs_storage_account(sb_info, object.storage_id, upload->old_size);
+		upload->old = 0;
+		storage = object.storage_id;
+		parent = object.parent_object ? object.parent_object : 0xffffffff;
+		handle = 0;
+		ret = ptp_sendobjectinfo(sb_info, &storage, &parent, &handle, &object);
+		if (ret != PTP_RC_OK)
+		{
+			remove_inode_hash(ino);
+			ino->i_nlink = 0;	// the old object is gone, the data only is in the page cache
+		}
+	}
+	ptp_free_object_info(&object);
+	if (ret != PTP_RC_OK)
+		return ret;
 
-        memset(&data,0,sizeof(data));
-        memset(&block,0,sizeof(block));
-        data.blocks=&block;
-        data.num_blocks = 1;
-        block.block_size = 0;
-        block.block = buf;
+	if (handle == 0 && (d = d_find_alias(ino)) != NULL)
+	{
+		handle = ptpfs_create_handle(d->d_parent->d_inode, &d->d_name);
+		dput(d);
+	}
+	upload->handle = handle;
+	upload->storage = storage;
+	return PTP_RC_OK;
+}
 
-        ret = ptp_sendobject(PTPFSSB(dir->i_sb),&data,0);
+//	the data is on the device, the page cache is clean
+static void ptpfs_upload_clean(struct inode *ino, loff_t size)
+{
+	struct page *page;
+	pgoff_t index;
 
+	for (index = 0; ((loff_t)index << PAGE_CACHE_SHIFT) < size; index++)
+	{
+		page = find_lock_page(ino->i_mapping, index);
+		if (page == NULL)
+			continue;
+		if (clear_page_dirty_for_io(page))
+		{
+			set_page_writeback(page);
+			end_page_writeback(page);
+		}
+		unlock_page(page);
+		page_cache_release(page);
+	}
+}
 
-        if (handle == 0)
-        {
-            //problem - it didn't return the right handle - need to do something find it
-            struct ptp_object_handles objects;
-            objects.n = 0;
-            objects.handles = NULL;
+/*
+ * ptpfs_upload_done:
+ * a complete upload takes the place of the old object: the old one is
+ * deleted and the inode moves to the new handle.  A failed one is deleted
+ * and the file stays dirty, the old object is untouched.  If pages were
+ * already sent and cleaned the data is gone, the file is marked lost.
+ */
+static void ptpfs_upload_done(struct inode *ino, struct ptp_upload *upload, int ok)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	if (!ok)
+	{
+		if (upload->handle)
+		{
+			ptp_deleteobject(sb_info, upload->handle, 0);
+			ptpfs_oi_forget(sb_info, upload->handle);
+		}
+		if (upload->old == 0)
+		{
+			remove_inode_hash(ino);
+			ino->i_nlink = 0;	// deleted first, see ptpfs_upload_announce()
+		}
+		if (PTPFSINO(ino)->data.file.streamed)
+		{
+			printk(KERN_INFO "ptpfs: upload of object 0x%lx failed, data lost\n", ino->i_ino);
+			ptpfs_upload_clean(ino, i_size_read(ino));
+			PTPFSINO(ino)->data.file.lost = 1;
+			PTPFSINO(ino)->data.file.size = 0;
+			PTPFSINO(ino)->data.file.dirty = 0;
+		}
+		ptpfs_upload_dir_changed(ino);
+		return;
+	}
+
+	if (upload->old)
+	{
+		if (ptp_deleteobject(sb_info, upload->old, 0) == PTP_RC_OK)
+			ptpfs_storage_account(sb_info, upload->storage, upload->old_size);
+		else
+			printk(KERN_INFO "ptpfs: replaced object 0x%x could not be deleted\n", upload->old);
+		ptpfs_oi_forget(sb_info, upload->old);
+	}
+	ptpfs_oi_forget(sb_info, upload->handle);
+	ptpfs_storage_account(sb_info, upload->storage, -(__s64)upload->size);
+
+	// the new object is found by lookup when SendObjectInfo did not say where it went
+	remove_inode_hash(ino);
+	if (upload->handle)
+	{
+		ino->i_ino = upload->handle;
+		insert_inode_hash(ino);
+	}
+	PTPFSINO(ino)->data.file.on_device = upload->size;
+	ino->i_mtime = CURRENT_TIME;
+	// a page rewritten behind the stream is sent again
+	if (!PTPFSINO(ino)->data.file.rewound)
+	{
+		ptpfs_upload_clean(ino, upload->size);
+		PTPFSINO(ino)->data.file.size = 0;
+		PTPFSINO(ino)->data.file.written = 0;
+		PTPFSINO(ino)->data.file.dirty = 0;
+	}
+	ptpfs_upload_dir_changed(ino);
+}
+
+/*
+ * ptpfs_upload_pages:
+ * send the page cache from upload->sent up to end.  A page is clean once it
+ * is sent and can be reclaimed, a long upload doesn't pin its whole file.
+ */
+static int ptpfs_upload_pages(struct ptpfs_sb_info *sb_info, struct ptp_upload *upload, loff_t end,
+                              struct writeback_control *wbc)
+{
+	struct inode *ino = upload->inode;
+	struct page *page;
+	char *kaddr;
+	size_t len;
+	ssize_t ret;
+
+	while (upload->sent < end)
+	{
+		page = find_lock_page(ino->i_mapping, upload->sent >> PAGE_CACHE_SHIFT);
+		if (page == NULL)
+			return -EIO;
+		len = min_t(__u64, PAGE_CACHE_SIZE, upload->size - upload->sent);
+		kaddr = kmap(page);
+		ret = ptp_upload_write(sb_info, upload, kaddr, len);
+		kunmap(page);
+		// under the page lock, see ptpfs_commit_write()
+		PTPFSINO(ino)->data.file.streamed = upload->sent;
+		if (ret >= 0 && clear_page_dirty_for_io(page))
+		{
+			set_page_writeback(page);
+			end_page_writeback(page);
+		}
+		unlock_page(page);
+		page_cache_release(page);
+		if (ret < 0)
+			return ret;
+		if (wbc)
+			wbc->nr_to_write--;
+	}
+	return 0;
+}
+
+/*
+ * ptpfs_upload_ready:
+ * the whole file has to be in the page cache before its upload starts, the
+ * old object can not be read while the SendObject data phase is open.
+ * Missing pages are read with filp, pages past the object on the device
+ * are zeroes.  Every page is dirtied so none is dropped before it is sent.
+ */
+static int ptpfs_upload_ready(struct inode *ino, struct file *filp)
+{
+	struct address_space *mapping = ino->i_mapping;
+	loff_t size = i_size_read(ino);
+	struct page *page;
+	pgoff_t index;
+
+	for (index = 0; ((loff_t)index << PAGE_CACHE_SHIFT) < size; index++)
+	{
+		if (((loff_t)index << PAGE_CACHE_SHIFT) >= PTPFSINO(ino)->data.file.on_device)
+		{
+			page = grab_cache_page(mapping, index);
+			if (page == NULL)
+				return 0;
+			if (!PageUptodate(page))
+			{
+				memclear_highpage_flush(page, 0, PAGE_CACHE_SIZE);
+				SetPageUptodate(page);
+			}
+			set_page_dirty(page);
+			unlock_page(page);
+			page_cache_release(page);
+			continue;
+		}
+		page = find_get_page(mapping, index);
+		if ((page == NULL || !PageUptodate(page)) && filp)
+		{
+			if (page)
+				page_cache_release(page);
+			page = read_cache_page(mapping, index, (filler_t *)mapping->a_ops->readpage, filp);
+			if (IS_ERR(page))
+				return 0;
+			wait_on_page_locked(page);
+		}
+		if (page == NULL || !PageUptodate(page))
+		{
+			if (page)
+				page_cache_release(page);
+			return 0;
+		}
+		set_page_dirty(page);
+		page_cache_release(page);
+	}
+	return 1;
+}
+
+//	send the rest and read the response, the page cache now matches the device
+static int ptpfs_upload_finish(struct ptpfs_sb_info *sb_info, struct ptp_upload *upload)
+{
+	struct ptp_data_buffer data;
+	struct ptp_block block;
+	int ret = 0;
+	__u16 rc;
+
+	if (upload->size == 0)
+	{
+		// like ptpfs_create(), an empty data phase
+		memset(&data,0,sizeof(data));
+		memset(&block,0,sizeof(block));
+		data.blocks = &block;
+		data.num_blocks = 1;
+		block.block = (unsigned char *)&block;
+		rc = ptp_sendobject(sb_info, &data, 0);
+	}
+	else
+	{
+		if (i_size_read(upload->inode) != upload->size)
+		{
+			printk(KERN_INFO "ptpfs: file size changed during its upload\n");
+			ret = -EIO;
+		}
+		else
+			ret = ptpfs_upload_pages(sb_info, upload, upload->size, NULL);
+		rc = ptp_upload_finish(sb_info, upload);
+	}
+	ptpfs_upload_done(upload->inode, upload, ret == 0 && rc == PTP_RC_OK);
+	ptpfs_upload_free(sb_info);
+	return ret == 0 && rc == PTP_RC_OK ? 0 : -EIO;
+}
+
+/*
+ * ptpfs_upload_check:
+ * a stream cancelled by another transaction is dropped.  One with a page
+ * rewritten behind it goes on, the file stays dirty and is sent again.
+ */
+static struct ptp_upload *ptpfs_upload_check(struct ptpfs_sb_info *sb_info, struct inode *ino)
+{
+	struct ptp_upload *upload = sb_info->upload;
+
+	if (upload == NULL || upload->inode != ino || upload->streaming)
+		return upload;
+	ptp_upload_cancel(sb_info);
+	ptpfs_upload_done(ino, upload, 0);
+	ptpfs_upload_free(sb_info);
+	return NULL;
+}
+
+/*
+ * ptpfs_upload_flush:
+ * replace the object of ino by the page cache, from fsync, close and
+ * sync(2).  Without filp nothing can be read, a file with pages missing is
+ * left dirty for the close.  A streamed upload the writer is not done with
+ * only sends what is written, unless the file is being closed.
+ */
+static int ptpfs_upload_flush(struct inode *ino, struct file *filp, int closing)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	struct ptp_upload *upload;
+	int flag = 0;	// buffer IO, shares the passport with readpage until ptpfs_release()
+	int again = 1;
+	int ret = 0;
+
+	down(&sb_info->upload_sem);
+	if (sb_info->upload && sb_info->upload->inode != ino)
+	{
+		up(&sb_info->upload_sem);
+		return -EBUSY;
+	}
+	if (filp)
+		ptpfs_passport_get(sb_info, flag);
+	else if (!ptpfs_passport_tryget(sb_info, 25))	// ptpfs_writepages
+	{
+		up(&sb_info->upload_sem);
+		return 0;
+	}
+
+	upload = ptpfs_upload_check(sb_info, ino);
+	if (PTPFSINO(ino)->data.file.lost)
+	{
+		ret = -EIO;
+		goto out;
+	}
+	if (upload && !closing && PTPFSINO(ino)->data.file.written < upload->size)
+	{
+		ret = ptpfs_upload_pages(sb_info, upload, PTPFSINO(ino)->data.file.written & PAGE_CACHE_MASK, NULL);
+		goto out;
+	}
+resend:
+	if (upload == NULL)
+	{
+		if (!PTPFSINO(ino)->data.file.dirty || !ptpfs_upload_ready(ino, filp))
+			goto out;
+		upload = ptpfs_upload_new(ino);
+		if (upload == NULL)
+		{
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (ptpfs_upload_announce(ino, upload) != PTP_RC_OK ||
+		    (upload->size && ptp_upload_start(sb_info, upload) != PTP_RC_OK))
+		{
+			ptpfs_upload_done(ino, upload, 0);
+			ptpfs_upload_free(sb_info);
+			ret = -EIO;
+			goto out;
+		}
+	}
+	ret = ptpfs_upload_finish(sb_info, upload);
+	// pages rewritten behind the stream: send the file again, read back from the new object
+	if (ret == 0 && filp && PTPFSINO(ino)->data.file.dirty && again--)
+	{
+		upload = NULL;
+		goto resend;
+	}
+out:
+	if (!filp)
+		ptpfs_passport_put(sb_info);
+	up(&sb_info->upload_sem);
+	return ret;
+}
+
+/*
+ * ptpfs_writepages:
+ * the object can only be sent from its first byte to its last, so
+ * background writeback leaves the pages dirty.  If ftruncate() announced
+ * the size of a file with nothing on the device, it starts the upload
+ * instead and sends the pages the writer is done with.  The passport is
+ * only held for one call: any other transaction cancels the open data
+ * phase, and the upload fails, see ptpfs_upload_done().
+ */
+static int ptpfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct inode *ino = mapping->host;
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	struct ptp_upload *upload;
+	loff_t end;
+	int flag = 25;	// ptpfs_writepages
+
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		return ptpfs_upload_flush(ino, NULL, 0);
+	// nothing of the old object may have to be read back
+	if (PTPFSINO(ino)->data.file.size <= 0 || PTPFSINO(ino)->data.file.on_device ||
+	    PTPFSINO(ino)->data.file.lost)
+		return 0;
+
+	if (down_trylock(&sb_info->upload_sem))
+		return 0;
+	if (!ptpfs_passport_tryget(sb_info, flag))
+	{
+		up(&sb_info->upload_sem);
+		return 0;
+	}
+	upload = ptpfs_upload_check(sb_info, ino);
+	if (upload == NULL && PTPFSINO(ino)->data.file.size == i_size_read(ino))
+	{
+		upload = ptpfs_upload_new(ino);
+		if (upload && (ptpfs_upload_announce(ino, upload) != PTP_RC_OK || ptp_upload_start(sb_info, upload) != PTP_RC_OK))
+		{
+			ptpfs_upload_done(ino, upload, 0);
+			ptpfs_upload_free(sb_info);
+			upload = NULL;
+		}
+	}
+	if (upload && upload->inode == ino && upload->streaming)
+	{
+		// whole pages the writer is done with
+		end = PTPFSINO(ino)->data.file.written & PAGE_CACHE_MASK;
+		if (PTPFSINO(ino)->data.file.written >= upload->size)
+			end = upload->size;
+		ptpfs_upload_pages(sb_info, upload, end, wbc);
+	}
+	ptpfs_passport_put(sb_info);
+	up(&sb_info->upload_sem);
+	return 0;
+}
+
+//	one page can not be sent on its own, see ptpfs_writepages()
+static int ptpfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	redirty_page_for_writepage(wbc, page);
+	unlock_page(page);
+	return 0;
+}
+
+static int ptpfs_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to)
+{
+	struct inode *ino = page->mapping->host;
+	loff_t pos = (loff_t)page->index << PAGE_CACHE_SHIFT;
+	int flag = 0;	// buffer IO, shares the passport with readpage
+	char *kaddr;
+	int ret = 0;
+
+	if (PageUptodate(page) || (from == 0 && to == PAGE_CACHE_SIZE))
+		return 0;
+
+	kaddr = kmap(page);
+	if (pos >= PTPFSINO(ino)->data.file.on_device)
+		memset(kaddr, 0, PAGE_CACHE_SIZE);
+	else
+	{
+		// the rest of the page is on the device
+		ptpfs_passport_get(PTPFSSB(ino->i_sb), flag);
+		ret = ptpfs_file_readpages(file, page, kaddr, pos, 1);
+	}
+	kunmap(page);
+	if (ret < 0)
+		return -EIO;
+	SetPageUptodate(page);
+	return 0;
+}
+
+static int ptpfs_commit_write(struct file *file, struct page *page, unsigned from, unsigned to)
+{
+	struct inode *ino = page->mapping->host;
+	loff_t pos = ((loff_t)page->index << PAGE_CACHE_SHIFT) + to;
+
+	// the page lock orders this against ptpfs_upload_pages()
+	if (((loff_t)page->index << PAGE_CACHE_SHIFT) < PTPFSINO(ino)->data.file.streamed)
+		PTPFSINO(ino)->data.file.rewound = 1;
+	if (pos > PTPFSINO(ino)->data.file.written)
+		PTPFSINO(ino)->data.file.written = pos;
+	PTPFSINO(ino)->data.file.dirty = 1;
+	return simple_commit_write(file, page, from, to);
+}
+
+static int ptpfs_sync_file(struct file *filp, struct dentry *d, int datasync)
+{
+	return ptpfs_upload_flush(d->d_inode, filp, 0);
+}
+//=========================================================================
+
+
+static int ptpfs_release(struct inode *ino, struct file *filp)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	int ret = 0;
+
+	if (filp->f_mode & FMODE_WRITE)
+		ret = ptpfs_upload_flush(ino, filp, 1);
+
+	// closed in the middle of its stream: free the device now, not at the next command
+	if (filp->private_data && filp->private_data == sb_info->private_data)
+	{
+		filp->private_data = NULL;
+		ptp_stream_abort(sb_info);
+	}
+	if (sb_info->filp_temp == filp)
+		sb_info->filp_temp = NULL;
+	ptpfs_passport_put(sb_info);
+    //printk(KERN_INFO "%s    object:%X    dcount: %d\n",  __FUNCTION__,ino->i_ino, filp->f_dentry->d_count);
+	/*
+	if (data)
+	{
+		switch (filp->f_flags & O_ACCMODE)
+		{
+			case O_RDWR:
+				printk("======== O_RDWR =======\n");		//read, write
+			case O_WRONLY:
+			{
+				printk("======== O_WRONLY =======\n");		//write only
+				struct ptp_object_info object;
+				memset(&object,0,sizeof(object));
+				if (ptp_getobjectinfo(PTPFSSB(ino->i_sb),ino->i_ino,&object)!=PTP_RC_OK)
+				{
+					ptp_free_data_buffer(data);
+					kfree(data);
+					return -EPERM;
+				}
+
+				ptp_deleteobject(PTPFSSB(ino->i_sb),ino->i_ino,0); //
+				int count = 0;
+				int x;
+
+				for (x = 0; x < data->num_blocks; x++)
+				{
+					count += data->blocks[x].block_size;
+				}
+
+
+                int storage = object.storage_id;
+                int parent = object.parent_object;
+                int handle = ino->i_ino;
+                object.object_compressed_size=count;
+                int ret = ptp_sendobjectinfo(PTPFSSB(ino->i_sb), &storage, &parent, &handle, &object); //
+                ret = ptp_sendobject(PTPFSSB(ino->i_sb),data,count); //
+
+                ino->i_size = count;
+                ino->i_mtime = CURRENT_TIME;
+                ptpfs_free_inode_data(ino);//uncache
+                ptpfs_free_inode_data(PTPFSINO(ino) -> parent);//uncache
+
+                //the inode number will change.  Kill this inode so next dir lookup will create a new one
+                dput(filp->f_dentry);
+                //iput(ino);
+			}
+			break;
+		}
+	
+		if(data->get_object == 1 && data->num_blocks != 0)  //open,but not readpage
+		{	
+			printk("====== open , but not readpage ======\n");
+
+			int result ;
+			int x;
+			int ret;
+			//========================
+			for (x = 1; x < data->num_seg; x++ )
+			{				
+				if (x == 1)
+				{
+					data->blocks[1].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
+					data->blocks[1].block_size = MAX_SEG_SIZE;
+				}
+
+				data->blocks[1].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
+				data->blocks[1].block_size = MAX_SEG_SIZE;
+				
+				memset(data->blocks[1].block,0,MAX_SEG_SIZE);
 
-            ptpfs_get_dir_data(dir);
-            if (PTPFSINO(dir)->type == INO_TYPE_DIR)
+				if (data->blocks[1].block == NULL)
+				{
+					printk("==== release function ! kmalloc error! ====\n");
+					ptp_free_data_buffer(data);
+					return PTP_ERROR_IO;
+				}
+				ret=ptp_io_read(PTPFSSB(ino->i_sb),data->blocks[1].block,MAX_SEG_SIZE);
+				if (ret < 0)
+				{
+					printk("==== release function ! ptp_io_read error ! ====\n");
+					ptp_free_data_buffer(data);
+					return PTP_ERROR_IO;
+				}
+				
+				//data->num_blocks++;
+				if (x == data->num_seg-1) 
+					kfree(data->blocks[1].block);
+			}
+
+			down(&PTPFSSB(ino->i_sb)->usb_device->sem);
+			result = ptp_usb_getresp(data->sb_temp, data->ptp_temp);
+			up (&PTPFSSB(ino->i_sb)->usb_device->sem);
+			//========================
+			printk("========= result : %x =========\n",result);
+			if(result < 0)
+				printk("can't get response !!!!!\n");
+
+			kfree(data->blocks[0].block);
+			kfree(data->blocks);
+
+			kfree(data->ptp_temp);			
+
+			
+		//	data->ptp_temp = NULL;
+		}
+		else
+			ptp_free_data_buffer(data);
+
+		kfree(data);
+		data = NULL;
+	}
+	*/
+	return ret;
+}
+
+
+
+struct mime_map
+{
+    char *ext;
+    int type;
+};                    
+const struct mime_map mime_map[] = {
+    {"txt",PTP_OFC_Text},
+    {"mp3",PTP_OFC_MP3},
+    {"mpg",PTP_OFC_MPEG},
+    {"wav",PTP_OFC_WAV},
+    {"avi",PTP_OFC_AVI},
+    {"asf",PTP_OFC_ASF},
+    {"jpg",PTP_OFC_EXIF_JPEG},
+    {"tif",PTP_OFC_TIFF},
+    {"bmp",PTP_OFC_BMP},
+    {"gif",PTP_OFC_GIF},
+    {"pcd",PTP_OFC_PCD},
+    {"pct",PTP_OFC_PICT},
+    {"png",PTP_OFC_PNG},
+    {0,0},
+};
+
+
+
+
+static inline int get_format(unsigned char *filename, int l)
+{
+    char buf[4];
+    int x;
+
+	//printk(KERN_INFO "===== %s =====\n",  __FUNCTION__);
+    while (l)
+    {
+        l--;
+        if (filename[l] == '.')
+        {
+            filename = &filename[l];
+            l = 0;
+            if (strlen(filename) > 4 || strlen(filename) == 1)
             {
-                ptp_getobjecthandles(PTPFSSB(dir->i_sb), PTPFSINO(dir)->storage, 0x000000, dir->i_ino,&objects);
+                return PTP_OFC_Undefined;
             }
-            else
+            filename++;
+            for (x = 0; x < strlen(filename); x++)
             {
-                ptp_getobjecthandles(PTPFSSB(dir->i_sb), dir->i_ino, 0x000000, 0xffffffff ,&objects);
+                buf[x] = __tolower(filename[x]);
             }
-
-            int x,y;
-            for (x = 0; x < objects.n && !handle; x++ )
+            buf[strlen(filename)] = 0;
+            const struct mime_map *map = mime_map;
+            while (map->ext)
             {
-                for (y = 0; y < PTPFSINO(dir)->data.dircache.num_files; y++)
-                {
-                    if (PTPFSINO(dir)->data.dircache.file_info[y].handle == objects.handles[x])
-                    {
-                        objects.handles[x] = 0;
-                        y = PTPFSINO(dir)->data.dircache.num_files;
-                    }
-                }
-                if (objects.handles[x])
+                if (!strcmp(buf,map->ext))
                 {
-                    handle = objects.handles[x]; 
+                    return map->type;
                 }
+                map++;
             }
-            ptp_free_object_handles(&objects);
         }
+    }
+    return PTP_OFC_Undefined;
+}
 
+static int ptpfs_handle_cmp(const void *a, const void *b)
+{
+	__u32 ha = *(const __u32 *)a;
+	__u32 hb = *(const __u32 *)b;
 
-        int mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH | S_IFREG;
-        struct inode *newi = ptpfs_get_inode(dir->i_sb, mode  , 0,handle);
-        PTPFSINO(newi)->parent = dir;
-        ptpfs_set_inode_info(newi,&objectinfo);
-        atomic_inc(&newi->i_count);    /* New dentry reference */
-        d_instantiate(d, newi);
+	if (ha < hb)
+		return -1;
+	return ha > hb;
+}
+
+static int ptpfs_delete_pending(struct ptpfs_sb_info *sb_info, __u32 handle)
+{
+	struct ptpfs_delete *e;
+	int ret = 0;
+
+	down(&sb_info->delete_sem);
+	list_for_each_entry(e, &sb_info->delete_list, list)
+	{
+		if (e->handle == handle)
+		{
+			ret = 1;
+			break;
+		}
+	}
+	up(&sb_info->delete_sem);
+	return ret;
+}
 
+/*
+ * ptpfs_create_handle:
+ * SendObjectInfo did not say where the object went.  The ObjectAdded event
+ * usually did; otherwise the listing of the folder is sorted and walked
+ * along the dircache (sorted by handle too), and the handles it lacks are
+ * asked for their name, newest first.  The dircache was loaded before the
+ * object was sent and the passport keeps ptpfs_event_work() from patching
+ * it meanwhile.
+ */
+static int ptpfs_create_is_ours(struct inode *dir, __u32 handle, struct qstr *name)
+{
+	struct ptp_object_info object;
+	int ret;
+
+	memset(&object,0,sizeof(object));
+	if (ptpfs_getobjectinfo(PTPFSSB(dir->i_sb), handle, &object) != PTP_RC_OK)
+		return 0;
+	ret = ptpfs_dircache_is_parent(PTPFSINO(dir), &object) && object.filename &&
+	      !strcmp(object.filename, (char *)name->name);
+	ptp_free_object_info(&object);
+	return ret;
+}
+
+static __u32 ptpfs_create_handle(struct inode *dir, struct qstr *name)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(dir->i_sb);
+	struct ptpfs_inode_data *ptpfs_data = PTPFSINO(dir);
+	struct ptp_object_handles objects;
+	__u32 handle;
+	int n = 0;
+	int x, y;
+
+	handle = ptp_event_added(sb_info);
+	if (handle && ptpfs_create_is_ours(dir, handle, name))
+		return handle;
+	handle = 0;
+
+	if (ptpfs_data->data.dircache.file_info == NULL)
+		return 0;
+
+	objects.n = 0;
+	objects.handles = NULL;
+	if (ptpfs_data->type == INO_TYPE_DIR)
+		ptp_getobjecthandles(sb_info, ptpfs_data->storage, 0x000000, dir->i_ino, &objects);
+	else
+		ptp_getobjecthandles(sb_info, dir->i_ino, 0x000000, 0xffffffff, &objects);
+	sort(objects.handles, objects.n, sizeof(__u32), ptpfs_handle_cmp, NULL);
+
+	for (x = 0, y = 0; x < objects.n; x++)
+	{
+		while (y < ptpfs_data->data.dircache.num_files &&
+		       (__u32)ptpfs_data->data.dircache.file_info[y].handle < objects.handles[x])
+			y++;
+		if (y < ptpfs_data->data.dircache.num_files &&
+		    (__u32)ptpfs_data->data.dircache.file_info[y].handle == objects.handles[x])
+			continue;
+		if (!ptpfs_delete_pending(sb_info, objects.handles[x]))
+			objects.handles[n++] = objects.handles[x];
+	}
+	// usually one, the newest handle is the likely one
+	while (n-- > 0 && handle == 0)
+	{
+		if (ptpfs_create_is_ours(dir, objects.handles[n], name))
+			handle = objects.handles[n];
+	}
+	ptp_free_object_handles(&objects);
+	return handle;
+}
+
+//	put the new object in the loaded dircache of dir, or drop the dircache
+static void ptpfs_dircache_created(struct inode *dir, __u32 handle, const char *name, int mode)
+{
+	struct ptpfs_inode_data *ptpfs_data = PTPFSINO(dir);
+	char *filename;
+
+	dir->i_version++;
+	if (ptpfs_data->data.dircache.file_info == NULL)
+		return;
+	if (handle && ptpfs_dircache_find(ptpfs_data, handle) >= 0)
+		return;
+	filename = handle ? kmalloc(strlen(name)+1, GFP_KERNEL) : NULL;
+	if (filename)
+	{
+		strcpy(filename, name);
+		if (ptpfs_dircache_add(ptpfs_data, filename, handle, mode) == 0)
+			return;
+		kfree(filename);
+	}
+	ptpfs_free_inode_data(dir);//uncache
+}
+
+static int ptpfs_create(struct inode *dir,struct dentry *d,int i) 
+{
+    //printk(KERN_INFO "%s   %s %d\n",__FUNCTION__,d->d_name.name,i);
+    __u32 storage;
+    __u32 parent;
+    __u32 handle;
+    struct ptp_object_info objectinfo;
+    int flag = 29;	// ptpfs_create
+    memset(&objectinfo,0,sizeof(objectinfo));
+
+    // the dircache stays loaded from the name check to the new entry
+    ptpfs_passport_get(PTPFSSB(dir->i_sb), flag);
+    if (ptpfs_dircache_exists(dir, &d->d_name))
+    {
+        ptpfs_passport_put(PTPFSSB(dir->i_sb));
+        return -EEXIST;
+    }
+
+    storage = PTPFSINO(dir)->storage;
+    if (PTPFSINO(dir)->type == INO_TYPE_STGDIR)
+    {
+        parent = 0xffffffff;
+    }
+    else
+    {
+        parent = dir->i_ino;
+    }
+
+    objectinfo.filename = (unsigned char *)d->d_name.name;
+    objectinfo.object_format=get_format((unsigned char *)d->d_name.name,d->d_name.len);
+    objectinfo.object_compressed_size=0;
+
+    ptp_event_added(PTPFSSB(dir->i_sb));	// older ObjectAdded are not ours
+    int ret = ptp_sendobjectinfo(PTPFSSB(dir->i_sb), &storage, &parent, &handle, &objectinfo);
+
+    if (ret == PTP_RC_OK)
+    {
+        struct ptp_data_buffer data;
+        struct ptp_block block;
+        unsigned char buf[10];
+
+        memset(&data,0,sizeof(data));
+        memset(&block,0,sizeof(block));
+        data.blocks=&block;
+        data.num_blocks = 1;
+        block.block_size = 0;
+        block.block = buf;
+
+        ret = ptp_sendobject(PTPFSSB(dir->i_sb),&data,0);
+
+
+        if (handle == 0)
+            handle = ptpfs_create_handle(dir, &d->d_name);
+
+        objectinfo.storage_id = storage;
+        struct inode *newi = ptpfs_iget(dir->i_sb, handle, &objectinfo);
+        ptpfs_oi_forget(PTPFSSB(dir->i_sb), handle);
+        ptpfs_storage_account(PTPFSSB(dir->i_sb), storage, -(__s64)objectinfo.object_compressed_size);
+        ptpfs_snapshot_drop(PTPFSSB(dir->i_sb), PTPFS_SNAP_DROPPED);
         objectinfo.filename = NULL;
         ptp_free_object_info(&objectinfo);
 
-        ptpfs_free_inode_data(dir);//uncache
-        dir->i_version++;
+        ptpfs_dircache_created(dir, handle, (char *)d->d_name.name, DT_REG);
+        ptpfs_passport_put(PTPFSSB(dir->i_sb));
+        if (newi == NULL)
+            return -ENOMEM;
+        PTPFSINO(newi)->parent = dir;
+        d_instantiate(d, newi);		// takes the ptpfs_iget() reference
+        d->d_time = dir->i_version;
         newi->i_mtime = CURRENT_TIME;
         return 0;
     }
     objectinfo.filename = NULL;
     ptp_free_object_info(&objectinfo);
+    ptpfs_passport_put(PTPFSSB(dir->i_sb));
     return -EPERM;
 
 
@@ -1162,9 +3006,16 @@ static int ptpfs_mkdir(struct inode *ino,struct dentry *d,int i)
     __u32 parent;
     __u32 handle;
     struct ptp_object_info objectinfo;
+    int flag = 30;	// ptpfs_mkdir
     memset(&objectinfo,0,sizeof(objectinfo));
 
-
+    // the dircache stays loaded from the name check to the new entry
+    ptpfs_passport_get(PTPFSSB(ino->i_sb), flag);
+    if (ptpfs_dircache_exists(ino, &d->d_name))
+    {
+        ptpfs_passport_put(PTPFSSB(ino->i_sb));
+        return -EEXIST;
+    }
 
     storage = PTPFSINO(ino)->storage;
     if (PTPFSINO(ino)->type == INO_TYPE_STGDIR)
@@ -1185,58 +3036,470 @@ static int ptpfs_mkdir(struct inode *ino,struct dentry *d,int i)
     if (ret == PTP_RC_OK)
     {
 
-        struct ptp_data_buffer data;
-        memset(&data,0,sizeof(data));
-        ret = ptp_sendobject(PTPFSSB(ino->i_sb),&data,0);
-    }
-    */
+        struct ptp_data_buffer data;
+        memset(&data,0,sizeof(data));
+        ret = ptp_sendobject(PTPFSSB(ino->i_sb),&data,0);
+    }
+    */
+
+
+    objectinfo.filename = NULL;
+    ptp_free_object_info(&objectinfo);
+
+    if (ret == PTP_RC_OK)
+    {
+        ptpfs_oi_forget(PTPFSSB(ino->i_sb), handle);
+        ptpfs_snapshot_drop(PTPFSSB(ino->i_sb), PTPFS_SNAP_DROPPED);
+        ptpfs_dircache_created(ino, handle, (char *)d->d_name.name, DT_DIR);
+        ptpfs_passport_put(PTPFSSB(ino->i_sb));
+        return 0;
+    }
+    ptpfs_passport_put(PTPFSSB(ino->i_sb));
+    return -EPERM;
+}
+
+//=========================================================================
+//	deferred DeleteObject
+//
+//	unlink and rmdir only patch the dircache and queue the handle; the
+//	worker sends the DeleteObjects a moment later, under one passport.  A
+//	folder queued by rmdir takes along the deletes of its content that were
+//	not sent yet, the device drops those with the folder.
+//=========================================================================
+static int ptpfs_delete_queued(struct ptpfs_delete *e, __u32 *set, int n)
+{
+	int x;
+
+	if (e->parent_type != INO_TYPE_DIR)
+		return 0;
+	for (x = 0; x < n; x++)
+		if (set[x] == e->parent)
+			return 1;
+	return 0;
+}
+
+//	rm -r queued the content before the folder: walking back from the folder
+//	meets a subfolder before its own content
+static void ptpfs_delete_swallow(struct ptpfs_sb_info *sb_info, struct ptpfs_delete *folder)
+{
+	struct list_head *p, *prev;
+	struct ptpfs_delete *e;
+	__u32 *set, *bigger;
+	int n = 1;
+	int max = 16;
+
+	set = (__u32 *)kmalloc(max*sizeof(__u32), GFP_KERNEL);
+	if (set == NULL)
+		return;		// each one gets its own DeleteObject
+	set[0] = folder->handle;
+
+	for (p = sb_info->delete_list.prev; p != &sb_info->delete_list; p = prev)
+	{
+		prev = p->prev;
+		e = list_entry(p, struct ptpfs_delete, list);
+		if (!ptpfs_delete_queued(e, set, n))
+			continue;
+		if (e->dir)
+		{
+			if (n == max)
+			{
+				bigger = (__u32 *)kmalloc(max*2*sizeof(__u32), GFP_KERNEL);
+				if (bigger == NULL)
+					continue;
+				memcpy(bigger, set, n*sizeof(__u32));
+				kfree(set);
+				set = bigger;
+				max *= 2;
+			}
+			set[n++] = e->handle;
+		}
+		folder->size += e->size;
+		list_del(&e->list);
+		kfree(e);
+	}
+	kfree(set);
+}
+
+static int ptpfs_delete_queue(struct inode *dir, __u32 handle, int is_dir, loff_t size)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(dir->i_sb);
+	struct ptpfs_delete *e;
+
+	e = (struct ptpfs_delete *)kmalloc(sizeof(struct ptpfs_delete), GFP_KERNEL);
+	if (e == NULL)
+		return -ENOMEM;
+	e->handle = handle;
+	e->parent = dir->i_ino;
+	e->parent_type = PTPFSINO(dir)->type;
+	e->storage = PTPFSINO(dir)->storage;
+	e->dir = is_dir;
+	e->size = size;
+
+	down(&sb_info->delete_sem);
+	if (is_dir)
+		ptpfs_delete_swallow(sb_info, e);
+	list_add_tail(&e->list, &sb_info->delete_list);
+	up(&sb_info->delete_sem);
+	schedule_delayed_work(&sb_info->delete_work, PTPFS_DELETE_DELAY);
+	return 0;
+}
+
+//	dircache loaded with the listing of the device, before the queue was sent
+static void ptpfs_delete_hide(struct ptpfs_sb_info *sb_info, struct ptpfs_inode_data *ptpfs_data)
+{
+	struct ptpfs_delete *e;
+	int x;
+
+	down(&sb_info->delete_sem);
+	list_for_each_entry(e, &sb_info->delete_list, list)
+	{
+		if (e->parent_type != ptpfs_data->type || e->parent != ptpfs_data->inode->i_ino)
+			continue;
+		x = ptpfs_dircache_find(ptpfs_data, e->handle);
+		if (x >= 0)
+			ptpfs_dircache_remove(ptpfs_data, x);
+	}
+	up(&sb_info->delete_sem);
+}
+
+static void ptpfs_delete_uncache(struct ptpfs_sb_info *sb_info, int type, __u32 ino)
+{
+	struct ptpfs_inode_data *d, *n;
+
+	list_for_each_entry_safe(d, n, &sb_info->dir_list, dir_list)
+	{
+		if (d->type == type && d->inode->i_ino == ino)
+		{
+			d->inode->i_version++;
+			ptpfs_free_inode_data(d->inode);
+		}
+	}
+}
+
+/*
+ * ptpfs_delete_work:
+ * send the queued DeleteObjects.  The queue is taken under the passport so
+ * no listing is loaded between the splice and the deletes.  An object the
+ * device kept comes back with the next listing of its folder.
+ */
+void ptpfs_delete_work(void *data)
+{
+	struct ptpfs_sb_info *sb_info = data;
+	struct ptpfs_delete *e, *n;
+	LIST_HEAD(batch);
+	int flag = 27;	// ptpfs_delete_work
 
+	ptpfs_passport_get(sb_info, flag);
+	down(&sb_info->delete_sem);
+	list_splice_init(&sb_info->delete_list, &batch);
+	up(&sb_info->delete_sem);
 
-    objectinfo.filename = NULL;
-    ptp_free_object_info(&objectinfo);
+	list_for_each_entry_safe(e, n, &batch, list)
+	{
+		if (ptp_deleteobject(sb_info, e->handle, 0) == PTP_RC_OK)
+		{
+			ptpfs_storage_account(sb_info, e->storage, e->size);
+		}
+		else
+		{
+			ptpfs_oi_forget(sb_info, e->handle);
+			ptpfs_delete_uncache(sb_info, e->parent_type, e->parent);
+			if (e->dir)
+				ptpfs_delete_uncache(sb_info, INO_TYPE_DIR, e->handle);
+			ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+		}
+		list_del(&e->list);
+		kfree(e);
+	}
+	ptpfs_passport_put(sb_info);
+}
 
-    if (ret == PTP_RC_OK)
-    {
-        ptpfs_free_inode_data(ino);//uncache
-        ino->i_version++;
-        return 0;
-    }
-    return -EPERM;
+//	umount: the queue goes out before the session is closed
+void ptpfs_delete_flush(struct ptpfs_sb_info *sb_info)
+{
+	cancel_delayed_work(&sb_info->delete_work);
+	flush_scheduled_work();
+	ptpfs_delete_work(sb_info);
 }
 
-int ptpfs_unlink(struct inode *dir,struct dentry *d)
+//	call with the passport
+static int __ptpfs_unlink(struct inode *dir,struct dentry *d)
 {
-    //printk(KERN_INFO "%s   %s\n",__FUNCTION__,d->d_name.name);
     int x;
+    int ret = -EPERM;
 
     struct ptpfs_inode_data* ptpfs_data = PTPFSINO(dir);
 
-    if (!ptpfs_get_dir_data(dir))
-    {
-        return -EPERM;
-    }
     if (ptpfs_data->type != INO_TYPE_DIR  && ptpfs_data->type != INO_TYPE_STGDIR)
     {
         return -EPERM;
     }
 
-
-    for (x = 0; x < ptpfs_data->data.dircache.num_files; x++)
+    if (ptpfs_get_dir_data(dir))
     {
-
-        if (!memcmp(ptpfs_data->data.dircache.file_info[x].filename,d->d_name.name,d->d_name.len))
+        x = ptpfs_dircache_lookup(ptpfs_data, d->d_name.name, d->d_name.len);
+        if (x >= 0)
         {
-            int ret = ptp_deleteobject(PTPFSSB(dir->i_sb),ptpfs_data->data.dircache.file_info[x].handle,0);
-            if (ret == PTP_RC_OK)
+            __u32 handle = ptpfs_data->data.dircache.file_info[x].handle;
+
+            ret = ptpfs_delete_queue(dir, handle, ptpfs_data->data.dircache.file_info[x].mode == DT_DIR,
+                                     d->d_inode ? d->d_inode->i_size : 0);
+            if (ret == 0)
             {
-                ptpfs_free_inode_data(dir);//uncache
+                ptpfs_oi_forget(PTPFSSB(dir->i_sb), handle);
+                ptpfs_snapshot_drop(PTPFSSB(dir->i_sb), PTPFS_SNAP_DROPPED);
+                ptpfs_dircache_remove(ptpfs_data, x);
                 dir->i_version++;
-                return 0;
-
+                if (d->d_inode)
+                    d->d_inode->i_nlink = 0;	// not kept in the icache
             }
         }
     }
-    return -EPERM;
+    return ret;
+}
+
+int ptpfs_unlink(struct inode *dir,struct dentry *d)
+{
+    //printk(KERN_INFO "%s   %s\n",__FUNCTION__,d->d_name.name);
+    int flag = 26;	// ptpfs_unlink
+    int ret;
+
+    ptpfs_passport_get(PTPFSSB(dir->i_sb), flag);
+    ret = __ptpfs_unlink(dir, d);
+    ptpfs_passport_put(PTPFSSB(dir->i_sb));
+    return ret;
+}
+
+/*
+ * ptpfs_dir_ioctl:
+ * PTPFS_IOC_EMPTY deletes the content of a folder or storage with one
+ * DeleteObject per entry, folders go with everything below them.  On the
+ * root it is a single DeleteObject(0xffffffff) for every storage, arg is
+ * the object format to delete, 0 for all.
+ */
+int ptpfs_dir_ioctl(struct inode *ino, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	struct ptpfs_inode_data *ptpfs_data = PTPFSINO(ino);
+	int flag = 26;	// ptpfs_unlink
+	int ret = 0;
+	int x;
+
+	if (cmd != PTPFS_IOC_EMPTY)
+		return -ENOTTY;
+	// like unlinking every entry; the root wipes the whole device
+	ret = permission(ino, MAY_WRITE | MAY_EXEC, NULL);
+	if (ret)
+		return ret;
+	if (ino == ino->i_sb->s_root->d_inode && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!ptp_operation_issupported(sb_info, PTP_OC_DeleteObject))
+		return -EOPNOTSUPP;
+	if (ino != ino->i_sb->s_root->d_inode &&
+	    (arg || (ptpfs_data->type != INO_TYPE_DIR && ptpfs_data->type != INO_TYPE_STGDIR)))
+		return -EINVAL;
+
+	ptpfs_delete_flush(sb_info);
+	ptpfs_passport_get(sb_info, flag);
+	if (ino == ino->i_sb->s_root->d_inode)
+	{
+		if (ptp_deleteobject(sb_info, 0xffffffff, (__u32)arg) != PTP_RC_OK)
+			ret = -EPERM;
+		ptpfs_event_drop_all(sb_info);
+	}
+	else if (!ptpfs_get_dir_data(ino))
+	{
+		ret = -EIO;
+	}
+	else
+	{
+		for (x = ptpfs_data->data.dircache.num_files - 1; x >= 0; x--)
+		{
+			struct ptpfs_dirinode_fileinfo *finfo = &ptpfs_data->data.dircache.file_info[x];
+
+			if (ptp_deleteobject(sb_info, finfo->handle, 0) != PTP_RC_OK)
+			{
+				ret = -EPERM;
+				break;
+			}
+			ptpfs_oi_forget(sb_info, finfo->handle);
+			if (finfo->mode == DT_DIR)
+				ptpfs_delete_uncache(sb_info, INO_TYPE_DIR, finfo->handle);
+			ptpfs_dircache_remove(ptpfs_data, x);
+		}
+		ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+		ino->i_version++;
+	}
+	down(&sb_info->storage_sem);
+	ptpfs_storage_forget(sb_info);
+	up(&sb_info->storage_sem);
+	ptpfs_passport_put(sb_info);
+	return ret;
+}
+//=========================================================================
+
+//	folder argument of MoveObject and CopyObject
+static __u32 ptpfs_parent_handle(struct inode *dir)
+{
+	if (PTPFSINO(dir)->type == INO_TYPE_STGDIR)
+		return 0;
+	return dir->i_ino;
+}
+
+//	the listings of dir changed on the device
+static void ptpfs_dir_changed(struct inode *dir)
+{
+	ptpfs_free_inode_data(dir);//uncache
+	dir->i_version++;
+}
+
+/*
+ * ptpfs_rename:
+ * MoveObject for another folder, MTP ObjectFileName for another name.
+ * Whatever the device can not do is -EXDEV, mv copies and deletes then.
+ * PTP has nothing atomic: a file replaced by the rename is deleted once the
+ * object is in its place, the name is briefly there twice.
+ */
+static int ptpfs_rename(struct inode *old_dir, struct dentry *old_d, struct inode *new_dir, struct dentry *new_d)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(old_dir->i_sb);
+	struct inode *ino = old_d->d_inode;
+	struct inode *target = new_d->d_inode;
+	int same_name = old_d->d_name.len == new_d->d_name.len &&
+	                !memcmp(old_d->d_name.name, new_d->d_name.name, old_d->d_name.len);
+	int flag = 28;	// ptpfs_rename
+	int ret = 0;
+
+	// the objects in a folder keep their storage
+	if (S_ISDIR(ino->i_mode) && PTPFSINO(old_dir)->storage != PTPFSINO(new_dir)->storage)
+		return -EXDEV;
+	if (old_dir != new_dir && !ptp_operation_issupported(sb_info, PTP_OC_MoveObject))
+		return -EXDEV;
+	if (!same_name && !ptp_operation_issupported(sb_info, PTP_OC_MTP_SetObjectPropValue))
+		return -EXDEV;
+	if (S_ISREG(ino->i_mode) && PTPFSINO(ino)->data.file.dirty)
+		return -EBUSY;
+	if (target && S_ISDIR(target->i_mode))
+		return -EEXIST;
+
+	ptpfs_passport_get(sb_info, flag);
+	if (!same_name && ptp_setobjectfilename(sb_info, ino->i_ino, (char *)new_d->d_name.name) != PTP_RC_OK)
+		ret = -EPERM;
+	else if (old_dir != new_dir)
+	{
+		if (ptp_moveobject(sb_info, ino->i_ino, PTPFSINO(new_dir)->storage, ptpfs_parent_handle(new_dir)) != PTP_RC_OK)
+		{
+			if (!same_name)
+				ptp_setobjectfilename(sb_info, ino->i_ino, (char *)old_d->d_name.name);
+			ret = -EPERM;
+		}
+		else
+		{
+			PTPFSINO(ino)->parent = new_dir;
+			PTPFSINO(ino)->storage = PTPFSINO(new_dir)->storage;
+		}
+	}
+
+	if (ret == 0 && target)
+	{
+		if (ptp_deleteobject(sb_info, target->i_ino, 0) == PTP_RC_OK)
+			ptpfs_storage_account(sb_info, PTPFSINO(new_dir)->storage, target->i_size);
+		else
+			printk(KERN_INFO "ptpfs: replaced object 0x%lx could not be deleted\n", target->i_ino);
+		ptpfs_oi_forget(sb_info, target->i_ino);
+		target->i_nlink = 0;
+	}
+
+	ptpfs_oi_forget(sb_info, ino->i_ino);
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	ptpfs_dir_changed(old_dir);
+	if (new_dir != old_dir)
+		ptpfs_dir_changed(new_dir);
+	ptpfs_passport_put(sb_info);
+	return ret;
+}
+
+/*
+ * ptpfs_clone:
+ * ioctl(dest, PTPFS_IOC_CLONE, src): CopyObject of src into the folder of
+ * dest, named like dest, and the copy takes the place of the object of
+ * dest.  Nothing but the request crosses the bus.
+ */
+static int ptpfs_clone(struct file *filp, int fd)
+{
+	struct inode *ino = filp->f_dentry->d_inode;
+	struct inode *dir = filp->f_dentry->d_parent->d_inode;		// pinned by the dentry of filp
+	struct ptpfs_sb_info *sb_info = PTPFSSB(ino->i_sb);
+	struct file *src;
+	struct inode *src_ino;
+	struct dentry *d = filp->f_dentry;
+	__u32 handle = 0;
+	int flag = 0;	// buffer IO, shares the passport with readpage until ptpfs_release()
+	int ret = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	src = fget(fd);
+	if (src == NULL)
+		return -EBADF;
+	src_ino = src->f_dentry->d_inode;
+
+	if (src_ino->i_sb != ino->i_sb || src_ino->i_mapping->a_ops != &ptpfs_fs_aops ||
+	    (PTPFSINO(dir)->type != INO_TYPE_DIR && PTPFSINO(dir)->type != INO_TYPE_STGDIR))
+		ret = -EXDEV;
+	else if (!ptp_operation_issupported(sb_info, PTP_OC_CopyObject))
+		ret = -EOPNOTSUPP;
+	else if (strcmp((char *)src->f_dentry->d_name.name, (char *)d->d_name.name) &&
+	         !ptp_operation_issupported(sb_info, PTP_OC_MTP_SetObjectPropValue))
+		ret = -EOPNOTSUPP;
+	else if (PTPFSINO(src_ino)->data.file.dirty || PTPFSINO(ino)->data.file.dirty)
+		ret = -EBUSY;
+	if (ret)
+	{
+		fput(src);
+		return ret;
+	}
+
+	ptpfs_passport_get(sb_info, flag);
+	if (ptp_copyobject(sb_info, src_ino->i_ino, PTPFSINO(dir)->storage, ptpfs_parent_handle(dir), &handle) != PTP_RC_OK ||
+	    handle == 0)
+		ret = -EIO;
+	else if (strcmp((char *)src->f_dentry->d_name.name, (char *)d->d_name.name) &&
+	         ptp_setobjectfilename(sb_info, handle, (char *)d->d_name.name) != PTP_RC_OK)
+		ret = -EIO;
+	else if (ptp_deleteobject(sb_info, ino->i_ino, 0) != PTP_RC_OK)
+		ret = -EIO;
+	if (ret)
+	{
+		if (handle)
+			ptp_deleteobject(sb_info, handle, 0);
+		fput(src);
+		return ret;
+	}
+
+	ptpfs_oi_forget(sb_info, ino->i_ino);
+	ptpfs_storage_account(sb_info, PTPFSINO(dir)->storage, (__s64)ino->i_size - src_ino->i_size);
+	remove_inode_hash(ino);
+	ino->i_ino = handle;
+	insert_inode_hash(ino);
+	truncate_inode_pages(ino->i_mapping, 0);
+	ino->i_size = src_ino->i_size;
+	ino->i_mtime = src_ino->i_mtime;
+	PTPFSINO(ino)->data.file.on_device = ino->i_size;
+	ptpfs_snapshot_drop(sb_info, PTPFS_SNAP_DROPPED);
+	ptpfs_dir_changed(dir);
+	fput(src);
+	return 0;
+}
+
+static int ptpfs_ioctl(struct inode *ino, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd)
+	{
+		case PTPFS_IOC_CLONE:
+			return ptpfs_clone(filp, (int)arg);
+	}
+	return -ENOTTY;
 }
 /*
 loff_t ptp_file_llseek(struct file *file, loff_t offset, int origin)
@@ -1268,11 +3531,27 @@ loff_t ptp_file_llseek(struct file *file, loff_t offset, int origin)
 
 */
 
+//	one DeleteObject for the folder, the deletes of its content queued by rm -r go along
 static int ptpfs_rmdir(struct inode *ino ,struct dentry *d)
 {
-	
 //	printk(KERN_INFO "===== %s =====\n",  __FUNCTION__);
-    return ptpfs_unlink(ino,d);
+	int flag = 26;	// ptpfs_unlink
+	int ret;
+
+	// ptpfs_event_work() can not fill the folder between the check and the queue
+	ptpfs_passport_get(PTPFSSB(ino->i_sb), flag);
+	if (!ptpfs_get_dir_data(d->d_inode))
+		ret = -EIO;
+	else if (PTPFSINO(d->d_inode)->data.dircache.num_files)
+		ret = -ENOTEMPTY;
+	else
+	{
+		ret = __ptpfs_unlink(ino,d);
+		if (ret == 0)
+			ptpfs_free_inode_data(d->d_inode);
+	}
+	ptpfs_passport_put(PTPFSSB(ino->i_sb));
+	return ret;
 }
 static int ptpfs_open(struct inode *ino, struct file *filp)
 {
@@ -1281,22 +3560,413 @@ static int ptpfs_open(struct inode *ino, struct file *filp)
 }
 
 
+//=========================================================================
+//	thumbnail tree: .thumbs/<storage>/<path>.jpg, read with GetThumb
+//=========================================================================
+static struct address_space_operations ptpfs_thumb_aops;
+static struct file_operations ptpfs_thumb_file_operations;
+static struct file_operations ptpfs_thumb_dir_operations;
+static struct inode_operations ptpfs_thumb_dir_inode_operations;
+static struct inode_operations ptpfs_thumb_file_inode_operations;
+static struct dentry_operations ptpfs_thumb_dentry_operations;
+
+//	0x38xx are the image formats, the ObjectInfo of a proplist listing has no thumb fields
+static int ptpfs_thumb_wanted(struct ptp_object_info *object)
+{
+	if (ptpfs_object_dtype(object) == DT_DIR)
+		return 0;
+	return object->thumb_compressed_size || (object->object_format & 0xff00) == 0x3800;
+}
+
+/*
+ * ptpfs_thumb_inode:
+ * a directory or file of the thumbnail tree.  Directories have the handle
+ * (or storage id) of the folder they mirror and keep a dircache of their
+ * own, so events patch them like the real ones.  Nothing is hashed.
+ */
+static struct inode *ptpfs_thumb_inode(struct inode *dir, int mode, __u32 ino, int type, __u32 storage)
+{
+	struct inode *inode = ptpfs_get_inode(dir->i_sb, mode, 0, ino);
+
+	if (inode == NULL)
+		return NULL;
+	PTPFSINO(inode)->parent = dir;
+	PTPFSINO(inode)->type = type;
+	PTPFSINO(inode)->storage = storage;
+	if (S_ISDIR(mode))
+	{
+		inode->i_op = &ptpfs_thumb_dir_inode_operations;
+		inode->i_fop = &ptpfs_thumb_dir_operations;
+	}
+	else
+	{
+		inode->i_op = &ptpfs_thumb_file_inode_operations;
+		inode->i_fop = &ptpfs_thumb_file_operations;
+		inode->i_mapping->a_ops = &ptpfs_thumb_aops;
+	}
+	return inode;
+}
+
+struct inode *ptpfs_thumbs_inode(struct inode *dir)
+{
+	return ptpfs_thumb_inode(dir, S_IFDIR | S_IRUGO | S_IXUGO, PTPFS_THUMBS_INO, INO_TYPE_THUMBS, 0);
+}
+
+//	like ptpfs_d_revalidate(), without the dircache check: a lookup is cheap here
+static int ptpfs_thumb_d_revalidate(struct dentry *dentry, struct nameidata *nd)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+
+	// the storages below .thumbs are kept like the ones in the root
+	if (PTPFSINO(dir)->type == INO_TYPE_THUMBS)
+		return 1;
+	return dentry->d_time == dir->i_version;
+}
+
+static struct dentry_operations ptpfs_thumb_dentry_operations = {
+	d_revalidate:	ptpfs_thumb_d_revalidate,
+};
+
+static int ptpfs_thumb_readdir(struct file *filp, void *dirent, filldir_t filldir)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct dentry *dentry = filp->f_dentry;
+	struct ptpfs_sb_info *sb_info = PTPFSSB(inode->i_sb);
+	struct ptpfs_inode_data* ptpfs_data = PTPFSINO(inode);
+	struct ptpfs_dirinode_fileinfo *finfo;
+	struct ptp_object_info object;
+	loff_t cookie;
+	ino_t ino;
+	char *name;
+	int len;
+	int x;
+	int n;
+	int flag = 5;	// ptpfs_readdir
+
+	if (filp->f_pos == 0)
+	{
+		if (filldir(dirent, ".", 1, filp->f_pos, inode->i_ino, DT_DIR) < 0)
+			return 0;
+		filp->f_pos++;
+	}
+	if (filp->f_pos == 1)
+	{
+		spin_lock(&dcache_lock);
+		ino = dentry->d_parent->d_inode->i_ino;
+		spin_unlock(&dcache_lock);
+		if (filldir(dirent, "..", 2, filp->f_pos, ino, DT_DIR) < 0)
+			return 0;
+		filp->f_pos++;
+	}
+
+	if (ptpfs_data->type == INO_TYPE_THUMBS)
+	{
+		down(&sb_info->storage_sem);
+		n = ptpfs_storage_get(sb_info, 0);
+		for (x = filp->f_pos - 2; x < n; x++)
+		{
+			if (filldir(dirent, sb_info->storages[x].name, strlen(sb_info->storages[x].name),
+			            filp->f_pos, sb_info->storages[x].id, DT_DIR) < 0)
+				break;
+			filp->f_pos++;
+		}
+		up(&sb_info->storage_sem);
+		return 0;
+	}
+
+	name = kmalloc(NAME_MAX+1, GFP_KERNEL);
+	if (name == NULL)
+		return -ENOMEM;
+	ptpfs_passport_get(sb_info, flag);
+	if (!ptpfs_get_dir_data(inode))
+	{
+		ptpfs_passport_put(sb_info);
+		kfree(name);
+		return 0;
+	}
+	for (x = ptpfs_dircache_seek(ptpfs_data, filp->f_pos); x < ptpfs_data->data.dircache.num_files; x++)
+	{
+		finfo = &ptpfs_data->data.dircache.file_info[x];
+		cookie = PTPFS_DIR_COOKIE(finfo->handle);
+		len = strlen(finfo->filename);
+		if (finfo->mode == DT_DIR)
+		{
+			if (filldir(dirent, finfo->filename, len, cookie, finfo->handle, DT_DIR) < 0)
+				break;
+		}
+		else
+		{
+			memset(&object,0,sizeof(object));
+			if (len + sizeof(PTPFS_THUMB_SUFFIX) - 1 <= NAME_MAX &&
+			    ptpfs_getobjectinfo(sb_info, finfo->handle, &object) == PTP_RC_OK &&
+			    ptpfs_thumb_wanted(&object))
+			{
+				memcpy(name, finfo->filename, len);
+				strcpy(name + len, PTPFS_THUMB_SUFFIX);
+				if (filldir(dirent, name, len + sizeof(PTPFS_THUMB_SUFFIX) - 1, cookie, finfo->handle, DT_REG) < 0)
+				{
+					ptp_free_object_info(&object);
+					break;
+				}
+			}
+			ptp_free_object_info(&object);
+		}
+		filp->f_pos = cookie + 1;
+	}
+	ptpfs_passport_put(sb_info);
+	kfree(name);
+	return 0;
+}
+
+/*
+ * ptpfs_thumb_lookup:
+ * folders keep their name, "<name>.jpg" is the thumbnail of the object
+ * <name>.  The size comes from thumb_compressed_size, objects without one
+ * have no entry.
+ */
+static struct dentry *ptpfs_thumb_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nd)
+{
+	struct ptpfs_sb_info *sb_info = PTPFSSB(dir->i_sb);
+	struct ptpfs_inode_data* ptpfs_data = PTPFSINO(dir);
+	struct ptpfs_dirinode_fileinfo *finfo;
+	struct ptp_object_info object;
+	struct inode *newi = NULL;
+	const unsigned char *name = dentry->d_name.name;
+	int len = dentry->d_name.len;
+	int slen = sizeof(PTPFS_THUMB_SUFFIX) - 1;
+	int x;
+	int n;
+	int flag = 15;	// ptpfs_lookup
+
+	dentry->d_op = &ptpfs_thumb_dentry_operations;
+	dentry->d_time = dir->i_version;
+
+	if (ptpfs_data->type == INO_TYPE_THUMBS)
+	{
+		down(&sb_info->storage_sem);
+		n = ptpfs_storage_get(sb_info, 0);
+		for (x = 0; x < n; x++)
+		{
+			if (strlen(sb_info->storages[x].name) == len && !memcmp(sb_info->storages[x].name, name, len))
+			{
+				newi = ptpfs_thumb_inode(dir, S_IFDIR | S_IRUGO | S_IXUGO, sb_info->storages[x].id,
+				                         INO_TYPE_STGDIR, sb_info->storages[x].id);
+				break;
+			}
+		}
+		up(&sb_info->storage_sem);
+		d_add(dentry, newi);
+		return NULL;
+	}
+
+	ptpfs_passport_get(sb_info, flag);
+	if (!ptpfs_get_dir_data(dir))
+	{
+		ptpfs_passport_put(sb_info);
+		return ERR_PTR(-EIO);
+	}
+
+	x = ptpfs_dircache_lookup(ptpfs_data, name, len);
+	if (x >= 0 && ptpfs_data->data.dircache.file_info[x].mode == DT_DIR)
+	{
+		finfo = &ptpfs_data->data.dircache.file_info[x];
+		newi = ptpfs_thumb_inode(dir, S_IFDIR | S_IRUGO | S_IXUGO, finfo->handle, INO_TYPE_DIR, ptpfs_data->storage);
+		if (newi == NULL)
+		{
+			ptpfs_passport_put(sb_info);
+			return ERR_PTR(-ENOMEM);
+		}
+		d_add(dentry, newi);
+		ptpfs_passport_put(sb_info);
+		return NULL;
+	}
+
+	x = -1;
+	if (len > slen && !memcmp(name + len - slen, PTPFS_THUMB_SUFFIX, slen))
+		x = ptpfs_dircache_lookup(ptpfs_data, name, len - slen);
+	if (x < 0 || ptpfs_data->data.dircache.file_info[x].mode != DT_REG)
+	{
+		d_add(dentry, NULL);
+		ptpfs_passport_put(sb_info);
+		return NULL;
+	}
+
+	finfo = &ptpfs_data->data.dircache.file_info[x];
+	memset(&object,0,sizeof(object));
+	if (ptpfs_getobjectinfo(sb_info, finfo->handle, &object) != PTP_RC_OK)
+	{
+		ptpfs_passport_put(sb_info);
+		return ERR_PTR(-EIO);
+	}
+	if (object.thumb_compressed_size == 0 && ptpfs_thumb_wanted(&object))
+	{
+		// cached from a proplist listing, ask for the full ObjectInfo
+		ptp_free_object_info(&object);
+		memset(&object,0,sizeof(object));
+		if (ptp_getobjectinfo(sb_info, finfo->handle, &object) != PTP_RC_OK)
+		{
+			ptpfs_passport_put(sb_info);
+			return ERR_PTR(-EIO);
+		}
+		ptpfs_oi_insert(sb_info, finfo->handle, &object);
+	}
+	if (object.thumb_compressed_size)
+	{
+		newi = ptpfs_thumb_inode(dir, S_IFREG | S_IRUGO, finfo->handle, 0, object.storage_id);
+		if (newi == NULL)
+		{
+			ptp_free_object_info(&object);
+			ptpfs_passport_put(sb_info);
+			return ERR_PTR(-ENOMEM);
+		}
+		newi->i_size = object.thumb_compressed_size;
+		newi->i_mtime.tv_sec = newi->i_ctime.tv_sec = object.modification_date;
+		newi->i_mtime.tv_nsec = newi->i_ctime.tv_nsec = 0;
+	}
+	d_add(dentry, newi);
+	ptp_free_object_info(&object);
+	ptpfs_passport_put(sb_info);
+	return NULL;
+}
+
+//	copy the part of the thumbnail that belongs to page, unlock it uptodate
+static void ptpfs_thumb_fill(struct page *page, struct ptp_data_buffer *data, loff_t size)
+{
+	loff_t start = (loff_t)page->index << PAGE_CACHE_SHIFT;
+	loff_t base = 0;
+	char *buffer = kmap_atomic(page, KM_USER0);
+	int pos = 0;
+	int toCopy;
+	int off;
+	int x;
+
+	for (x = 0; x < data->num_blocks && pos < PAGE_CACHE_SIZE && start + pos < size; x++)
+	{
+		if (base + data->blocks[x].block_size > start + pos)
+		{
+			off = start + pos - base;
+			toCopy = min_t(loff_t, data->blocks[x].block_size - off, size - start - pos);
+			toCopy = min_t(int, toCopy, PAGE_CACHE_SIZE - pos);
+			memcpy(&buffer[pos], data->blocks[x].block + off, toCopy);
+			pos += toCopy;
+		}
+		base += data->blocks[x].block_size;
+	}
+	memset(&buffer[pos], 0, PAGE_CACHE_SIZE - pos);
+	kunmap_atomic(buffer, KM_USER0);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
+}
+
+/*
+ * ptpfs_thumb_readpage:
+ * GetThumb has no offset, the whole thumbnail comes in one transaction.
+ * The other pages of it are filled on the way if they are not cached yet.
+ */
+static int ptpfs_thumb_readpage(struct file *filp, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct ptpfs_sb_info *sb_info = PTPFSSB(inode->i_sb);
+	struct ptp_data_buffer data;
+	struct page *p;
+	loff_t size = i_size_read(inode);
+	pgoff_t index;
+	int flag = 24;	// ptpfs_thumb_readpage
+
+	memset(&data,0,sizeof(data));
+	ptpfs_passport_get(sb_info, flag);
+	if (ptp_getthumb(sb_info, inode->i_ino, &data) != PTP_RC_OK)
+	{
+		printk(KERN_INFO "ptp_getthumb error !\n");
+		if (data.blocks)
+			ptp_free_data_blocks(&data);
+		ptpfs_passport_put(sb_info);
+		SetPageError(page);
+		unlock_page(page);
+		return -EIO;
+	}
+	ptpfs_passport_put(sb_info);
+
+	ptpfs_thumb_fill(page, &data, size);
+	for (index = 0; ((loff_t)index << PAGE_CACHE_SHIFT) < size; index++)
+	{
+		if (index == page->index)
+			continue;
+		p = grab_cache_page_nowait(inode->i_mapping, index);
+		if (p == NULL)
+			continue;
+		if (PageUptodate(p))
+			unlock_page(p);
+		else
+			ptpfs_thumb_fill(p, &data, size);
+		page_cache_release(p);
+	}
+	ptp_free_data_blocks(&data);
+	return 0;
+}
+
+//	thumbnails are generated by the device, they can't be written or truncated
+static int ptpfs_thumb_open(struct inode *inode, struct file *filp)
+{
+	if (filp->f_mode & FMODE_WRITE)
+		return -EROFS;
+	return 0;
+}
+
+static int ptpfs_thumb_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	return -EROFS;
+}
+
+static struct address_space_operations ptpfs_thumb_aops = {
+	readpage:	ptpfs_thumb_readpage,
+};
+static struct file_operations ptpfs_thumb_file_operations = {
+	read:		generic_file_read,
+	mmap:		generic_file_readonly_mmap,
+	open:		ptpfs_thumb_open,
+};
+static struct inode_operations ptpfs_thumb_file_inode_operations = {
+	setattr:	ptpfs_thumb_setattr,
+};
+static struct file_operations ptpfs_thumb_dir_operations = {
+	read:		generic_read_dir,
+	readdir:	ptpfs_thumb_readdir,
+};
+static struct inode_operations ptpfs_thumb_dir_inode_operations = {
+	lookup:		ptpfs_thumb_lookup,
+};
+//=========================================================================
+
+
 struct address_space_operations ptpfs_fs_aops = {
 	readpage:   	ptpfs_file_readpage,
+	readpages:		ptpfs_readpages,
 	direct_IO:		ptp_direct_IO,
-//	commit_write:	simple_commit_write,		//
+	writepage:		ptpfs_writepage,
+	writepages:		ptpfs_writepages,
+	prepare_write:	ptpfs_prepare_write,
+	commit_write:	ptpfs_commit_write,
+	set_page_dirty:	__set_page_dirty_nobuffers,
 };
 struct file_operations ptpfs_dir_operations = {
     read:       generic_read_dir,
     readdir:    ptpfs_readdir,
+    ioctl:      ptpfs_dir_ioctl,
 };
 struct file_operations ptpfs_file_operations = {
 	read:		generic_file_read, 
-	write:		ptpfs_write,
+	write:		generic_file_write,
+	fsync:		ptpfs_sync_file,
+	ioctl:		ptpfs_ioctl,
 	open:		ptpfs_open,
 	release:	ptpfs_release,
 //	llseek:	ptp_file_llseek,
 
+};
+struct inode_operations ptpfs_file_inode_operations = {
+    setattr:    ptpfs_setattr,
 };
 struct inode_operations ptpfs_dir_inode_operations = {
     lookup:     ptpfs_lookup,
@@ -1304,6 +3974,7 @@ struct inode_operations ptpfs_dir_inode_operations = {
     rmdir:      ptpfs_rmdir,
     unlink:     ptpfs_unlink,
     create:     ptpfs_create,
+    rename:     ptpfs_rename,
 };
 
 /*
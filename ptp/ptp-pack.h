@@ -407,19 +407,40 @@ static int ptp_atoi(const char *s)
     return k;
 }
 
+//	subset of ISO 8601 "YYYYMMDDThhmmss", without '.s' tenths of second and time zone
+static time_t ptp_unpack_date(const char *date, __u8 len)
+{
+    char tmp[16];
+    unsigned int year, mon, day, hour, min, sec;
+
+    if (date == NULL || len <= 15)
+        return 0;
+    strncpy (tmp, date, 4);
+    tmp[4] = 0;
+    year=ptp_atoi (tmp);
+    strncpy (tmp, date + 4, 2);
+    tmp[2] = 0;
+    mon = ptp_atoi (tmp);
+    strncpy (tmp, date + 6, 2);
+    tmp[2] = 0;
+    day = ptp_atoi (tmp);
+    strncpy (tmp, date + 9, 2);
+    tmp[2] = 0;
+    hour = ptp_atoi (tmp);
+    strncpy (tmp, date + 11, 2);
+    tmp[2] = 0;
+    min = ptp_atoi (tmp);
+    strncpy (tmp, date + 13, 2);
+    tmp[2] = 0;
+    sec = ptp_atoi (tmp);
+    return mktime(year, mon, day, hour, min, sec);
+}
+
 static inline void  ptp_unpack_OI (struct ptpfs_sb_info *sb, struct ptp_data_buffer *data, struct ptp_object_info *oi)
 {
     __u8 filenamelen;
     __u8 capturedatelen;
     char *capture_date;
-    char tmp[16];
-
-    unsigned int year = 0; 
-    unsigned int mon = 0;
-    unsigned int day = 0; 
-    unsigned int hour = 0;
-    unsigned int min = 0; 
-    unsigned int sec = 0;
 
     oi->storage_id=dtoh32apd(sb,data,PTP_oi_StorageID);
     oi->object_format=dtoh16apd(sb,data,PTP_oi_ObjectFormat);
@@ -438,64 +459,278 @@ static inline void  ptp_unpack_OI (struct ptpfs_sb_info *sb, struct ptp_data_buf
     oi->sequence_number=dtoh32apd(sb,data,PTP_oi_SequenceNumber);
     oi->filename= ptp_unpack_string(sb, data, PTP_oi_filenamelen, &filenamelen);
     capture_date = ptp_unpack_string(sb, data, PTP_oi_filenamelen+filenamelen*2+1, &capturedatelen);
-
-    // subset of ISO 8601, without '.s' tenths of second and
-    // time zone
-    if (capturedatelen>15)
-    {
-        strncpy (tmp, capture_date, 4);
-        tmp[4] = 0;
-        year=ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 4, 2);
-        tmp[2] = 0;
-        mon = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 6, 2);
-        tmp[2] = 0;
-        day = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 9, 2);
-        tmp[2] = 0;
-        hour = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 11, 2);
-        tmp[2] = 0;
-        min = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 13, 2);
-        tmp[2] = 0;
-        sec = ptp_atoi (tmp);
-        oi->capture_date=mktime(year, mon, day, hour, min, sec);
-    } else {
-        oi->modification_date=0;
-    }
+    oi->capture_date = ptp_unpack_date(capture_date, capturedatelen);
     kfree(capture_date);
 
     // now it's modification date ;)
     capture_date = ptp_unpack_string(sb, data,
                                      PTP_oi_filenamelen+filenamelen*2
                                      +capturedatelen*2+2,&capturedatelen);
-    if (capturedatelen>15)
+    oi->modification_date = ptp_unpack_date(capture_date, capturedatelen);
+    kfree(capture_date);
+}
+
+// ObjectPropList unpack
+//
+// the dataset of a whole folder runs over many data phase segments, so it is
+// walked with a cursor instead of get_charptr(), which starts from block 0
+// for every field.
+
+struct ptp_data_cursor
+{
+    struct ptp_data_buffer *data;
+    int block;
+    int pos;
+};
+
+static int ptp_cursor_read(struct ptp_data_cursor *c, unsigned char *buf, int len)
+{
+    struct ptp_data_buffer *data = c->data;
+    int n;
+
+    while (len)
     {
-        strncpy (tmp, capture_date, 4);
-        tmp[4] = 0;
-        year=ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 4, 2);
-        tmp[2] = 0;
-        mon = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 6, 2);
-        tmp[2] = 0;
-        day = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 9, 2);
-        tmp[2] = 0;
-        hour = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 11, 2);
-        tmp[2] = 0;
-        min = ptp_atoi (tmp);
-        strncpy (tmp, capture_date + 13, 2);
-        tmp[2] = 0;
-        sec = ptp_atoi (tmp);
-        oi->modification_date=mktime(year, mon, day, hour, min, sec);
-    } else {
-        oi->modification_date=0;
+        if (c->block >= data->num_blocks)
+            return -1;
+        n = min(len, data->blocks[c->block].block_size - c->pos);
+        if (buf)
+        {
+            memcpy(buf, &data->blocks[c->block].block[c->pos], n);
+            buf += n;
+        }
+        c->pos += n;
+        len -= n;
+        if (c->pos == data->blocks[c->block].block_size)
+        {
+            c->block++;
+            c->pos = 0;
+        }
     }
-    kfree(capture_date);
+    return 0;
+}
+
+static inline __u16 ptp_cursor_u16(struct ptpfs_sb_info *sb, struct ptp_data_cursor *c, int *err)
+{
+    unsigned char buf[2];
+    if (ptp_cursor_read(c, buf, 2)) { *err = 1; return 0; }
+    return dtoh16ap(sb, buf);
+}
+
+static inline __u32 ptp_cursor_u32(struct ptpfs_sb_info *sb, struct ptp_data_cursor *c, int *err)
+{
+    unsigned char buf[4];
+    if (ptp_cursor_read(c, buf, 4)) { *err = 1; return 0; }
+    return dtoh32ap(sb, buf);
+}
+
+static inline __u64 ptp_cursor_u64(struct ptpfs_sb_info *sb, struct ptp_data_cursor *c, int *err)
+{
+    unsigned char buf[8];
+    if (ptp_cursor_read(c, buf, 8)) { *err = 1; return 0; }
+    return dtoh64ap(sb, buf);
+}
+
+//	same as ptp_unpack_string()
+static char *ptp_cursor_string(struct ptpfs_sb_info *sb, struct ptp_data_cursor *c, __u8 *len, int *err)
+{
+    unsigned char buf[2];
+    char *string = NULL;
+    int i;
+
+    if (ptp_cursor_read(c, len, 1)) { *err = 1; return NULL; }
+    if (*len == 0)
+        return NULL;
+    string = kmalloc(*len, GFP_KERNEL);
+    for (i = 0; i < *len; i++)
+    {
+        if (ptp_cursor_read(c, buf, 2)) { *err = 1; break; }
+        if (string) string[i] = (char)dtoh16ap(sb, buf);
+    }
+    if (string) string[*len-1] = 0;
+    return string;
+}
+
+static int ptp_dtc_size(__u16 datatype)
+{
+    switch (datatype & 0x0fff)
+    {
+    case PTP_DTC_INT8:
+    case PTP_DTC_UINT8:
+        return 1;
+    case PTP_DTC_INT16:
+    case PTP_DTC_UINT16:
+        return 2;
+    case PTP_DTC_INT32:
+    case PTP_DTC_UINT32:
+        return 4;
+    case PTP_DTC_INT64:
+    case PTP_DTC_UINT64:
+        return 8;
+    case PTP_DTC_INT128:
+    case PTP_DTC_UINT128:
+        return 16;
+    }
+    return -1;
+}
+
+//	step over a property value we do not keep
+static int ptp_cursor_skip_value(struct ptpfs_sb_info *sb, struct ptp_data_cursor *c, __u16 datatype)
+{
+    unsigned char len;
+    int err = 0;
+    __u32 n;
+
+    if (datatype == PTP_DTC_STR)
+    {
+        if (ptp_cursor_read(c, &len, 1))
+            return -1;
+        return ptp_cursor_read(c, NULL, len*2);
+    }
+    if (ptp_dtc_size(datatype) < 0)
+        return -1;
+    if (datatype & 0x4000)	// array: count, elements
+    {
+        n = ptp_cursor_u32(sb, c, &err);
+        if (err)
+            return -1;
+        return ptp_cursor_read(c, NULL, n*ptp_dtc_size(datatype));
+    }
+    return ptp_cursor_read(c, NULL, ptp_dtc_size(datatype));
+}
+
+//	integer property of any width, for devices that pick their own datatype
+static __u64 ptp_cursor_uint(struct ptpfs_sb_info *sb, struct ptp_data_cursor *c, __u16 datatype, int *err)
+{
+    unsigned char buf[1];
+
+    switch (ptp_dtc_size(datatype))
+    {
+    case 1:
+        if (ptp_cursor_read(c, buf, 1)) { *err = 1; return 0; }
+        return buf[0];
+    case 2:
+        return ptp_cursor_u16(sb, c, err);
+    case 4:
+        return ptp_cursor_u32(sb, c, err);
+    case 8:
+        return ptp_cursor_u64(sb, c, err);
+    }
+    *err = ptp_cursor_skip_value(sb, c, datatype) ? 1 : 0;
+    return 0;
+}
+
+//	entry for handle, the elements of one object normally come together
+static struct ptp_object_info *ptp_object_list_get(struct ptp_object_list *ol, __u32 handle)
+{
+    __u32 x;
+
+    if (ol->n && ol->handles[ol->n-1] == handle)
+        return &ol->objects[ol->n-1];
+    for (x = 0; x < ol->n; x++)
+    {
+        if (ol->handles[x] == handle)
+            return &ol->objects[x];
+    }
+    if (ol->n == ol->max)
+    {
+        __u32 max = ol->max ? ol->max*2 : 64;
+        __u32 *handles = kmalloc(max*sizeof(__u32), GFP_KERNEL);
+        struct ptp_object_info *objects = kmalloc(max*sizeof(struct ptp_object_info), GFP_KERNEL);
+
+        if (handles == NULL || objects == NULL)
+        {
+            if (handles) kfree(handles);
+            if (objects) kfree(objects);
+            return NULL;
+        }
+        memcpy(handles, ol->handles, ol->n*sizeof(__u32));
+        memcpy(objects, ol->objects, ol->n*sizeof(struct ptp_object_info));
+        if (ol->handles) kfree(ol->handles);
+        if (ol->objects) kfree(ol->objects);
+        ol->handles = handles;
+        ol->objects = objects;
+        ol->max = max;
+    }
+    memset(&ol->objects[ol->n], 0, sizeof(struct ptp_object_info));
+    ol->handles[ol->n] = handle;
+    return &ol->objects[ol->n++];
+}
+
+//	NumberOfElements, then (ObjectHandle, PropertyCode, DataType, Value) per element
+static inline int ptp_unpack_OPL (struct ptpfs_sb_info *sb, struct ptp_data_buffer *data, struct ptp_object_list *ol)
+{
+    struct ptp_data_cursor c;
+    struct ptp_object_info *oi;
+    __u32 n, x, handle;
+    __u16 code, datatype;
+    __u8 len;
+    char *date;
+    int err = 0;
+
+    c.data = data;
+    c.block = 0;
+    c.pos = 0;
+
+    n = ptp_cursor_u32(sb, &c, &err);
+    for (x = 0; x < n && !err; x++)
+    {
+        handle = ptp_cursor_u32(sb, &c, &err);
+        code = ptp_cursor_u16(sb, &c, &err);
+        datatype = ptp_cursor_u16(sb, &c, &err);
+        if (err)
+            break;
+        oi = ptp_object_list_get(ol, handle);
+        if (oi == NULL)
+            return -ENOMEM;
+
+        switch (code)
+        {
+        case PTP_OPC_StorageID:
+            oi->storage_id = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_ObjectFormat:
+            oi->object_format = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_ProtectionStatus:
+            oi->protection_status = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_ObjectSize:
+            oi->object_compressed_size = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_AssociationType:
+            oi->association_type = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_AssociationDesc:
+            oi->association_desc = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_ParentObject:
+            oi->parent_object = ptp_cursor_uint(sb, &c, datatype, &err);
+            break;
+        case PTP_OPC_ObjectFileName:
+            if (datatype != PTP_DTC_STR)
+                goto skip;
+            if (oi->filename) kfree(oi->filename);
+            oi->filename = ptp_cursor_string(sb, &c, &len, &err);
+            break;
+        case PTP_OPC_DateCreated:
+        case PTP_OPC_DateModified:
+            if (datatype != PTP_DTC_STR)
+                goto skip;
+            date = ptp_cursor_string(sb, &c, &len, &err);
+            if (code == PTP_OPC_DateCreated)
+                oi->capture_date = ptp_unpack_date(date, len);
+            else
+                oi->modification_date = ptp_unpack_date(date, len);
+            if (date) kfree(date);
+            break;
+        default:
+        skip:
+            if (ptp_cursor_skip_value(sb, &c, datatype))
+                err = 1;
+            break;
+        }
+    }
+    return err ? -EINVAL : 0;
 }
 
 // Custom Type Value Assignement (without Length) macro frequently used below
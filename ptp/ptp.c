@@ -12,10 +12,22 @@
 #include <linux/usb.h>
 #include <linux/smp_lock.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/completion.h>
+#include <linux/moduleparam.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/time.h>
+#include <linux/bitops.h>
 
 /* Define generic byte swapping functions */
 #include <asm/byteorder.h>
 #include <asm/unaligned.h>
+#include <asm/scatterlist.h>
+#include <asm/div64.h>
 
 
 //#include <asm-mips/dec/prom.h>
@@ -26,26 +38,379 @@
 
 #include "ptp-pack.h"
 //=========================================================================
-struct ptp_usb_bulkcontainer *check_alignment(struct ptp_usb_bulkcontainer *bc)
+//	command, response and data header containers
+//
+//	every transaction needs one or two maxpacket sized buffers; they come
+//	from a per mount mempool on top of a 512 byte aligned slab, so the
+//	hot path neither allocates nor touches the stack for DMA.  Endpoints
+//	with a bigger wMaxPacketSize get a pool of kmalloc'd containers instead.
+//=========================================================================
+kmem_cache_t *ptp_container_cachep;
+
+static void *ptp_container_kmalloc(gfp_t gfp_mask, void *pool_data)
+{
+	return kmalloc((size_t)pool_data, gfp_mask);
+}
+
+static void ptp_container_kfree(void *element, void *pool_data)
+{
+	kfree(element);
+}
+
+int ptp_container_pool_create(struct ptpfs_sb_info *sb, struct ptpfs_usb_device_info *dev)
+{
+	size_t size = max(dev->inep_maxpacket, dev->outep_maxpacket);
+
+	if (size <= PTP_CONTAINER_SIZE)
+		sb->container_pool = mempool_create(PTP_CONTAINER_POOL_MIN, mempool_alloc_slab,
+		                                    mempool_free_slab, ptp_container_cachep);
+	else
+		sb->container_pool = mempool_create(PTP_CONTAINER_POOL_MIN, ptp_container_kmalloc,
+		                                    ptp_container_kfree, (void *)size);
+	if (sb->container_pool == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void ptp_container_pool_destroy(struct ptpfs_sb_info *sb)
+{
+	if (sb->container_pool)
+		mempool_destroy(sb->container_pool);
+	sb->container_pool = NULL;
+}
+
+//	never fails, waits for a container to come back if the pool is empty
+static struct ptp_usb_bulkcontainer *ptp_container_get(struct ptpfs_sb_info *sb)
 {
-        int ptr_temp;
-//        printk("cross alignment: %p\n",bc);
-        ptr_temp=(unsigned int)bc - (unsigned int)bc%512 + 512;
-        bc = (struct ptp_usb_bulkcontainer *)ptr_temp;
+	return mempool_alloc(sb->container_pool, GFP_NOIO);
+}
 
-        return bc;
+static void ptp_container_put(struct ptpfs_sb_info *sb, void *bc)
+{
+	mempool_free(bc, sb->container_pool);
 }
 //=========================================================================
 
 
+//=========================================================================
+//	transaction statistics, /sys/kernel/debug/ptpfs/<dev>/
+//
+//	opcodes   transactions, errors and bytes per operation code
+//	latency   log2(usec) histograms of the command, data and response phases
+//	counters  bytes in/out, endpoint stalls cleared, bytes drained, cancels
+//
+//	updated under usb_device->sem; trace=1 also logs every transaction,
+//	this kernel has no tracepoints.
+//=========================================================================
+static int trace = 0;
+module_param(trace, int, 0644);
+MODULE_PARM_DESC(trace, "log the start and end of every PTP transaction (KERN_DEBUG)");
+
+struct dentry *ptp_debugfs_root;
+
+static const char *ptp_phase_name[PTP_PHASES] = { "command", "data", "response" };
+
+static __u64 ptp_stats_now(void)
+{
+	struct timeval tv;
+
+	do_gettimeofday(&tv);
+	return (__u64)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static void ptp_stats_latency(struct ptpfs_sb_info *sb, int phase, __u64 usec)
+{
+	int bucket = usec > 0xffffffff ? PTP_STATS_BUCKETS-1 : fls((__u32)usec);
+
+	if (bucket >= PTP_STATS_BUCKETS)
+		bucket = PTP_STATS_BUCKETS-1;
+	sb->usb_device->stats.latency[phase][bucket]++;
+}
+
+//	transfers are charged to the last transaction, the GetObject stream included
+static void ptp_stats_in(struct ptpfs_sb_info *sb, int bytes)
+{
+	struct ptp_stats *st = &sb->usb_device->stats;
+
+	if (bytes <= 0)
+		return;
+	st->bytes_in += bytes;
+	if (st->cur)
+		st->cur->bytes_in += bytes;
+}
+
+static void ptp_stats_out(struct ptpfs_sb_info *sb, int bytes)
+{
+	struct ptp_stats *st = &sb->usb_device->stats;
+
+	if (bytes <= 0)
+		return;
+	st->bytes_out += bytes;
+	st->urbs_out++;
+	if (st->cur)
+		st->cur->bytes_out += bytes;
+}
+
+static void ptp_stats_start(struct ptpfs_sb_info *sb, __u16 code)
+{
+	struct ptp_stats *st = &sb->usb_device->stats;
+	int x;
+
+	for (x = 0; x < st->nr_op; x++)
+	{
+		if (st->op[x].code == code)
+			break;
+	}
+	if (x == st->nr_op)
+	{
+		if (st->nr_op == PTP_STATS_OPCODES)
+		{
+			st->cur = NULL;		// table full, only the totals
+			return;
+		}
+		st->op[x].code = code;
+		st->nr_op++;
+	}
+	st->cur = &st->op[x];
+	st->cur->count++;
+}
+
+//	usb_clear_halt and count the stall
+static void ptp_clear_halt(struct ptpfs_sb_info *sb, int pipe)
+{
+	sb->usb_device->stats.stalls++;
+	usb_clear_halt(sb->usb_device->udev, pipe);
+}
+
+static int ptp_stats_opcodes_show(struct seq_file *m, void *v)
+{
+	struct ptpfs_usb_device_info *dev = m->private;
+	struct ptp_opcode_stats *op;
+	int x;
+
+	seq_printf(m, "opcode     count    errors      bytes_in     bytes_out\n");
+	for (x = 0; x < dev->stats.nr_op; x++)
+	{
+		op = &dev->stats.op[x];
+		seq_printf(m, "0x%04x %9lu %9lu %13llu %13llu\n", op->code, op->count, op->errors,
+		           (unsigned long long)op->bytes_in, (unsigned long long)op->bytes_out);
+	}
+	return 0;
+}
+
+static int ptp_stats_latency_show(struct seq_file *m, void *v)
+{
+	struct ptpfs_usb_device_info *dev = m->private;
+	int phase;
+	int x;
+
+	for (phase = 0; phase < PTP_PHASES; phase++)
+	{
+		seq_printf(m, "%s (usec)\n", ptp_phase_name[phase]);
+		for (x = 0; x < PTP_STATS_BUCKETS; x++)
+		{
+			if (dev->stats.latency[phase][x] == 0)
+				continue;
+			seq_printf(m, "  < %9u %9lu\n", 1u << x, dev->stats.latency[phase][x]);
+		}
+	}
+	return 0;
+}
+
+static int ptp_stats_counters_show(struct seq_file *m, void *v)
+{
+	struct ptpfs_usb_device_info *dev = m->private;
+	__u64 msec = dev->stats.usec_out;
+	__u64 rate = 0;
+
+	// bulk-out throughput while a transfer was on the wire, bytes per msec
+	do_div(msec, 1000);
+	if (msec)
+	{
+		rate = dev->stats.bytes_out;
+		do_div(rate, (__u32)msec);
+	}
+
+	seq_printf(m, "bytes_in  %llu\n", (unsigned long long)dev->stats.bytes_in);
+	seq_printf(m, "bytes_out %llu\n", (unsigned long long)dev->stats.bytes_out);
+	seq_printf(m, "urbs_out  %lu\n", dev->stats.urbs_out);
+	seq_printf(m, "kBps_out  %llu\n", (unsigned long long)rate);
+	seq_printf(m, "stalls    %lu\n", dev->stats.stalls);
+	seq_printf(m, "drained   %llu\n", (unsigned long long)dev->stats.drained);
+	seq_printf(m, "cancels   %lu\n", dev->stats.cancels);
+	return 0;
+}
+
+static int ptp_stats_opcodes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ptp_stats_opcodes_show, inode->u.generic_ip);
+}
+
+static int ptp_stats_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ptp_stats_latency_show, inode->u.generic_ip);
+}
+
+static int ptp_stats_counters_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ptp_stats_counters_show, inode->u.generic_ip);
+}
+
+static struct file_operations ptp_stats_opcodes_fops = {
+	.owner =	THIS_MODULE,
+	.open =		ptp_stats_opcodes_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+static struct file_operations ptp_stats_latency_fops = {
+	.owner =	THIS_MODULE,
+	.open =		ptp_stats_latency_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+static struct file_operations ptp_stats_counters_fops = {
+	.owner =	THIS_MODULE,
+	.open =		ptp_stats_counters_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+void ptp_stats_register(struct ptpfs_usb_device_info *dev)
+{
+	struct ptp_stats *st = &dev->stats;
+
+	if (ptp_debugfs_root == NULL || IS_ERR(ptp_debugfs_root))
+		return;
+	st->dir = debugfs_create_dir(dev->kobj_name, ptp_debugfs_root);
+	if (st->dir == NULL || IS_ERR(st->dir))
+	{
+		st->dir = NULL;
+		return;
+	}
+	st->files[0] = debugfs_create_file("opcodes", 0444, st->dir, dev, &ptp_stats_opcodes_fops);
+	st->files[1] = debugfs_create_file("latency", 0444, st->dir, dev, &ptp_stats_latency_fops);
+	st->files[2] = debugfs_create_file("counters", 0444, st->dir, dev, &ptp_stats_counters_fops);
+}
+
+void ptp_stats_unregister(struct ptpfs_usb_device_info *dev)
+{
+	struct ptp_stats *st = &dev->stats;
+	int x;
+
+	if (st->dir == NULL)
+		return;
+	for (x = 0; x < 3; x++)
+	{
+		if (st->files[x] && !IS_ERR(st->files[x]))
+			debugfs_remove(st->files[x]);
+	}
+	debugfs_remove(st->dir);
+	st->dir = NULL;
+}
+//=========================================================================
+
+
+//=========================================================================
+//	data phase segments
+//
+//	segments up to PTP_SEG_KMALLOC_MAX come from kmalloc, bigger ones are
+//	vmalloc'd and read through a page scatterlist with usb_sg_init(), so a
+//	single read can drain several megabytes of an object.
+//=========================================================================
+unsigned char *ptp_seg_alloc(struct ptpfs_sb_info *sb)
+{
+	if (sb->seg_size > PTP_SEG_KMALLOC_MAX)
+		return vmalloc(sb->seg_size);
+	return kmalloc(sb->seg_size, GFP_KERNEL);
+}
+
+//	vmalloc'd segments are not DMA-able, they go to usb_sg_init() page by page
+static int ptp_seg_vmalloced(unsigned char *block)
+{
+	unsigned long addr = (unsigned long)block;
+
+	return addr >= VMALLOC_START && addr < VMALLOC_END;
+}
+
+void ptp_seg_free(unsigned char *block)
+{
+	if (ptp_seg_vmalloced(block))
+		vfree(block);
+	else
+		kfree(block);
+}
+
+//	align a requested segment size to the bulk-in endpoint
+int ptp_seg_size_align(struct ptpfs_usb_device_info *dev, int size)
+{
+	int maxpacket = dev->inep_maxpacket ? dev->inep_maxpacket : PTP_USB_BULK_HS_MAX_PACKET_LEN;
+
+	if (size > PTP_SEG_SIZE_MAX)
+		size = PTP_SEG_SIZE_MAX;
+	if (size > PTP_SEG_KMALLOC_MAX)
+		size -= size % PAGE_SIZE;
+	size -= size % maxpacket;
+	if (size < maxpacket)
+		size = maxpacket;
+	return size;
+}
+
+static int ptp_sg_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size)
+{
+	struct usb_sg_request io;
+	struct scatterlist *sg;
+	int nents = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	int pipe = usb_rcvbulkpipe(sb->usb_device->udev, sb->usb_device->inep);
+	int retval;
+	int x;
+
+	sg = kmalloc(nents*sizeof(struct scatterlist), GFP_KERNEL);
+	if (sg == NULL)
+		return -ENOMEM;
+	memset(sg, 0, nents*sizeof(struct scatterlist));
+
+	// vmalloc'd segments are page aligned, every entry but the last is a whole page
+	for (x = 0; x < nents; x++)
+	{
+		sg[x].page = vmalloc_to_page(bytes + (x << PAGE_SHIFT));
+		sg[x].offset = 0;
+		sg[x].length = min((unsigned int)PAGE_SIZE, size - (x << PAGE_SHIFT));
+	}
+
+	retval = usb_sg_init(&io, sb->usb_device->udev, pipe, 0, sg, nents, size, GFP_KERNEL);
+	if (retval)
+	{
+		kfree(sg);
+		return retval;
+	}
+	usb_sg_wait(&io);
+	kfree(sg);
+
+	// a short packet ends the data phase, the remaining URBs are unlinked
+	if (io.status == 0 || io.status == -EREMOTEIO)
+	{
+		ptp_stats_in(sb, io.bytes);
+		return io.bytes;
+	}
+	if (io.status == -EPIPE)
+		ptp_clear_halt(sb, pipe);
+	return io.status;
+}
+
 //static int ptp_io_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size)
 int ptp_io_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size)
 {
     int retval = 0;
     int count = 0;
 
+	if (ptp_seg_vmalloced(bytes))
+		return ptp_sg_read(sb, bytes, size);
 
-    memset(bytes,0,size);
     /* do an immediate bulk read to get data from the device */
     int pipe =  usb_rcvbulkpipe (sb->usb_device->udev, sb->usb_device->inep);
 	//	jiffies=3*Hz is too short to make crash.
@@ -58,18 +423,229 @@ int ptp_io_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int siz
     if (!retval)
     {
         retval = count;
+        ptp_stats_in(sb, count);
     }
     else if (retval == -EPIPE)
     {
         //stall
-        usb_clear_halt(sb->usb_device->udev,pipe);
+        ptp_clear_halt(sb,pipe);
     }
     return retval;
 }
+
+//=========================================================================
+//	bulk-in ring for the GetObject data phase
+//
+//	every segment after the first container is seg_size bytes on the
+//	wire (the last one may be short), so the whole data phase can be queued
+//	as a row of seg_size URBs.  We never submit more URBs than there are
+//	segments left, otherwise one of them would swallow the response container.
+//	ring_depth=0 falls back to one synchronous usb_bulk_msg() per segment.
+//=========================================================================
+static int ring_depth = 4;
+module_param(ring_depth, int, 0444);
+MODULE_PARM_DESC(ring_depth, "bulk-in URBs kept in flight during GetObject (0 = synchronous)");
+
+static void ptp_ring_complete(struct urb *urb, struct pt_regs *regs)
+{
+	complete((struct completion *)urb->context);
+}
+
+void ptp_ring_free(struct ptpfs_usb_device_info *dev)
+{
+	struct ptp_urb_ring *ring = &dev->ring;
+	int x;
+
+	for (x = 0; x < ring->depth; x++)
+	{
+		if (ring->urb[x])
+		{
+			usb_kill_urb(ring->urb[x]);
+			usb_free_urb(ring->urb[x]);
+		}
+		if (ring->buf[x])
+			kfree(ring->buf[x]);
+	}
+	memset(ring, 0, sizeof(*ring));
+}
+
+static int ptp_ring_alloc(struct ptpfs_usb_device_info *dev, int seg_size)
+{
+	struct ptp_urb_ring *ring = &dev->ring;
+	int depth = min(ring_depth, PTP_RING_DEPTH_MAX);
+	int x;
+
+	if (ring->depth && ring->seg_size == seg_size)
+		return ring->depth;
+	ptp_ring_free(dev);
+
+	for (x = 0; x < depth; x++)
+	{
+		ring->urb[x] = usb_alloc_urb(0, GFP_KERNEL);
+		ring->buf[x] = kmalloc(seg_size, GFP_KERNEL);
+		if (ring->urb[x] == NULL || ring->buf[x] == NULL)
+		{
+			ring->depth = x+1;
+			ptp_ring_free(dev);
+			return 0;
+		}
+		init_completion(&ring->done[x]);
+	}
+	ring->depth = depth;
+	ring->seg_size = seg_size;
+	return depth;
+}
+
+static int ptp_ring_submit(struct ptpfs_sb_info *sb, int slot)
+{
+	struct ptp_urb_ring *ring = &sb->usb_device->ring;
+	int pipe = usb_rcvbulkpipe(sb->usb_device->udev, sb->usb_device->inep);
+	int retval;
+
+	init_completion(&ring->done[slot]);
+	usb_fill_bulk_urb(ring->urb[slot], sb->usb_device->udev, pipe,
+	                  ring->buf[slot], ring->seg_size,
+	                  ptp_ring_complete, &ring->done[slot]);
+	retval = usb_submit_urb(ring->urb[slot], GFP_KERNEL);
+	if (retval)
+		return retval;
+
+	ring->inflight++;
+	ring->to_submit--;
+	return 0;
+}
+
+//	queue the first num_seg segments of the data phase, returns 0 if the ring is not used
+static int ptp_ring_start(struct ptpfs_sb_info *sb, int num_seg)
+{
+	struct ptp_urb_ring *ring = &sb->usb_device->ring;
+	int x;
+
+	if (ring_depth <= 0 || num_seg <= 0)
+		return 0;
+	//	large segments go through usb_sg_init(), which already queues the whole segment
+	if (sb->seg_size > PTP_SEG_KMALLOC_MAX)
+		return 0;
+	if (!ptp_ring_alloc(sb->usb_device, sb->seg_size))
+		return 0;
+
+	ring->head = 0;
+	ring->inflight = 0;
+	ring->to_submit = num_seg;
+	for (x = 0; x < ring->depth && ring->to_submit; x++)
+	{
+		if (ptp_ring_submit(sb, x))
+		{
+			ptp_ring_stop(sb);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void ptp_ring_stop(struct ptpfs_sb_info *sb)
+{
+	struct ptp_urb_ring *ring = &sb->usb_device->ring;
+	int x;
+
+	for (x = 0; x < ring->depth; x++)
+		usb_kill_urb(ring->urb[x]);
+	ring->head = 0;
+	ring->inflight = 0;
+	ring->to_submit = 0;
+}
+
+//	read the next data phase segment, from the ring if one is running
+int ptp_stream_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size)
+{
+	struct ptp_urb_ring *ring = &sb->usb_device->ring;
+	struct urb *urb;
+	int slot = ring->head;
+	int retval;
+
+	if (ring->inflight == 0)
+		return ptp_io_read(sb, bytes, size);
+
+	urb = ring->urb[slot];
+	if (!wait_for_completion_timeout(&ring->done[slot], 10*HZ))
+	{
+		printk("==== ptp_stream_read timeout ====\n");
+		ptp_ring_stop(sb);
+		return -ETIMEDOUT;
+	}
+	ring->inflight--;
+	ring->head = (slot+1) % ring->depth;
+
+	retval = urb->status;
+	if (retval)
+	{
+		if (retval == -EPIPE)
+			ptp_clear_halt(sb, urb->pipe);
+		ptp_ring_stop(sb);
+		return retval;
+	}
+
+	retval = min(urb->actual_length, (int)size);
+	memcpy(bytes, ring->buf[slot], retval);
+	ptp_stats_in(sb, retval);
+
+	// put the URB back on the wire for the next segment 
+	if (ring->to_submit && ptp_ring_submit(sb, slot))
+	{
+		ptp_ring_stop(sb);
+		return -EIO;
+	}
+	return retval;
+}
+//=========================================================================
+
+//	ptp_sg_read() for the bulk-out pipe, bytes is a vmalloc'd segment
+static int ptp_sg_write(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size)
+{
+	struct usb_sg_request io;
+	struct scatterlist *sg;
+	int nents = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	int pipe = usb_sndbulkpipe(sb->usb_device->udev, sb->usb_device->outep);
+	int retval;
+	int x;
+
+	sg = kmalloc(nents*sizeof(struct scatterlist), GFP_KERNEL);
+	if (sg == NULL)
+		return -ENOMEM;
+	memset(sg, 0, nents*sizeof(struct scatterlist));
+
+	// whole pages are whole packets, only the last entry can end short
+	for (x = 0; x < nents; x++)
+	{
+		sg[x].page = vmalloc_to_page(bytes + (x << PAGE_SHIFT));
+		sg[x].offset = 0;
+		sg[x].length = min((unsigned int)PAGE_SIZE, size - (x << PAGE_SHIFT));
+	}
+
+	retval = usb_sg_init(&io, sb->usb_device->udev, pipe, 0, sg, nents, size, GFP_KERNEL);
+	if (retval)
+	{
+		kfree(sg);
+		return retval;
+	}
+	usb_sg_wait(&io);
+	kfree(sg);
+
+	if (io.status == 0)
+	{
+		ptp_stats_out(sb, io.bytes);
+		return io.bytes;
+	}
+	if (io.status == -EPIPE)
+		ptp_clear_halt(sb, pipe);
+	return io.status;
+}
+
 static int ptp_io_write(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size)
 {
     ssize_t bytes_written = 0;
     int retval = 0;
+    __u64 t0 = 0;
 
     /* verify that the device wasn't unplugged */
     if (sb->usb_device->udev == NULL)
@@ -84,6 +660,12 @@ static int ptp_io_write(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned
         goto exit;
     }
 
+	t0 = ptp_stats_now();
+	if (ptp_seg_vmalloced(bytes))
+	{
+		retval = ptp_sg_write(sb, bytes, size);
+		goto exit;
+	}
 
     int pipe =  usb_sndbulkpipe (sb->usb_device->udev, sb->usb_device->outep);
     //retval = usb_ptp_bulk_msg(sb,pipe,bytes, size,&bytes_written);
@@ -93,208 +675,808 @@ static int ptp_io_write(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned
     if (retval == -EPIPE)
     {
         //stall
-        usb_clear_halt(sb->usb_device->udev,pipe);
+        ptp_clear_halt(sb,pipe);
     }
     if (!retval)
     {
         retval = bytes_written;
+        ptp_stats_out(sb, bytes_written);
     }
 
-    exit:
+    exit:
+	if (retval > 0)
+		sb->usb_device->stats.usec_out += ptp_stats_now() - t0;
+
+    return retval;
+}
+
+//	ends a data phase that filled its last packet
+static int ptp_io_write_zlp(struct ptpfs_sb_info *sb)
+{
+	int actual;
+	int retval;
+
+	if (sb->usb_device->udev == NULL)
+		return -ENODEV;
+	retval = usb_bulk_msg(sb->usb_device->udev, usb_sndbulkpipe(sb->usb_device->udev, sb->usb_device->outep),
+	                      NULL, 0, &actual, 10*HZ);
+	if (retval == -EPIPE)
+		ptp_clear_halt(sb, usb_sndbulkpipe(sb->usb_device->udev, sb->usb_device->outep));
+	return retval;
+}
+
+//	seg_size is aligned to the bulk-in endpoint, data phases we send use whole bulk-out packets
+static unsigned int ptp_seg_out(struct ptpfs_sb_info *sb)
+{
+	int maxpacket = sb->usb_device->outep_maxpacket ? sb->usb_device->outep_maxpacket : PTP_USB_BULK_HS_MAX_PACKET_LEN;
+
+	return sb->seg_size - sb->seg_size % maxpacket;
+}
+
+//	container header of a data phase we send, objects over 4GB have 0xffffffff
+static void ptp_data_header(struct ptpfs_sb_info *sb, unsigned char *buf, struct ptp_container *ptp, __u64 len)
+{
+	struct ptp_usb_bulkcontainer *hdr = (struct ptp_usb_bulkcontainer *)buf;
+
+	hdr->length=htod32p(sb, len > 0xffffffffULL ? 0xffffffff : (__u32)len);
+	hdr->type=htod16p(sb,PTP_USB_CONTAINER_DATA);
+	hdr->code=htod16p(sb,ptp->code);
+	hdr->trans_id=htod32p(sb,ptp->transactionID);
+}
+
+__u16 ptp_usb_getresp(struct ptpfs_sb_info *sb, struct ptp_container* resp)
+{
+    //printk(KERN_INFO "%s\n",__FUNCTION__);
+    int ret;
+    __u32 len;
+
+    struct ptp_usb_bulkcontainer *usbresp;
+
+	usbresp = ptp_container_get(sb);
+    ret=ptp_io_read(sb,(unsigned char *)usbresp, sizeof(*usbresp));
+
+    if (ret < 0)
+	{
+		printk("===== usbresp error 1 =====\n");
+		ptp_container_put(sb, usbresp);
+        return PTP_ERROR_IO;
+	}
+    else if (dtoh16p(sb,usbresp->type)!=PTP_USB_CONTAINER_RESPONSE)
+	{
+		printk("===== usbresp error 2 =====\n");
+		ptp_container_put(sb, usbresp);
+        return PTP_ERROR_RESP_EXPECTED;
+	}
+//    else if (( dtoh16p(sb,usbresp.code))!=resp->code)
+    else if (( dtoh16p(sb,usbresp->code))!=PTP_RC_OK) //0x2001
+	{
+		ret = dtoh16p(sb,usbresp->code);
+		ptp_container_put(sb, usbresp);
+		return ret;
+	}
+    // build an appropriate PTPContainer 
+    resp->code=dtoh16p(sb,usbresp->code);
+    resp->sessionID=sb->session_id;
+    resp->transactionID=dtoh32p(sb,usbresp->trans_id);
+    // the container is reused, only the params the response carries are valid
+    len = min((__u32)ret, dtoh32p(sb,usbresp->length));
+    resp->param1=len >= PTP_USB_BULK_HDR_LEN+4 ? dtoh32p(sb,usbresp->payload.params.param1) : 0;
+    resp->param2=len >= PTP_USB_BULK_HDR_LEN+8 ? dtoh32p(sb,usbresp->payload.params.param2) : 0;
+    resp->param3=len >= PTP_USB_BULK_HDR_LEN+12 ? dtoh32p(sb,usbresp->payload.params.param3) : 0;
+    resp->param4=len >= PTP_USB_BULK_HDR_LEN+16 ? dtoh32p(sb,usbresp->payload.params.param4) : 0;
+    resp->param5=len >= PTP_USB_BULK_HDR_LEN+20 ? dtoh32p(sb,usbresp->payload.params.param5) : 0;
+//	printk("code : %x, sessionID : %x, transactionID : %x, 1 : %x, 2 : %x", resp->code, resp->sessionID, resp->transactionID, resp->param1, resp->param2);
+
+	ptp_container_put(sb, usbresp);
+    return PTP_RC_OK;
+}
+
+
+
+//=========================================================================
+//	interrupt endpoint events
+//
+//	one interrupt URB stays posted while the device is mounted; events are
+//	queued from the completion and handled by ptpfs_event_work() in process
+//	context, where it can talk to the device.
+//	events=0 leaves the endpoint alone, dircaches are then re-listed as before.
+//=========================================================================
+static int events = 1;
+module_param(events, int, 0444);
+MODULE_PARM_DESC(events, "listen for device events on the interrupt endpoint (0 = off)");
+
+static void ptp_event_complete(struct urb *urb, struct pt_regs *regs)
+{
+	struct ptpfs_sb_info *sb = urb->context;
+	struct ptp_event_queue *q = &sb->usb_device->events;
+	struct ptp_usb_eventcontainer *ec = (struct ptp_usb_eventcontainer *)urb->transfer_buffer;
+	struct ptp_event *ev;
+	unsigned int len;
+	int next;
+
+	switch (urb->status)
+	{
+		case 0:
+			break;
+		case -ECONNRESET:
+		case -ENOENT:
+		case -ESHUTDOWN:
+			return;		// killed or unplugged
+		default:
+			goto resubmit;
+	}
+
+	if (urb->actual_length < PTP_USB_BULK_HDR_LEN || dtoh16p(sb,ec->type) != PTP_USB_CONTAINER_EVENT)
+		goto resubmit;
+
+	len = min(dtoh32p(sb,ec->length), (__u32)urb->actual_length);
+
+	spin_lock(&q->lock);
+	next = (q->tail + 1) % PTP_EVENT_RING;
+	if (next == q->head)
+	{
+		q->overflow = 1;
+	}
+	else
+	{
+		ev = &q->ev[q->tail];
+		ev->code = dtoh16p(sb,ec->code);
+		ev->param1 = len >= PTP_USB_BULK_HDR_LEN+4 ? dtoh32p(sb,ec->param1) : 0;
+		ev->param2 = len >= PTP_USB_BULK_HDR_LEN+8 ? dtoh32p(sb,ec->param2) : 0;
+		ev->param3 = len >= PTP_USB_BULK_HDR_LEN+12 ? dtoh32p(sb,ec->param3) : 0;
+		q->tail = next;
+	}
+	if (len >= PTP_USB_BULK_HDR_LEN+4 && dtoh16p(sb,ec->code) == PTP_EC_ObjectAdded)
+		q->added = dtoh32p(sb,ec->param1);
+	spin_unlock(&q->lock);
+	queue_work(q->wq, &q->work);
+
+resubmit:
+	if (usb_submit_urb(urb, GFP_ATOMIC))
+		printk("===== ptp_event_complete resubmit error =====\n");
+}
+
+/*
+ * ptp_event_get:
+ * take the next queued event.  Returns 1 with *ev filled, 0 if the queue is
+ * empty, -1 if events were lost since the last call (the queue is emptied).
+ */
+int ptp_event_get(struct ptpfs_sb_info *sb, struct ptp_event *ev)
+{
+	struct ptp_event_queue *q = &sb->usb_device->events;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (q->overflow)
+	{
+		q->overflow = 0;
+		q->head = q->tail;
+		ret = -1;
+	}
+	else if (q->head != q->tail)
+	{
+		*ev = q->ev[q->head];
+		q->head = (q->head + 1) % PTP_EVENT_RING;
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	return ret;
+}
+
+/*
+ * ptp_event_added:
+ * handle of the last ObjectAdded event, 0 if none came since the last call.
+ * Also set while the event is still waiting in the queue.
+ */
+__u32 ptp_event_added(struct ptpfs_sb_info *sb)
+{
+	struct ptp_event_queue *q = &sb->usb_device->events;
+	unsigned long flags;
+	__u32 handle;
+
+	spin_lock_irqsave(&q->lock, flags);
+	handle = q->added;
+	q->added = 0;
+	spin_unlock_irqrestore(&q->lock, flags);
+	return handle;
+}
+
+int ptp_event_start(struct ptpfs_sb_info *sb)
+{
+	struct ptpfs_usb_device_info *dev = sb->usb_device;
+	struct ptp_event_queue *q = &dev->events;
+
+	if (!events || !dev->intep)
+		return 0;
+
+	spin_lock_init(&q->lock);
+	q->head = q->tail = q->overflow = 0;
+	INIT_WORK(&q->work, ptpfs_event_work, sb);
+
+	q->wq = create_singlethread_workqueue("ptpfs_event");
+	q->buf = kmalloc(PTP_USB_EVENT_LEN, GFP_KERNEL);
+	q->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (q->wq == NULL || q->buf == NULL || q->urb == NULL)
+		goto error;
+
+	usb_fill_int_urb(q->urb, dev->udev, usb_rcvintpipe(dev->udev, dev->intep),
+	                 q->buf, PTP_USB_EVENT_LEN, ptp_event_complete, sb, dev->intep_interval);
+	if (usb_submit_urb(q->urb, GFP_KERNEL))
+		goto error;
+	return 0;
+
+error:
+	printk("===== ptp_event_start error, events disabled =====\n");
+	if (q->urb) usb_free_urb(q->urb);
+	if (q->buf) kfree(q->buf);
+	if (q->wq) destroy_workqueue(q->wq);
+	q->urb = NULL;
+	q->buf = NULL;
+	q->wq = NULL;
+	return -ENOMEM;
+}
+
+void ptp_event_stop(struct ptpfs_sb_info *sb)
+{
+	struct ptp_event_queue *q = &sb->usb_device->events;
+
+	if (q->urb == NULL)
+		return;
+	usb_kill_urb(q->urb);
+	destroy_workqueue(q->wq);	// waits for the worker
+	usb_free_urb(q->urb);
+	kfree(q->buf);
+	q->urb = NULL;
+	q->buf = NULL;
+	q->wq = NULL;
+}
+//=========================================================================
+
+//=========================================================================
+//	abort a GetObject stream that readpage did not read to the end
+//=========================================================================
+
+/*
+ * ptp_usb_cancel:
+ * Still Image class Cancel Request for the transaction, then poll Get Device
+ * Status until the device is idle again.  Returns 0 on success, < 0 if the
+ * device does not support or rejected the cancel.
+ */
+static int ptp_usb_cancel(struct ptpfs_sb_info *sb, __u32 transaction_id)
+{
+	struct usb_device *udev = sb->usb_device->udev;
+	int ifnum = sb->usb_device->ifnum;
+	unsigned char *buf;
+	__u16 code;
+	int ret;
+	int x;
+
+	buf = (unsigned char *)ptp_container_get(sb);
+
+	// control data is always little endian: CancellationCode, TransactionID
+	put_unaligned(cpu_to_le16(PTP_USB_CANCEL_CODE), (__u16 *)buf);
+	put_unaligned(cpu_to_le32(transaction_id), (__u32 *)&buf[2]);
+	ret = usb_control_msg(udev, usb_sndctrlpipe(udev,0), PTP_USB_REQ_CANCEL,
+	                      USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+	                      0, ifnum, buf, 6, HZ);
+	if (ret < 0)
+	{
+		ptp_container_put(sb, buf);
+		return ret;
+	}
+
+	ret = -EIO;
+	for (x = 0; x < PTP_CANCEL_POLLS; x++)
+	{
+		// wLength, Code, [stalled endpoints]
+		if (usb_control_msg(udev, usb_rcvctrlpipe(udev,0), PTP_USB_REQ_GET_DEVICE_STATUS,
+		                    USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+		                    0, ifnum, buf, PTP_USB_DEVICE_STATUS_LEN, HZ) < 4)
+			break;
+		code = le16_to_cpu(get_unaligned((__u16 *)&buf[2]));
+		if (code == PTP_RC_OK)
+		{
+			ret = 0;
+			break;
+		}
+		if (code != PTP_RC_DeviceBusy && code != PTP_RC_TransactionCanceled)
+			break;
+		msleep(PTP_CANCEL_POLL_MS);
+	}
+	ptp_container_put(sb, buf);
+
+	/*	the ring keeps running until the cancel is known to have worked, a
+		failed cancel is drained through ptp_stream_read and must not lose
+		the segments the ring URBs already hold */
+	if (ret == 0)
+		ptp_ring_stop(sb);
+
+	/*	the device may have stalled the pipes to abort the data phase.  This
+		is part of the cancel, not a stall we hit, so it isn't counted */
+	usb_clear_halt(udev, usb_rcvbulkpipe(udev, sb->usb_device->inep));
+	usb_clear_halt(udev, usb_sndbulkpipe(udev, sb->usb_device->outep));
+	if (ret == 0)
+		sb->usb_device->stats.cancels++;
+	return ret;
+}
+
+//	read and throw away the rest of the data phase, then the response
+static int ptp_stream_drain(struct ptpfs_sb_info *sb, struct ptp_data_buffer *buf)
+{
+	unsigned char *tmp;
+	int x;
+
+	if (buf->num_blocks >= buf->num_seg)	// response was already read
+		return 0;
+
+	tmp = ptp_seg_alloc(sb);
+	if (tmp == NULL)
+		return -ENOMEM;
+	for (x = buf->num_blocks; x < buf->num_seg; x++)
+	{
+		int ret = ptp_stream_read(sb, tmp, sb->seg_size);
+
+		if (ret < 0)
+		{
+			printk("==== ptp_stream_drain ! ptp_stream_read error ! ====\n");
+			ptp_seg_free(tmp);
+			return -EIO;
+		}
+		sb->usb_device->stats.drained += ret;
+	}
+	ptp_seg_free(tmp);
+
+	if (ptp_usb_getresp(buf->sb_temp, buf->ptp_temp) != PTP_RC_OK)
+		printk("can't get response !!!!!\n");
+	return 0;
+}
+
+static void ptp_stream_free(struct ptp_data_buffer *buf)
+{
+	int nblocks = buf->num_seg > MAX_SEG_NUM ? MAX_SEG_NUM : buf->num_seg;
+	int x;
+
+	for (x = 0; x < nblocks; x++)
+	{
+		if (buf->blocks[x].block_size)
+			ptp_seg_free(buf->blocks[x].block);
+	}
+	kfree(buf->blocks);
+	kfree(buf->ptp_temp);
+	kfree(buf);
+}
+
+/*
+ * __ptp_stream_abort:
+ * Finish the GetObject transaction whose data phase is still on the wire.
+ * Cancelling frees the device within milliseconds, devices that reject the
+ * cancel are drained.  Call with usb_device->sem held.
+ */
+int __ptp_stream_abort(struct ptpfs_sb_info *sb)
+{
+	struct ptp_data_buffer *buf = sb->private_data;
+	int ret = 0;
+
+	if (sb->read_condition != 1 || buf == NULL)
+		return 0;
+
+	if (buf->num_blocks < buf->num_seg)
+	{
+		if (ptp_usb_cancel(sb, buf->ptp_temp->transactionID) < 0)
+			ret = ptp_stream_drain(sb, buf);
+	}
+	ptp_ring_stop(sb);
+
+	ptp_stream_free(buf);
+	sb->private_data = NULL;
+	sb->read_condition = 2;
+	return ret;
+}
+
+int ptp_stream_abort(struct ptpfs_sb_info *sb)
+{
+	int ret;
+
+	down(&sb->usb_device->sem);
+	ret = __ptp_stream_abort(sb);
+	up (&sb->usb_device->sem);
+	return ret;
+}
+//=========================================================================
+
+static __u16 ptp_usb_sendreq(struct ptpfs_sb_info *sb, struct ptp_container* req)
+{
+    //printk(KERN_INFO "%s\n",__FUNCTION__);
+    __u16 ret;
+    struct ptp_usb_bulkcontainer *usbreq;
+
+	// before sendreq action, if the stream is not read over, cancel (or drain) it first.
+
+	if(sb->read_condition == 1)	
+		__ptp_stream_abort(sb);
+
+
+//=================================
+
+
+    /* build appropriate USB container */
+    usbreq = ptp_container_get(sb);
+    usbreq->length=htod32p(sb,PTP_USB_BULK_REQ_LEN-(sizeof(__u32)*(5-req->nparam)));
+    usbreq->type=htod16p(sb,PTP_USB_CONTAINER_COMMAND);
+    usbreq->code=htod16p(sb,req->code);
+    usbreq->trans_id=htod32p(sb,req->transactionID);
+    usbreq->payload.params.param1=htod32p(sb,req->param1);
+    usbreq->payload.params.param2=htod32p(sb,req->param2);
+    usbreq->payload.params.param3=htod32p(sb,req->param3);
+    usbreq->payload.params.param4=htod32p(sb,req->param4);
+    usbreq->payload.params.param5=htod32p(sb,req->param5);
+    /* send it to responder */
+    ret=ptp_io_write(sb,(unsigned char *)usbreq,PTP_USB_BULK_REQ_LEN-(sizeof(__u32)*(5-req->nparam)));
+    ptp_container_put(sb, usbreq);
+
+	if (ret < 0 )
+	{
+        ret = PTP_ERROR_IO;
+		return ret; 
+	}
+    return PTP_RC_OK;
+}
+
+
+/*
+ * ptp_usb_senddata:
+ * the container header shifts the data by 12 bytes, so the blocks can not
+ * be handed to the host controller as they are.  Header and data are copied
+ * into one staging segment at a time and every segment goes out as a single
+ * URB, or one scatter-gather request over the pages of a vmalloc'd segment.
+ * Segments are whole packets, so only the last transfer is short; a data
+ * phase that ends on a packet boundary is closed by a zero length packet.
+ */
+static __u16 ptp_usb_senddata(struct ptpfs_sb_info *sb, struct ptp_container* ptp, struct ptp_data_buffer *data, unsigned int size)
+{
+    //printk(KERN_INFO "%s\n",__FUNCTION__);
+	int maxpacket = sb->usb_device->outep_maxpacket ? sb->usb_device->outep_maxpacket : PTP_USB_BULK_HS_MAX_PACKET_LEN;
+	unsigned int total = size + PTP_USB_BULK_HDR_LEN;
+	unsigned int sent = 0;
+	unsigned int seg;
+	unsigned int len;
+	unsigned char *buf;
+	int block = 0;
+	int offset = 0;
+	int toCopy;
+	int ret = 0;
+
+	// SendObjectInfo and other small data phases fit one container
+	if (total <= PTP_CONTAINER_SIZE)
+	{
+		buf = (unsigned char *)ptp_container_get(sb);
+		seg = PTP_CONTAINER_SIZE;
+	}
+	else
+	{
+		buf = ptp_seg_alloc(sb);
+		if (buf == NULL)
+			return PTP_ERROR_IO;
+		seg = ptp_seg_out(sb);
+	}
+
+	ptp_data_header(sb, buf, ptp, total);
+	len = PTP_USB_BULK_HDR_LEN;
+
+	for (;;)
+	{
+		while (len < seg && sent < size && block < data->num_blocks)
+		{
+			toCopy = min(seg - len, size - sent);
+			toCopy = min(toCopy, data->blocks[block].block_size - offset);
+			memcpy(&buf[len], &data->blocks[block].block[offset], toCopy);
+			len += toCopy;
+			sent += toCopy;
+			offset += toCopy;
+			if (offset >= data->blocks[block].block_size)
+			{
+				block++;
+				offset = 0;
+			}
+		}
+		if (sent < size && len < seg)
+		{
+			printk(KERN_INFO "ptpfs: senddata blocks end %u bytes short\n", size - sent);
+			ret = -EINVAL;
+			break;
+		}
+		ret = ptp_io_write(sb, buf, len);
+		if (ret < 0 || sent == size)
+			break;
+		len = 0;
+	}
+	if (ret >= 0 && total % maxpacket == 0)
+		ret = ptp_io_write_zlp(sb);
+
+	if (total <= PTP_CONTAINER_SIZE)
+		ptp_container_put(sb, buf);
+	else
+		ptp_seg_free(buf);
+	if (ret < 0)
+	{
+		return PTP_ERROR_IO;
+	}
+	return PTP_RC_OK;
+}
+
+
+//=========================================================================
+//	SendObject stream
+//
+//	the data phase of SendObject is fed from the page cache by
+//	ptpfs_upload_flush() and ptpfs_writepages() instead of being built in
+//	memory first.  The object was announced with SendObjectInfo, so the
+//	container length is known when it starts.  Segments are the ones of
+//	ptp_usb_senddata(), whole bulk-out packets.
+//=========================================================================
+/*
+ * __ptp_upload_abort:
+ * another transaction needs the device while the data phase is open.  The
+ * object is short, cancel it instead of leaving the device waiting for
+ * data.  The owner finds streaming cleared.  Call with usb_device->sem held.
+ */
+void __ptp_upload_abort(struct ptpfs_sb_info *sb)
+{
+	struct ptp_upload *upload = sb->upload;
+
+	if (upload == NULL || !upload->streaming)
+		return;
+	if (ptp_usb_cancel(sb, upload->ptp.transactionID) < 0)
+		printk(KERN_INFO "ptpfs: upload of 0x%x could not be cancelled\n", upload->handle);
+	upload->streaming = 0;
+}
 
-    return retval;
+void ptp_upload_cancel(struct ptpfs_sb_info *sb)
+{
+	down(&sb->usb_device->sem);
+	__ptp_upload_abort(sb);
+	up (&sb->usb_device->sem);
 }
 
-__u16 ptp_usb_getresp(struct ptpfs_sb_info *sb, struct ptp_container* resp)
+/**
+ * ptp_upload_start:
+ * params:	struct ptp_upload *upload	- size is the object size given to SendObjectInfo
+ *
+ * Sends the SendObject request and stages the data container header; the
+ * header goes out with the first packet of data.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_upload_start(struct ptpfs_sb_info *sb, struct ptp_upload *upload)
 {
-    //printk(KERN_INFO "%s\n",__FUNCTION__);
-    int ret;
+	__u16 ret;
 
-    struct ptp_usb_bulkcontainer *usbresp;
-    struct ptp_usb_bulkcontainer *usbresp_org;
-	usbresp_org = kmalloc(1024, GFP_KERNEL);
-    memset(usbresp_org,0,1024);
+	upload->buf = ptp_seg_alloc(sb);
+	if (upload->buf == NULL)
+		return PTP_ERROR_IO;
 
-	usbresp = check_alignment(usbresp_org);
-    ret=ptp_io_read(sb,(unsigned char *)usbresp, sizeof(*usbresp));
+	memset(&upload->ptp,0,sizeof(upload->ptp));
+	if (ptp_operation_issupported(sb,PTP_OC_EK_SendFileObject))
+		upload->ptp.code=PTP_OC_EK_SendFileObject;
+	else
+		upload->ptp.code=PTP_OC_SendObject;
+	upload->ptp.nparam=0;
 
-    if (ret < 0)
+	down(&sb->usb_device->sem);
+	if (sb->usb_device->udev == NULL)
 	{
-		printk("===== usbresp error 1 =====\n");
-		kfree(usbresp_org);
-        return PTP_ERROR_IO;
+		up (&sb->usb_device->sem);
+		ptp_seg_free(upload->buf);
+		upload->buf = NULL;
+		return PTP_ERROR_BADPARAM;
 	}
-    else if (dtoh16p(sb,usbresp->type)!=PTP_USB_CONTAINER_RESPONSE)
+	if (sb->read_condition == 1)
+		__ptp_stream_abort(sb);
+	upload->ptp.transactionID=sb->transaction_id++;
+	upload->ptp.sessionID=sb->session_id;
+	ptp_stats_start(sb, upload->ptp.code);
+
+	ret = ptp_usb_sendreq(sb, &upload->ptp);
+	if (ret == PTP_RC_OK)
 	{
-		printk("===== usbresp error 2 =====\n");
-		kfree(usbresp_org);
-        return PTP_ERROR_RESP_EXPECTED;
+		// over 4GB the device reads up to the short packet
+		ptp_data_header(sb, upload->buf, &upload->ptp, upload->size + PTP_USB_BULK_HDR_LEN);
+		upload->len = PTP_USB_BULK_HDR_LEN;
+		upload->sent = 0;
+		upload->streaming = 1;
 	}
-//    else if (( dtoh16p(sb,usbresp.code))!=resp->code)
-    else if (( dtoh16p(sb,usbresp->code))!=PTP_RC_OK) //0x2001
+	up (&sb->usb_device->sem);
+
+	if (ret != PTP_RC_OK)
 	{
-		kfree(usbresp_org);
-		return dtoh16p(sb,usbresp->code);
+		ptp_seg_free(upload->buf);
+		upload->buf = NULL;
 	}
-    // build an appropriate PTPContainer 
-    resp->code=dtoh16p(sb,usbresp->code);
-    resp->sessionID=sb->session_id;
-    resp->transactionID=dtoh32p(sb,usbresp->trans_id);
-    resp->param1=dtoh32p(sb,usbresp->payload.params.param1);
-    resp->param2=dtoh32p(sb,usbresp->payload.params.param2);
-    resp->param3=dtoh32p(sb,usbresp->payload.params.param3);
-    resp->param4=dtoh32p(sb,usbresp->payload.params.param4);
-    resp->param5=dtoh32p(sb,usbresp->payload.params.param5);
-//	printk("code : %x, sessionID : %x, transactionID : %x, 1 : %x, 2 : %x", resp->code, resp->sessionID, resp->transactionID, resp->param1, resp->param2);
-
-	kfree(usbresp_org);
-    return PTP_RC_OK;
+	return ret;
 }
 
-static __u16 ptp_usb_sendreq(struct ptpfs_sb_info *sb, struct ptp_container* req)
+/*
+ * ptp_upload_write:
+ * copy count bytes behind the staged ones and send every full segment.
+ * The tail waits for the next call, so only the last packet of the data
+ * phase is short.  Returns the bytes taken or < 0.
+ */
+ssize_t ptp_upload_write(struct ptpfs_sb_info *sb, struct ptp_upload *upload, const unsigned char *buf, size_t count)
 {
-    //printk(KERN_INFO "%s\n",__FUNCTION__);
-    __u16 ret;
-    struct ptp_usb_bulkcontainer usbreq;
+	unsigned int seg = ptp_seg_out(sb);
+	size_t done = 0;
+	int toCopy;
+	int ret;
 
-	// before sendreq action, if the stream is not read over, we read it first.  
+	if (count > upload->size - upload->sent)
+		return -EFBIG;
 
-	if(sb->read_condition == 1)	
+	while (done < count)
 	{
-		struct ptp_data_buffer *buf = sb->private_data;
-		int x;
-
-		for (x = buf->num_blocks; x < buf->num_seg; x++ )
-		{	
-			if (x == buf->num_blocks)
-			{
-				buf->blocks[1].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-				buf->blocks[1].block_size = MAX_SEG_SIZE;
-			}
-	
-			memset(buf->blocks[1].block,0,MAX_SEG_SIZE);
-			if (buf->blocks[1].block == NULL)
-			{
-				printk("==== release function ! kmalloc error! ====\n");
-				ptp_free_data_buffer(buf);
-				return PTP_ERROR_IO;	
-			}
-
-			ret=ptp_io_read(sb,buf->blocks[1].block,MAX_SEG_SIZE);
-			if (ret < 0)
-			{
-				printk("==== release function ! ptp_io_read error ! ====\n");
-				ptp_free_data_buffer(buf);
-				return PTP_ERROR_IO;
-			}
-			if (x == buf->num_seg-1) 
-			{	
-				kfree(buf->blocks[1].block);
-			}
-		} //end for
-
-//		down(&sb->usb_device->sem);
-		ret = ptp_usb_getresp(buf->sb_temp, buf->ptp_temp);
-//		up (&sb->usb_device->sem);
-		if(ret < 0)
-			printk("can't get response !!!!!\n");
+		toCopy = min_t(size_t, seg - upload->len, count - done);
+		memcpy(&upload->buf[upload->len], buf + done, toCopy);
+		upload->len += toCopy;
+		upload->sent += toCopy;
+		done += toCopy;
+		if (upload->len < seg)
+			break;
+
+		down(&sb->usb_device->sem);
+		ret = upload->streaming ? ptp_io_write(sb, upload->buf, upload->len) : -EIO;
+		if (ret < 0)
+			__ptp_upload_abort(sb);
+		up (&sb->usb_device->sem);
+		if (ret < 0)
+			return ret;
+		upload->len = 0;
+	}
+	return done;
+}
 
-		kfree(buf->ptp_temp);			
-		kfree(buf->blocks);
-		kfree(buf);
-		buf = NULL;		
-		sb->private_data = NULL;
-		sb->read_condition = 2;
-	}	//end if (sb_info->read_condition == 1)
+/**
+ * ptp_upload_finish:
+ * params:	struct ptp_upload *upload	- started by ptp_upload_start()
+ *
+ * Sends the staged tail, a zero length packet if the data phase ended on a
+ * packet boundary, and reads the response.  An upload that got fewer bytes
+ * than announced is cancelled.  The staging buffer is freed.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_upload_finish(struct ptpfs_sb_info *sb, struct ptp_upload *upload)
+{
+	int maxpacket = sb->usb_device->outep_maxpacket ? sb->usb_device->outep_maxpacket : PTP_USB_BULK_HS_MAX_PACKET_LEN;
+	__u16 ret = PTP_RC_OK;
 
+	down(&sb->usb_device->sem);
+	if (!upload->streaming)
+		ret = PTP_ERROR_IO;
+	else if (upload->sent != upload->size)
+	{
+		__ptp_upload_abort(sb);
+		ret = PTP_ERROR_IO;
+	}
+	else
+	{
+		if (upload->len && ptp_io_write(sb, upload->buf, upload->len) < 0)
+			ret = PTP_ERROR_IO;
+		// maxpacket is a power of two, the low 32 bits of the length are enough
+		else if (((__u32)upload->size + PTP_USB_BULK_HDR_LEN) % maxpacket == 0 && ptp_io_write_zlp(sb) < 0)
+			ret = PTP_ERROR_IO;
+		else
+			ret = ptp_usb_getresp(sb, &upload->ptp);
+		upload->streaming = 0;
+	}
+	if (ret != PTP_RC_OK && sb->usb_device->stats.cur)
+		sb->usb_device->stats.cur->errors++;
+	up (&sb->usb_device->sem);
 
-//=================================
+	ptp_seg_free(upload->buf);
+	upload->buf = NULL;
+	return ret;
+}
+//=========================================================================
 
 
-    /* build appropriate USB container */
-    usbreq.length=htod32p(sb,PTP_USB_BULK_REQ_LEN-(sizeof(__u32)*(5-req->nparam)));
-    usbreq.type=htod16p(sb,PTP_USB_CONTAINER_COMMAND);
-    usbreq.code=htod16p(sb,req->code);
-    usbreq.trans_id=htod32p(sb,req->transactionID);
-    usbreq.payload.params.param1=htod32p(sb,req->param1);
-    usbreq.payload.params.param2=htod32p(sb,req->param2);
-    usbreq.payload.params.param3=htod32p(sb,req->param3);
-    usbreq.payload.params.param4=htod32p(sb,req->param4);
-    usbreq.payload.params.param5=htod32p(sb,req->param5);
-    /* send it to responder */
-    ret=ptp_io_write(sb,(unsigned char *)&usbreq,PTP_USB_BULK_REQ_LEN-(sizeof(__u32)*(5-req->nparam)));
+//	a data phase that was a multiple of wMaxPacketSize is closed by a zero length packet
+static void ptp_usb_eat_zlp(struct ptpfs_sb_info *sb, unsigned int container_len, unsigned char *buf, int maxpacket)
+{
+	if (container_len % maxpacket == 0)
+		ptp_io_read(sb, buf, maxpacket);
+}
 
-	if (ret < 0 )
+/*
+ * data phase received straight into page cache pages.
+ * The caller asks for the object from (page offset - (wMaxPacketSize - header)),
+ * so the first packet holds the container header and the tail of the previous
+ * page, and every packet after it lands page aligned.  data->count returns the
+ * number of bytes that went into the pages.
+ */
+static __u16 ptp_usb_getdata_pages(struct ptpfs_sb_info *sb, struct ptp_container* ptp, struct ptp_data_buffer *data)
+{
+	struct ptp_usb_bulkcontainer *hdr;
+	struct usb_sg_request io;
+	struct scatterlist *sg;
+	int maxpacket = sb->usb_device->inep_maxpacket;
+	int pipe = usb_rcvbulkpipe(sb->usb_device->udev, sb->usb_device->inep);
+	unsigned int len;
+	unsigned int remain;
+	int ret;
+	int x;
+
+	hdr = ptp_container_get(sb);
+
+	ret = ptp_io_read(sb, (unsigned char *)hdr, maxpacket);
+	if (ret < PTP_USB_BULK_HDR_LEN)
 	{
-        ret = PTP_ERROR_IO;
-		return ret; 
+		ptp_container_put(sb, hdr);
+		return PTP_ERROR_IO;
+	}
+	if (dtoh16p(sb,hdr->type)!=PTP_USB_CONTAINER_DATA)
+	{
+		ptp_container_put(sb, hdr);
+		return PTP_ERROR_DATA_EXPECTED;
+	}
+	if (dtoh16p(sb,hdr->code)!=ptp->code)
+	{
+		ret = dtoh16p(sb,hdr->code);
+		ptp_container_put(sb, hdr);
+		return ret;
 	}
-    return PTP_RC_OK;
-}
-
 
-static __u16 ptp_usb_senddata(struct ptpfs_sb_info *sb, struct ptp_container* ptp, struct ptp_data_buffer *data, unsigned int size)
-{
-    //printk(KERN_INFO "%s\n",__FUNCTION__);
-    int ret,block,bytesCopied,bytesToCopy,offset;
+	len = dtoh32p(sb,hdr->length);
+	data->count = 0;
+	if (len <= maxpacket)
+	{
+		// a payload of exactly one packet is still followed by a zero length packet
+		ptp_usb_eat_zlp(sb, len, (unsigned char *)hdr, maxpacket);
+		ptp_container_put(sb, hdr);
+		return PTP_RC_OK;
+	}
+	remain = len - maxpacket;
+	if (remain > data->nr_pages << PAGE_SHIFT)
+	{
+		ptp_container_put(sb, hdr);
+		return PTP_ERROR_BADPARAM;
+	}
 
-    unsigned char buf[512];
-    struct ptp_usb_bulkcontainer *usbdata;
-    usbdata = (struct ptp_usb_bulkcontainer*)buf;
+	sg = kmalloc(data->nr_pages*sizeof(struct scatterlist), GFP_KERNEL);
+	if (sg == NULL)
+	{
+		ptp_container_put(sb, hdr);
+		return PTP_ERROR_IO;
+	}
+	memset(sg, 0, data->nr_pages*sizeof(struct scatterlist));
+	for (x = 0; x < data->nr_pages && (x << PAGE_SHIFT) < remain; x++)
+	{
+		sg[x].page = data->pages[x];
+		sg[x].offset = 0;
+		sg[x].length = min((unsigned int)PAGE_SIZE, remain - (x << PAGE_SHIFT));
+	}
 
+	ret = usb_sg_init(&io, sb->usb_device->udev, pipe, 0, sg, x, remain, GFP_KERNEL);
+	if (ret == 0)
+	{
+		usb_sg_wait(&io);
+		ret = io.status;
+		if (ret == -EPIPE)
+			ptp_clear_halt(sb, pipe);
+	}
+	kfree(sg);
+	if (ret && ret != -EREMOTEIO)
+	{
+		ptp_container_put(sb, hdr);
+		return PTP_ERROR_IO;
+	}
+	data->count = io.bytes;
+	ptp_stats_in(sb, io.bytes);
 
-    // build appropriate USB container 
-    usbdata->length=htod32p(sb,PTP_USB_BULK_HDR_LEN+size);
-    usbdata->type=htod16p(sb,PTP_USB_CONTAINER_DATA);
-    usbdata->code=htod16p(sb,ptp->code);
-    usbdata->trans_id=htod32p(sb,ptp->transactionID);
-    if (size < (512-PTP_USB_BULK_HDR_LEN))
-    {
-        memcpy(&buf[PTP_USB_BULK_HDR_LEN],data->blocks[0].block,size);
-        ret=ptp_io_write(sb,buf, size+PTP_USB_BULK_HDR_LEN);
-    }
-    else
-    {
-        bytesCopied = (512-PTP_USB_BULK_HDR_LEN);
-        memcpy(&buf[PTP_USB_BULK_HDR_LEN],data->blocks[0].block,bytesCopied);
-        ret=ptp_io_write(sb,buf, 512);
-        offset = bytesCopied;
-        block = 0;
-        while (bytesCopied < size)
-        {
-            bytesToCopy = data->blocks[block].block_size-offset;
-            if (bytesToCopy > 512) bytesToCopy = 512;
-            memcpy(buf,&data->blocks[block].block[offset],bytesToCopy);
-            offset += bytesToCopy;
-            if (offset >= data->blocks[block].block_size)
-            {
-                block++;
-                offset = 0;
-            }
-            if (bytesToCopy < 512 && (bytesToCopy+bytesCopied) < size)
-            {
-                int toCopy = 512-bytesToCopy;
-                if (toCopy > data->blocks[block].block_size) toCopy = data->blocks[block].block_size;
-                memcpy(&buf[bytesToCopy],data->blocks[block].block,toCopy);
-                offset = toCopy;
-                bytesToCopy += toCopy;
-            }
-            ret=ptp_io_write(sb,buf,bytesToCopy);
-            if (ret < 0)
-            {
-                return PTP_ERROR_IO;
-            }
-            bytesCopied += bytesToCopy;
-        }
-    }
-    if (ret < 0)
-    {
-        return PTP_ERROR_IO;
-    }
-    return PTP_RC_OK;
+	ptp_usb_eat_zlp(sb, len, (unsigned char *)hdr, maxpacket);
+	ptp_container_put(sb, hdr);
+	return PTP_RC_OK;
 }
 
-
 //operation code for request and data are the same,so only response need to check 0x2001(ok)
 static __u16 ptp_usb_getdata(struct ptpfs_sb_info *sb, struct ptp_container* ptp, struct ptp_data_buffer *data)       
 {
@@ -303,33 +1485,34 @@ static __u16 ptp_usb_getdata(struct ptpfs_sb_info *sb, struct ptp_container* ptp
     int ret;
     int x;
     unsigned int len;
-//=============================================
-    struct ptp_usb_bulkcontainer *usbdata_org;
     struct ptp_usb_bulkcontainer *usbdata;
-	usbdata_org = kmalloc(1024, GFP_KERNEL);
-    memset(usbdata_org,0,1024);
-
-	usbdata = check_alignment(usbdata_org);
-//=============================================
 
+    if (data->pages != NULL)
+    {
+        return ptp_usb_getdata_pages(sb, ptp, data);
+    }
     if (data->blocks != NULL)
     {
         return PTP_ERROR_BADPARAM;
     }
     // read first(?) part of data 
-	
+	usbdata = ptp_container_get(sb);
     ret=ptp_io_read(sb,(unsigned char *)usbdata,sizeof(*usbdata));
     if (ret < 0)
     {
+        ptp_container_put(sb, usbdata);
         return PTP_ERROR_IO;
     }
     else if (dtoh16p(sb,usbdata->type)!=PTP_USB_CONTAINER_DATA)
     {
+        ptp_container_put(sb, usbdata);
         return PTP_ERROR_DATA_EXPECTED;
     }
     else if (dtoh16p(sb,usbdata->code)!=ptp->code)
     {
-        return dtoh16p(sb,usbdata->code);
+        ret = dtoh16p(sb,usbdata->code);
+        ptp_container_put(sb, usbdata);
+        return ret;
     }
     // evaluate data length 
     len=dtoh32p(sb,usbdata->length)-PTP_USB_BULK_HDR_LEN;
@@ -338,10 +1521,10 @@ static __u16 ptp_usb_getdata(struct ptpfs_sb_info *sb, struct ptp_container* ptp
 
 	if (len > PTP_USB_BULK_PAYLOAD_LEN)
 	{
-		if ( (len-PTP_USB_BULK_PAYLOAD_LEN) % MAX_SEG_SIZE == 0)
-			num_seg = (len-PTP_USB_BULK_PAYLOAD_LEN)/MAX_SEG_SIZE+1; // (500,16384,16384,...,16384)
+		if ( (len-PTP_USB_BULK_PAYLOAD_LEN) % sb->seg_size == 0)
+			num_seg = (len-PTP_USB_BULK_PAYLOAD_LEN)/sb->seg_size+1; // (500,seg_size,seg_size,...,seg_size)
 		else
-			num_seg = (len-PTP_USB_BULK_PAYLOAD_LEN)/MAX_SEG_SIZE+2; // (500,16384,16384,...,16384,remainder)
+			num_seg = (len-PTP_USB_BULK_PAYLOAD_LEN)/sb->seg_size+2; // (500,seg_size,...,seg_size,remainder)
 	}
     // allocate memory for data 
 	data->num_seg = num_seg;
@@ -352,12 +1535,17 @@ static __u16 ptp_usb_getdata(struct ptpfs_sb_info *sb, struct ptp_container* ptp
 	if (ptp->code == PTP_OC_GetObject && num_seg > MAX_SEG_NUM )  //
 	{
 		data->blocks =(struct ptp_block*)kmalloc(MAX_SEG_NUM*sizeof(struct ptp_block),GFP_KERNEL);
-		memset(data->blocks,0,MAX_SEG_NUM*sizeof(struct ptp_block));
+		if (data->blocks) memset(data->blocks,0,MAX_SEG_NUM*sizeof(struct ptp_block));
 	}
 	else
 	{
 		data->blocks =(struct ptp_block*)kmalloc(num_seg*sizeof(struct ptp_block),GFP_KERNEL);
-		memset(data->blocks,0,num_seg*sizeof(struct ptp_block));
+		if (data->blocks) memset(data->blocks,0,num_seg*sizeof(struct ptp_block));
+	}
+	if (data->blocks == NULL)
+	{
+		ptp_container_put(sb, usbdata);
+		return PTP_ERROR_IO;
 	}
 	data->num_blocks = 1;	// already read 1st block
 	data->record_blocks = 0;
@@ -365,34 +1553,44 @@ static __u16 ptp_usb_getdata(struct ptpfs_sb_info *sb, struct ptp_container* ptp
 
 	data->blocks[0].block_size = len<PTP_USB_BULK_PAYLOAD_LEN?len:PTP_USB_BULK_PAYLOAD_LEN;
 	data->blocks[0].block = kmalloc(data->blocks[0].block_size,GFP_KERNEL);
+	if (data->blocks[0].block == NULL)
+	{
+		ptp_container_put(sb, usbdata);
+		kfree(data->blocks);
+		data->blocks = NULL;
+		return PTP_ERROR_IO;
+	}
 
     memcpy(data->blocks[0].block,usbdata->payload.data,data->blocks[0].block_size);
 
+	//	the rest of the object is read by readpage, start pulling it in now
+	if (ptp->code == PTP_OC_GetObject)
+		ptp_ring_start(sb, num_seg-1);
+
 	//	maybe length of get_objecthandles will larger than 512
 	if (ptp->code != PTP_OC_GetObject) 
 	{
 		for (x = 1; x < num_seg; x++ )
 		{
-			data->blocks[x].block = kmalloc(MAX_SEG_SIZE,GFP_KERNEL);
-			data->blocks[x].block_size = MAX_SEG_SIZE;
-			memset(data->blocks[x].block,0,MAX_SEG_SIZE);
+			data->blocks[x].block = ptp_seg_alloc(sb);
+			data->blocks[x].block_size = sb->seg_size;
 			if (data->blocks[x].block == NULL)
 			{
-				kfree(usbdata_org); 
+				ptp_container_put(sb, usbdata);
 				ptp_free_data_buffer(data);
 				return PTP_ERROR_IO;
 			}
-			ret=ptp_io_read(sb,data->blocks[x].block,MAX_SEG_SIZE);
+			ret=ptp_io_read(sb,data->blocks[x].block,sb->seg_size);
 			if (ret < 0)
 			{
-				kfree(usbdata_org); 
+				ptp_container_put(sb, usbdata);
 				ptp_free_data_buffer(data);
 				return PTP_ERROR_IO;
 			}
 			data->num_blocks++;
 		}
 	}
-	kfree(usbdata_org); 
+	ptp_container_put(sb, usbdata);
     return PTP_RC_OK;
 }
 
@@ -457,15 +1655,32 @@ static __u16 ptp_transaction (struct ptpfs_sb_info *sb, struct ptp_container* pt
 
 	
     __u16 result = PTP_RC_OK;
+    __u64 t0, t1;
+    int phase = PTP_PHASE_CMD;
     ptp->transactionID=sb->transaction_id++;
     ptp->sessionID=sb->session_id;
     // send request
 
+	if (trace)
+		printk(KERN_DEBUG "ptpfs: > 0x%04x tid %u params %x %x %x\n", ptp->code, ptp->transactionID,
+		       ptp->param1, ptp->param2, ptp->param3);
+	// a stream left open is finished in sendreq, start the clock after it
+	if (sb->read_condition == 1)
+		__ptp_stream_abort(sb);
+	if (sb->upload && sb->upload->streaming)
+		__ptp_upload_abort(sb);
+	ptp_stats_start(sb, ptp->code);
+	t0 = ptp_stats_now();
+
 	result = ptp_usb_sendreq(sb, ptp);
+	t1 = ptp_stats_now();
+	ptp_stats_latency(sb, phase, t1-t0);
     if (result != PTP_RC_OK)
     {
         goto done;
     }
+	t0 = t1;
+	phase = PTP_PHASE_DATA;
     // is there a dataphase?
     switch (flags&PTP_DP_DATA_MASK)
     {
@@ -481,10 +1696,17 @@ static __u16 ptp_transaction (struct ptpfs_sb_info *sb, struct ptp_container* pt
         result = PTP_ERROR_BADPARAM;
         goto done;
     }
+	if ((flags&PTP_DP_DATA_MASK) != PTP_DP_NODATA)
+	{
+		t1 = ptp_stats_now();
+		ptp_stats_latency(sb, phase, t1-t0);
+		t0 = t1;
+	}
     if (result != PTP_RC_OK)
     {
         goto done;
     }
+	phase = PTP_PHASE_RESP;
 
 	if (!data)
 	{
@@ -506,8 +1728,15 @@ static __u16 ptp_transaction (struct ptpfs_sb_info *sb, struct ptp_container* pt
 		data->ptp_temp = ptp;
 		result = PTP_NRC_GETOBJECT;  // do not get response,readpage first;
 	}
+	if (result != PTP_NRC_GETOBJECT)
+		ptp_stats_latency(sb, phase, ptp_stats_now()-t0);
 
     done:    /* unlock the device */
+	if (result != PTP_RC_OK && result != PTP_NRC_GETOBJECT && sb->usb_device->stats.cur)
+		sb->usb_device->stats.cur->errors++;
+	if (trace)
+		printk(KERN_DEBUG "ptpfs: < 0x%04x tid %u ret 0x%04x %s\n", ptp->code, ptp->transactionID,
+		       result, ptp_phase_name[phase]);
     up (&sb->usb_device->sem);
     return result;
 }
@@ -683,6 +1912,56 @@ __u16 ptp_getobjecthandles (struct ptpfs_sb_info *sb, __u32 storage,
     return ret;
 }
 
+void ptp_free_object_list(struct ptp_object_list *list)
+{
+    __u32 x;
+
+    for (x = 0; x < list->n; x++)
+        ptp_free_object_info(&list->objects[x]);
+    if (list->handles) kfree(list->handles);
+    if (list->objects) kfree(list->objects);
+    list->handles = NULL;
+    list->objects = NULL;
+    list->n = list->max = 0;
+}
+
+/**
+ * ptp_getobjectproplist:
+ * sb:		ptpfs_sb_info
+ * handle:	folder, 0x00000000 for the root of the storages
+ * depth:	1 for the children of handle
+ * list:	filled with one ptp_object_info per object
+ *
+ * MTP GetObjectPropList with every property, the metadata of a whole folder
+ * in one transaction.
+ **/
+__u16 ptp_getobjectproplist (struct ptpfs_sb_info *sb, __u32 handle, __u32 depth,
+                             struct ptp_object_list *list)
+{
+    __u16 ret;
+    struct ptp_container ptp;
+    struct ptp_data_buffer data;
+
+    memset(&ptp,0,sizeof(ptp));
+    memset(&data,0,sizeof(data));
+
+    ptp.code=PTP_OC_MTP_GetObjectPropList;
+    ptp.param1=handle;
+    ptp.param2=0x00000000;		// any format
+    ptp.param3=PTP_OPC_All;
+    ptp.param4=0x00000000;		// no property group
+    ptp.param5=depth;
+    ptp.nparam=5;
+    ret=ptp_transaction(sb, &ptp, PTP_DP_GETDATA, 0, &data);
+    if (ret == PTP_RC_OK && ptp_unpack_OPL(sb, &data, list))
+    {
+        ptp_free_object_list(list);
+        ret = PTP_ERROR_IO;
+    }
+    ptp_free_data_buffer(&data);
+    return ret;
+}
+
 __u16 ptp_getobjectinfo (struct ptpfs_sb_info *sb, __u32 handle,
                          struct ptp_object_info* objectinfo)
 {
@@ -718,7 +1997,7 @@ void ptp_free_data_buffer(struct ptp_data_buffer *buffer)
     for (x = 0; x < free_num; x++)
 	{
 		if (buffer->blocks[x].block_size)	
-			kfree(buffer->blocks[x].block);
+			ptp_seg_free(buffer->blocks[x].block);
 	}
     kfree(buffer->blocks);
     buffer->blocks = 0;
@@ -726,6 +2005,22 @@ void ptp_free_data_buffer(struct ptp_data_buffer *buffer)
 }
 
 
+//	ptp_free_data_buffer() for data phases other than GetObject, which keep
+//	every block and may have more than MAX_SEG_NUM of them
+void ptp_free_data_blocks(struct ptp_data_buffer *buffer)
+{
+    int x;
+
+    for (x = 0; x < buffer->num_blocks; x++)
+	{
+		if (buffer->blocks[x].block_size)
+			ptp_seg_free(buffer->blocks[x].block);
+	}
+    kfree(buffer->blocks);
+    buffer->blocks = 0;
+    buffer->num_blocks = 0;
+}
+
 __u16
 ptp_getobject (struct ptpfs_sb_info *sb, __u32 handle, struct ptp_data_buffer *data)
 {
@@ -740,6 +2035,90 @@ ptp_getobject (struct ptpfs_sb_info *sb, __u32 handle, struct ptp_data_buffer *d
     return ptp_transaction(sb, ptp, PTP_DP_GETDATA, 0, data);
 }
 
+/**
+ * ptp_getpartialobject:
+ * params:	__u32 handle		- object to read
+ *		__u32 offset		- first byte of the object to read
+ *		__u32 maxbytes		- number of bytes to read
+ *		struct ptp_data_buffer *data - receives the bytes, free with ptp_free_data_buffer
+ *
+ * Ranged read of an object, the transaction is complete when this returns.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_getpartialobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 offset,
+                           __u32 maxbytes, struct ptp_data_buffer *data)
+{
+    struct ptp_container ptp;
+    memset(&ptp,0,sizeof(ptp));
+
+    ptp.code=PTP_OC_GetPartialObject;
+    ptp.param1=handle;
+    ptp.param2=offset;
+    ptp.param3=maxbytes;
+    ptp.nparam=3;
+    return ptp_transaction(sb, &ptp, PTP_DP_GETDATA, 0, data);
+}
+
+/**
+ * ptp_getpartialobject_pages:
+ * params:	__u32 handle		- object to read
+ *		struct page **pages	- locked page cache pages, consecutive indices
+ *		int nr_pages
+ *		__u32 offset		- object offset of pages[0], must be >= ptp_pages_bias()
+ *		__u32 length		- bytes wanted in the pages
+ *
+ * Reads [offset, offset+length) of the object into the pages without copying.
+ * Returns a PTP_RC_* code, *got is the number of bytes that landed in the pages.
+ **/
+__u16 ptp_getpartialobject_pages(struct ptpfs_sb_info *sb, __u32 handle, struct page **pages,
+                                 int nr_pages, __u32 offset, __u32 length, __u32 *got)
+{
+    __u16 ret;
+    int bias = ptp_pages_bias(sb);
+    struct ptp_container ptp;
+    struct ptp_data_buffer data;
+
+    memset(&ptp,0,sizeof(ptp));
+    memset(&data,0,sizeof(data));
+
+    ptp.code=PTP_OC_GetPartialObject;
+    ptp.param1=handle;
+    ptp.param2=offset-bias;
+    ptp.param3=length+bias;
+    ptp.nparam=3;
+
+    data.pages = pages;
+    data.nr_pages = nr_pages;
+    ret=ptp_transaction(sb, &ptp, PTP_DP_GETDATA, 0, &data);
+    *got = data.count;
+    return ret;
+}
+
+/**
+ * ptp_getthumb:
+ * params:	__u32 handle		- object whose thumbnail is wanted
+ *		struct ptp_data_buffer *data - receives the thumbnail, free with ptp_free_data_blocks
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_getthumb(struct ptpfs_sb_info *sb, __u32 handle, struct ptp_data_buffer *data)
+{
+    struct ptp_container ptp;
+    memset(&ptp,0,sizeof(ptp));
+
+    ptp.code=PTP_OC_GetThumb;
+    ptp.param1=handle;
+    ptp.nparam=1;
+    return ptp_transaction(sb, &ptp, PTP_DP_GETDATA, 0, data);
+}
+
+//	bytes of object data that share the first packet with the container header
+int ptp_pages_bias(struct ptpfs_sb_info *sb)
+{
+    return sb->usb_device->inep_maxpacket - PTP_USB_BULK_HDR_LEN;
+}
+
 /*
 __u16
 ptp_getobject (struct ptpfs_sb_info *sb, __u32 handle, struct ptp_data_buffer *data)
@@ -840,3 +2219,90 @@ __u16 ptp_deleteobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 ofc)
     ptp.nparam=2;
     return ptp_transaction(sb, &ptp, PTP_DP_NODATA, 0, NULL);
 }
+
+/**
+ * ptp_moveobject:
+ * params:	__u32 handle		- object to move
+ *		__u32 storage		- destination storage
+ *		__u32 parent		- destination folder, 0 for the root of the storage
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_moveobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 storage, __u32 parent)
+{
+    struct ptp_container ptp;
+    memset(&ptp,0,sizeof(ptp));
+    ptp.code=PTP_OC_MoveObject;
+    ptp.param1=handle;
+    ptp.param2=storage;
+    ptp.param3=parent;
+    ptp.nparam=3;
+    return ptp_transaction(sb, &ptp, PTP_DP_NODATA, 0, NULL);
+}
+
+/**
+ * ptp_copyobject:
+ * params:	__u32 handle		- object to copy
+ *		__u32 storage		- destination storage
+ *		__u32 parent		- destination folder, 0 for the root of the storage
+ *		__u32 *newhandle	- handle of the copy
+ *
+ * The copy is made on the device, no object data crosses the bus.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_copyobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 storage, __u32 parent, __u32 *newhandle)
+{
+    struct ptp_container ptp;
+    __u16 ret;
+
+    memset(&ptp,0,sizeof(ptp));
+    ptp.code=PTP_OC_CopyObject;
+    ptp.param1=handle;
+    ptp.param2=storage;
+    ptp.param3=parent;
+    ptp.nparam=3;
+    ret = ptp_transaction(sb, &ptp, PTP_DP_NODATA, 0, NULL);
+    *newhandle = ptp.param1;
+    return ret;
+}
+
+/**
+ * ptp_setobjectfilename:
+ * params:	__u32 handle		- object to rename
+ *		char *filename
+ *
+ * MTP SetObjectPropValue of ObjectFileName, PTP has no rename.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+__u16 ptp_setobjectfilename(struct ptpfs_sb_info *sb, __u32 handle, char *filename)
+{
+    struct ptp_container ptp;
+    struct ptp_data_buffer data;
+    struct ptp_block block;
+    __u8 len;
+    __u16 ret;
+
+    if (strlen(filename) >= PTP_MAXSTRLEN)
+        return PTP_ERROR_BADPARAM;
+
+    memset(&data,0,sizeof(data));
+    block.block_size = (strlen(filename)+1)*2+1;
+    block.block = kmalloc(block.block_size, GFP_KERNEL);
+    if (block.block == NULL)
+        return PTP_ERROR_IO;
+    memset(block.block, 0, block.block_size);
+    data.blocks = &block;
+    data.num_blocks = 1;
+    ptp_pack_string(sb, filename, &data, 0, &len);
+
+    memset(&ptp,0,sizeof(ptp));
+    ptp.code=PTP_OC_MTP_SetObjectPropValue;
+    ptp.param1=handle;
+    ptp.param2=PTP_OPC_ObjectFileName;
+    ptp.nparam=2;
+    ret = ptp_transaction(sb, &ptp, PTP_DP_SENDDATA, block.block_size, &data);
+    kfree(block.block);
+    return ret;
+}
@@ -37,6 +37,31 @@
 #define PTP_OC_EK_SendFileObjectInfo	0x9005
 #define PTP_OC_EK_SendFileObject	0x9006
 
+// Microsoft MTP extension Operation Codes
+#define PTP_OC_MTP_GetObjectPropsSupported	0x9801
+#define PTP_OC_MTP_GetObjectPropDesc		0x9802
+#define PTP_OC_MTP_GetObjectPropValue		0x9803
+#define PTP_OC_MTP_SetObjectPropValue		0x9804
+#define PTP_OC_MTP_GetObjectPropList		0x9805
+#define PTP_OC_MTP_SetObjectPropList		0x9806
+#define PTP_OC_MTP_SendObjectPropList		0x9808
+#define PTP_OC_MTP_GetObjectReferences		0x9810
+#define PTP_OC_MTP_SetObjectReferences		0x9811
+
+// MTP Object Property Codes
+#define PTP_OPC_StorageID			0xDC01
+#define PTP_OPC_ObjectFormat			0xDC02
+#define PTP_OPC_ProtectionStatus		0xDC03
+#define PTP_OPC_ObjectSize			0xDC04
+#define PTP_OPC_AssociationType			0xDC05
+#define PTP_OPC_AssociationDesc			0xDC06
+#define PTP_OPC_ObjectFileName			0xDC07
+#define PTP_OPC_DateCreated			0xDC08
+#define PTP_OPC_DateModified			0xDC09
+#define PTP_OPC_Keywords			0xDC0A
+#define PTP_OPC_ParentObject			0xDC0B
+#define PTP_OPC_All				0xFFFFFFFF
+
 
 
 // DataType Codes 
@@ -102,6 +127,23 @@
 #define PTP_RC_TransactionCanceled      0x201F
 #define PTP_RC_SpecificationOfDestinationUnsupported            0x2020
 
+// Event Codes
+#define PTP_EC_Undefined                0x4000
+#define PTP_EC_CancelTransaction        0x4001
+#define PTP_EC_ObjectAdded              0x4002
+#define PTP_EC_ObjectRemoved            0x4003
+#define PTP_EC_StoreAdded               0x4004
+#define PTP_EC_StoreRemoved             0x4005
+#define PTP_EC_DevicePropChanged        0x4006
+#define PTP_EC_ObjectInfoChanged        0x4007
+#define PTP_EC_DeviceInfoChanged        0x4008
+#define PTP_EC_RequestObjectTransfer    0x4009
+#define PTP_EC_StoreFull                0x400A
+#define PTP_EC_DeviceReset              0x400B
+#define PTP_EC_StorageInfoChanged       0x400C
+#define PTP_EC_CaptureComplete          0x400D
+#define PTP_EC_UnreportedStatus         0x400E
+
 #define PTP_NRC_GETOBJECT			0x20FF // not yet to get response , we read file data in readpage first 
 
 
@@ -141,6 +183,16 @@ struct ptp_container
 #define PTP_USB_BULK_PAYLOAD_LEN	(PTP_USB_BULK_HS_MAX_PACKET_LEN-PTP_USB_BULK_HDR_LEN)
 #define PTP_USB_BULK_REQ_LEN	        (PTP_USB_BULK_HDR_LEN+5*sizeof(__u32))
 
+// Still Image class requests
+#define PTP_USB_REQ_CANCEL			0x64
+#define PTP_USB_REQ_GET_DEVICE_STATUS		0x67
+#define PTP_USB_CANCEL_CODE			0x4001
+#define PTP_USB_DEVICE_STATUS_LEN		20	// wLength, Code and up to 4 endpoint params
+#define PTP_CANCEL_POLLS			200
+#define PTP_CANCEL_POLL_MS			5
+
+#define PTP_USB_EVENT_LEN		(PTP_USB_BULK_HDR_LEN+3*sizeof(__u32))
+
 // USB container types
 #define PTP_USB_CONTAINER_UNDEFINED		0x0000
 #define PTP_USB_CONTAINER_COMMAND		0x0001
@@ -168,6 +220,18 @@ struct ptp_usb_bulkcontainer
     } payload;
 };
 
+// interrupt endpoint event, at most three parameters
+struct ptp_usb_eventcontainer
+{
+    __u32 length;
+    __u16 type;
+    __u16 code;
+    __u32 trans_id;
+    __u32 param1;
+    __u32 param2;
+    __u32 param3;
+};
+
 
 
 
@@ -296,6 +360,15 @@ struct ptp_object_handles
     __u32 *handles;
 };
 
+// GetObjectPropList result, objects[x] describes handles[x]
+struct ptp_object_list
+{
+    __u32 n;
+    __u32 max;
+    __u32 *handles;
+    struct ptp_object_info *objects;
+};
+
 struct ptp_object_info
 {
     __u32 storage_id;
@@ -376,12 +449,16 @@ struct ptp_data_buffer {
 	*/
 	int record_blocks;		
 		
-	int offset;		//	record the last readpage offset
+	loff_t offset;		//	record the last readpage offset
 	int count;			//	record how much block(bytes) already be read to pages, if offset is in 3rd_block,count = 1st_block_size + 2nd_block_size
 
     //for get DATA,get_response will be executed in readpage
     struct ptpfs_sb_info *sb_temp;
     struct ptp_container *ptp_temp;
+
+    //	set by readpages: receive the data phase straight into these page cache pages
+    struct page **pages;
+    int nr_pages;
 };
 
 #endif
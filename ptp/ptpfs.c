@@ -13,6 +13,11 @@
 #include <linux/spinlock.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
+#include <linux/debugfs.h>
 
 #include <linux/string.h>
 #include <asm/uaccess.h>
@@ -53,10 +58,6 @@ static DEFINE_MUTEX (ptp_devices_mutex);
 static DEFINE_MUTEX (ptp_mount_mutex);
 static struct ptpfs_input *input_data;
 
-#define PASSPORT_FREE 0xff
-extern DEFINE_MUTEX (ptp_passport_mutex);
-extern ptp_passport_mutex;
-extern unsigned char passport;
 
 void force_delete(struct inode *inode)
 {
@@ -71,6 +72,8 @@ void force_delete(struct inode *inode)
 static inline void ptp_usb_device_delete (struct ptpfs_usb_device_info *dev)
 {
     ptp_devices[dev->minor] = NULL;
+    ptp_ring_free(dev);
+    ptp_stats_unregister(dev);
     kfree(dev);
 }
 
@@ -79,7 +82,11 @@ void ptpfs_set_inode_info(struct inode *ino, struct ptp_object_info *object)
 
 	if (object->object_format!=PTP_OFC_Association && object->association_type != PTP_AT_GenericFolder)
 	{
+		// written data in the page cache is newer than the device
+		if (PTPFSINO(ino)->data.file.dirty)
+			return;
         ino->i_size = object->object_compressed_size;
+        PTPFSINO(ino)->data.file.on_device = ino->i_size;
         ino->i_ctime.tv_sec = object->capture_date;
         ino->i_mtime.tv_sec = ino->i_atime.tv_sec = object->modification_date;
 	}
@@ -94,6 +101,8 @@ void ptpfs_free_inode_data(struct inode *ino)
 {
     int x;
     struct ptpfs_inode_data* ptpfs_data = PTPFSINO(ino);
+    if (ptpfs_data == NULL)
+        return;
     switch (ptpfs_data->type)
 	{
 		case INO_TYPE_DIR:
@@ -104,7 +113,13 @@ void ptpfs_free_inode_data(struct inode *ino)
 		}
 		kfree(ptpfs_data->data.dircache.file_info);
 		ptpfs_data->data.dircache.file_info = NULL;
+		if (ptpfs_data->data.dircache.name_index)
+			ptp_seg_free((unsigned char *)ptpfs_data->data.dircache.name_index);
+		ptpfs_data->data.dircache.name_index = NULL;
+		ptpfs_data->data.dircache.name_mask = 0;
 		ptpfs_data->data.dircache.num_files= 0;
+		ptpfs_data->data.dircache.max_files= 0;
+		list_del_init(&ptpfs_data->dir_list);
 		break;
 	}
 }
@@ -112,22 +127,7 @@ void ptpfs_free_inode_data(struct inode *ino)
 static void ptpfs_put_inode(struct inode *ino)
 {
 	int flag = 13;	// ptpfs_put_inode
-checkagain2:
-        down(&ptp_passport_mutex);
-        if(passport==PASSPORT_FREE)
-        {
-                passport=flag;
-                up(&ptp_passport_mutex);
-        }
-        else if(passport!=flag)
-        {
-                up(&ptp_passport_mutex);
-                msleep(1000);
-//printk("david1222: %s(%d) goto checkagain2 ino=%p pass=%d\n",__func__,__LINE__,ino,passport);
-                goto checkagain2;
-        }
-        else
-                up(&ptp_passport_mutex);
+	ptpfs_passport_get(PTPFSSB(ino->i_sb), flag);
 	
 //    printk(KERN_INFO "%s - %ld   count: %d\n",  __FUNCTION__,ino->i_ino,ino->i_count);
 /*
@@ -136,20 +136,16 @@ checkagain2:
 	else
 		printk("========== ptpfs_put_inode name : %x =====================\n",PTPFSINO(ino)->data.dircache.file_info);	
 */
-    ptpfs_free_inode_data(ino);
-    force_delete(ino);
-	down(&ptp_passport_mutex);
-	passport=PASSPORT_FREE;
-	up(&ptp_passport_mutex);
+	// with the event listener running the dircache stays valid until the last reference.
+	// Unused object inodes stay in the icache with their pages, never with a dircache.
+	if (atomic_read(&ino->i_count) == 1 || PTPFSSB(ino->i_sb)->usb_device->events.urb == NULL)
+	    ptpfs_free_inode_data(ino);
+	ptpfs_passport_put(PTPFSSB(ino->i_sb));
 }
 
-struct inode *ptpfs_get_inode(struct super_block *sb, int mode, int dev, int ino)
+//	PTPFSINO(inode) is already allocated, so this can not fail
+static void ptpfs_init_inode(struct inode *inode, int mode, int dev)
 {
-    //printk(KERN_INFO "%s -- %d\n",  __FUNCTION__, ino);
-    struct inode * inode = new_inode(sb);
-
-    if (inode)
-	{
         inode->i_mode = mode;
 
         inode->i_uid = current->fsuid;
@@ -162,18 +158,14 @@ struct inode *ptpfs_get_inode(struct super_block *sb, int mode, int dev, int ino
         inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
         inode->i_version = 1;
         inode->i_mapping->a_ops = &ptpfs_fs_aops;
-        if (ino)
-		{
-            inode->i_ino = ino;
-		}
-	
-		PTPFSINO(inode) = (struct ptpfs_inode_data *)kmalloc(sizeof(struct ptpfs_inode_data), GFP_KERNEL); 
 
         memset(PTPFSINO(inode),0,sizeof(struct ptpfs_inode_data));
-        insert_inode_hash(inode);
+        PTPFSINO(inode)->inode = inode;
+        INIT_LIST_HEAD(&PTPFSINO(inode)->dir_list);
         switch (mode & S_IFMT)
 		{
 		case S_IFREG:
+			inode->i_op = &ptpfs_file_inode_operations;
 			inode->i_fop = &ptpfs_file_operations;
 			break;
 		case S_IFDIR:
@@ -187,15 +179,126 @@ struct inode *ptpfs_get_inode(struct super_block *sb, int mode, int dev, int ino
 			init_special_inode(inode, mode, dev);
 			break;
         }
+}
+
+//	root and storage directories, objects get theirs from ptpfs_iget()
+struct inode *ptpfs_get_inode(struct super_block *sb, int mode, int dev, int ino)
+{
+    //printk(KERN_INFO "%s -- %d\n",  __FUNCTION__, ino);
+    struct ptpfs_inode_data *data = kmalloc(sizeof(struct ptpfs_inode_data), GFP_KERNEL);
+    struct inode * inode;
+
+    if (data == NULL)
+        return NULL;
+    inode = new_inode(sb);
+    if (inode)
+	{
+        if (ino)
+		{
+            inode->i_ino = ino;
+		}
+        PTPFSINO(inode) = data;
+        ptpfs_init_inode(inode, mode, dev);
     }
+    else
+        kfree(data);
     return inode;
 }
 
+struct ptpfs_iget_key
+{
+	__u32 handle;
+	struct ptpfs_inode_data *data;		// taken by ptpfs_iget_set, which runs under inode_lock
+};
+
+static int ptpfs_iget_test(struct inode *inode, void *data)
+{
+	return inode->i_ino == ((struct ptpfs_iget_key *)data)->handle;
+}
+
+static int ptpfs_iget_set(struct inode *inode, void *data)
+{
+	struct ptpfs_iget_key *key = data;
+
+	inode->i_ino = key->handle;
+	PTPFSINO(inode) = key->data;
+	key->data = NULL;
+	return 0;
+}
+
+/*
+ * ptpfs_iget:
+ * the inode of an object, hashed by its handle.  Handles are not reused
+ * within a session, so an inode still in the icache is the same object and
+ * keeps its page cache, unless size or date changed on the device.
+ */
+struct inode *ptpfs_iget(struct super_block *sb, __u32 handle, struct ptp_object_info *object)
+{
+	struct ptpfs_iget_key key;
+	struct inode *inode;
+	int mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
+
+	if (object->object_format==PTP_OFC_Association && object->association_type == PTP_AT_GenericFolder)
+		mode |= S_IFDIR;
+	else
+		mode |= S_IFREG;
+
+	// allocated up front: an iput() here could wait on the passport of our caller
+	key.handle = handle;
+	key.data = kmalloc(sizeof(struct ptpfs_inode_data), GFP_KERNEL);
+	if (key.data == NULL)
+		return NULL;
+	inode = iget5_locked(sb, handle, ptpfs_iget_test, ptpfs_iget_set, &key);
+	if (key.data)
+		kfree(key.data);
+	if (inode == NULL)
+		return NULL;
+	if (inode->i_state & I_NEW)
+	{
+		ptpfs_init_inode(inode, mode, 0);
+		ptpfs_set_inode_info(inode, object);
+		unlock_new_inode(inode);
+		return inode;
+	}
+
+	ptpfs_refresh_inode(inode, object);
+	return inode;
+}
+
+//	new ObjectInfo for a cached inode, page cache of a changed object is dropped
+void ptpfs_refresh_inode(struct inode *inode, struct ptp_object_info *object)
+{
+	if (S_ISREG(inode->i_mode) && !PTPFSINO(inode)->data.file.dirty &&
+	    (inode->i_size != object->object_compressed_size || inode->i_mtime.tv_sec != object->modification_date))
+		invalidate_remote_inode(inode);
+	ptpfs_set_inode_info(inode, object);
+}
+
+//	the dircache is gone by now, see ptpfs_put_inode()
+static void ptpfs_clear_inode(struct inode *ino)
+{
+	kfree(PTPFSINO(ino));
+	PTPFSINO(ino) = NULL;
+}
+
 static void ptpfs_put_super (struct super_block * sb)
 {
     //printk(KERN_INFO "%s\n",  __FUNCTION__);
     printk("<ptp module> umount ptp device ST\n");
 
+	ptpfs_crawl_stop(PTPFSSB(sb));
+	ptp_event_stop(PTPFSSB(sb));
+	// the refresh re-arms itself while the bus is busy
+	PTPFSSB(sb)->storage_stop = 1;
+	cancel_delayed_work(&PTPFSSB(sb)->storage_work);
+	flush_scheduled_work();
+	cancel_delayed_work(&PTPFSSB(sb)->storage_work);
+	flush_scheduled_work();
+	ptpfs_delete_flush(PTPFSSB(sb));
+	ptpfs_oi_clear(PTPFSSB(sb));
+	ptpfs_storage_forget(PTPFSSB(sb));
+	ptpfs_snapshot_drop(PTPFSSB(sb), PTPFS_SNAP_DROPPED);
+
     ptp_free_device_info(PTPFSSB(sb)->deviceinfo);
     kfree(PTPFSSB(sb)->deviceinfo);
 
@@ -207,6 +310,7 @@ static void ptpfs_put_super (struct super_block * sb)
 			printk(KERN_INFO "Could not close session\n");
 		}
 	}
+	ptp_container_pool_destroy(PTPFSSB(sb));
 	//disconnect will check that unmount is done.
 	if (PTPFSSB(sb)->usb_device->close_type == 0)
 	{
@@ -215,6 +319,8 @@ static void ptpfs_put_super (struct super_block * sb)
 	}	
 	else if (PTPFSSB(sb)->usb_device->close_type == 2)  //disconnect is done , free it 
 	{
+		ptp_ring_free(PTPFSSB(sb)->usb_device);
+		ptp_stats_unregister(PTPFSSB(sb)->usb_device);
 		kfree(PTPFSSB(sb)->usb_device);
 		/*
 		**	these two pointers indicate same area, but ptp_probe will check ptp_devices[x]
@@ -248,8 +354,9 @@ static void ptpfs_put_super (struct super_block * sb)
 static int ptpfs_statfs(struct super_block *sb, struct kstatfs *buf)
 {
 	//printk(KERN_INFO "%s\n",  __FUNCTION__);
-    struct ptp_storage_ids storageids;
+    struct ptpfs_sb_info *sb_info = PTPFSSB(sb);
     int x;
+    int n;
 
     buf->f_type = PTPFS_MAGIC;
     buf->f_bsize = PAGE_CACHE_SIZE;
@@ -259,36 +366,20 @@ static int ptpfs_statfs(struct super_block *sb, struct kstatfs *buf)
     buf->f_blocks = 0;
     buf->f_bfree = 0;
 
-    //down(&params->ptp_lock);
-    if (ptp_getstorageids(PTPFSSB(sb), &storageids)!=PTP_RC_OK)
+    down(&sb_info->storage_sem);
+    n = ptpfs_storage_get(sb_info, 1);
+    if (n < 0)
 	{
-        printk(KERN_INFO "Error getting storage ids\n");
-        storageids.n = 0;
-        storageids.storage = NULL;
         buf->f_blocks = 1024;
         buf->f_bfree = 0;
 	}
 
-    for (x = 0; x < storageids.n; x++)
+    for (x = 0; x < n; x++)
 	{
-        struct ptp_storage_info storageinfo;
-        if ((storageids.storage[x]&0x0000ffff)==0) continue;
-
-        memset(&storageinfo,0,sizeof(storageinfo));
-        if (ptp_getstorageinfo(PTPFSSB(sb), storageids.storage[x],&storageinfo)!=PTP_RC_OK)
-	        {
-            printk(KERN_INFO "Error getting storage info\n");
-        	}
-        else
-	        {
-            buf->f_blocks += storageinfo.max_capability;
-            buf->f_bfree += storageinfo.free_space_in_bytes;
-            ptp_free_storage_info(&storageinfo);
-        	}
-
+        buf->f_blocks += sb_info->storages[x].max_capability;
+        buf->f_bfree += sb_info->storages[x].free_space_in_bytes;
 	}
-    ptp_free_storage_ids(&storageids);
-    //up(&params->ptp_lock);
+    up(&sb_info->storage_sem);
     buf->f_blocks /= 1024;
     buf->f_bfree /= 1024;
     buf->f_bavail = buf->f_bfree;
@@ -299,7 +390,7 @@ struct super_operations ptpfs_ops = {
 	statfs:		ptpfs_statfs,
 	put_super:		ptpfs_put_super,
 	put_inode:		ptpfs_put_inode,
-	drop_inode:	generic_delete_inode,
+	clear_inode:	ptpfs_clear_inode,
 };
 
 char * ___strtok;
@@ -324,7 +415,7 @@ char * strtok(char * s,const char * ct)
 		return (sbegin);
 }
 
-static int ptpfs_parse_options(char *options, uid_t *uid, gid_t *gid)
+static int ptpfs_parse_options(char *options, struct ptpfs_sb_info *sbi)
 {
 	char *this_char, *value, *rest;
 
@@ -344,17 +435,41 @@ static int ptpfs_parse_options(char *options, uid_t *uid, gid_t *gid)
 
 		if (!strcmp(this_char,"uid"))
 		{
-			if (!uid)
-				continue;
-			*uid = simple_strtoul(value,&rest,0);
+			sbi->fs_uid = simple_strtoul(value,&rest,0);
 			if (*rest)
 				goto bad_val;
 		}
 		else if (!strcmp(this_char,"gid"))
 		{
-			if (!gid)
-				continue;
-			*gid = simple_strtoul(value,&rest,0);
+			sbi->fs_gid = simple_strtoul(value,&rest,0);
+			if (*rest)
+				goto bad_val;
+		}
+		else if (!strcmp(this_char,"segsize"))
+		{
+			// accepts K/M suffixes, aligned to the endpoint in ptp_fill_super
+			sbi->seg_size = memparse(value,&rest);
+			if (*rest || sbi->seg_size <= 0)
+				goto bad_val;
+		}
+		else if (!strcmp(this_char,"statttl"))
+		{
+			// seconds before statfs has the free space refreshed in the background
+			sbi->storage_ttl = simple_strtol(value,&rest,0);
+			if (*rest || sbi->storage_ttl < 0)
+				goto bad_val;
+		}
+		else if (!strcmp(this_char,"snapshot"))
+		{
+			// 1 : list the whole device once and never ask per folder
+			sbi->snapshot = simple_strtoul(value,&rest,0);
+			if (*rest)
+				goto bad_val;
+		}
+		else if (!strcmp(this_char,"crawl"))
+		{
+			// 1 : read the metadata of the whole device in the background
+			sbi->crawl = simple_strtoul(value,&rest,0);
 			if (*rest)
 				goto bad_val;
 		}
@@ -371,6 +486,20 @@ static int ptpfs_parse_options(char *options, uid_t *uid, gid_t *gid)
 	return 1;
 }
 
+static ssize_t ptp_show_crawl(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	static const char *state[] = { "idle", "running", "done" };
+	struct ptpfs_usb_device_info *pdev = ptp_devices[to_usb_interface(dev)->minor];
+	struct ptp_crawl_progress *c;
+
+	if (pdev == NULL)
+		return 0;
+	c = &pdev->crawl;
+	return sprintf(buf, "%s folders %d pending %d objects %d errors %d\n",
+	               state[c->state], c->folders, c->pending, c->objects, c->errors);
+}
+static DEVICE_ATTR(crawl, S_IRUGO, ptp_show_crawl, NULL);
+
 int ptp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
 	printk("<ptp module> ptp_probe ST\n");
@@ -438,6 +567,7 @@ int ptp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 			pdev->fs_already_mount = 0;
 
 			pdev->udev = interface_to_usbdev (interface);
+			pdev->ifnum = iface_desc->desc.bInterfaceNumber;
 			pdev->minor = x;
 			interface->minor = pdev->minor; //minor could be 0-7								
 
@@ -457,6 +587,7 @@ int ptp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 						printk("========== USB_DIR_IN : %x =====================\n",USB_DIR_IN);
 						*/
 						pdev->inep = endpoint->bEndpointAddress;
+						pdev->inep_maxpacket = le16_to_cpu(endpoint->wMaxPacketSize);
 					} //end if -- USB_DIR_IN
 					else if ((endpoint->bEndpointAddress & USB_ENDPOINT_DIR_MASK) == USB_DIR_OUT)
 					{
@@ -468,6 +599,7 @@ int ptp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 						printk("========== USB_DIR_OUT : %x =====================\n",USB_DIR_OUT);
 						*/
 						pdev->outep = endpoint->bEndpointAddress;
+						pdev->outep_maxpacket = le16_to_cpu(endpoint->wMaxPacketSize);
 					} //end if -- USB_DIR_OUT					
 				} //end if	-- USB_ENDPOINT_XFER_BULK 		
 				else if ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT)
@@ -480,6 +612,7 @@ int ptp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 					printk("========== USB_ENDPOINT_XFER_INT : %x =====================\n",USB_ENDPOINT_XFER_INT);
 					*/
 					pdev->intep = endpoint->bEndpointAddress;
+					pdev->intep_interval = endpoint->bInterval;
 				} //end if -- USB_ENDPOINT_XFER_INT		
     		} //end for -- N_endpoints
 			ptp_devices[x]=pdev;			
@@ -506,6 +639,8 @@ int ptp_probe(struct usb_interface *interface, const struct usb_device_id *id)
 
 		ptp_devices[x]->kobj_name = 	interface->dev.kobj.k_name;
 		printk("==== kobj_name : %s ====\n",ptp_devices[x]->kobj_name);		
+		ptp_stats_register(ptp_devices[x]);
+		device_create_file(dev, &dev_attr_crawl);
 		printk("<ptp module> ptp_probe SP\n");
 
 		return 0;   	
@@ -516,9 +651,12 @@ static int ptp_disconnect(struct usb_interface *intf)
 {
 	int x;
 	printk("<ptp module> ptp_disconnect ST\n");
+	device_remove_file(&intf->dev, &dev_attr_crawl);
 
 	if ( ptp_devices[intf->minor]->fs_already_mount == 0)  
 	{
+		ptp_ring_free(ptp_devices[intf->minor]);
+		ptp_stats_unregister(ptp_devices[intf->minor]);
 		kfree(ptp_devices[intf->minor]);
 		ptp_devices[intf->minor]=NULL;
 		usb_set_intfdata(intf, NULL);
@@ -533,6 +671,8 @@ static int ptp_disconnect(struct usb_interface *intf)
 	}
 	else if (ptp_devices[intf->minor]->close_type == 1)  //unmount is done , disconnect free data now. 
 	{	
+		ptp_ring_free(ptp_devices[intf->minor]);
+		ptp_stats_unregister(ptp_devices[intf->minor]);
 		kfree(ptp_devices[intf->minor]);
 		ptp_devices[intf->minor]=NULL;
 	}	
@@ -585,9 +725,6 @@ static long ptp_fill_super(struct super_block *sb, void *data, int silent)
 		}
 	}
 
-	if (ptpfs_parse_options (data,&uid, &gid))
-		return 1;
-
     sb->s_blocksize = PAGE_CACHE_SIZE;
     sb->s_blocksize_bits = PAGE_CACHE_SHIFT;
     sb->s_magic = PTPFS_MAGIC;
@@ -596,11 +733,43 @@ static long ptp_fill_super(struct super_block *sb, void *data, int silent)
 	PTPFSSB(sb) = kmalloc(sizeof(struct ptpfs_sb_info), GFP_KERNEL); 
     memset(PTPFSSB(sb), 0, sizeof(struct ptpfs_sb_info));
     PTPFSSB(sb)->byteorder = PTP_DL_LE;
-    PTPFSSB(sb)->fs_gid = gid;
-    PTPFSSB(sb)->fs_uid = uid;
+    PTPFSSB(sb)->seg_size = MAX_SEG_SIZE;
+    PTPFSSB(sb)->sb = sb;
+    spin_lock_init(&PTPFSSB(sb)->passport_lock);
+    init_waitqueue_head(&PTPFSSB(sb)->passport_wait);
+    PTPFSSB(sb)->passport = PASSPORT_FREE;
+    PTPFSSB(sb)->oi_cache = RB_ROOT;
+    init_MUTEX(&PTPFSSB(sb)->oi_sem);
+    init_MUTEX(&PTPFSSB(sb)->storage_sem);
+    init_MUTEX(&PTPFSSB(sb)->snap_sem);
+    init_MUTEX(&PTPFSSB(sb)->upload_sem);
+    PTPFSSB(sb)->storage_ttl = PTPFS_STORAGE_TTL;
+    INIT_WORK(&PTPFSSB(sb)->storage_work, ptpfs_storage_work, PTPFSSB(sb));
+    init_MUTEX(&PTPFSSB(sb)->delete_sem);
+    INIT_LIST_HEAD(&PTPFSSB(sb)->delete_list);
+    INIT_WORK(&PTPFSSB(sb)->delete_work, ptpfs_delete_work, PTPFSSB(sb));
+    INIT_LIST_HEAD(&PTPFSSB(sb)->dir_list);
+
+	if (ptpfs_parse_options (data, PTPFSSB(sb)))
+	{
+		kfree(PTPFSSB(sb));
+		PTPFSSB(sb) = NULL;
+		return 1;
+	}
+	uid = PTPFSSB(sb)->fs_uid;
+	gid = PTPFSSB(sb)->fs_gid;
+	PTPFSSB(sb)->seg_size = ptp_seg_size_align(ptp_devices[x], PTPFSSB(sb)->seg_size);
 
-	PTPFSSB(sb)->buffer = kmalloc(sizeof((int)PAGE_SIZE), GFP_KERNEL); 
-    memset(PTPFSSB(sb)->buffer, 0, sizeof((int)PAGE_SIZE));
+	PTPFSSB(sb)->buffer = kmalloc(PAGE_SIZE, GFP_KERNEL); 
+    memset(PTPFSSB(sb)->buffer, 0, PAGE_SIZE);
+
+	if (ptp_container_pool_create(PTPFSSB(sb), ptp_devices[x]))
+	{
+		kfree(PTPFSSB(sb)->buffer);
+		kfree(PTPFSSB(sb));
+		PTPFSSB(sb) = NULL;
+		return -ENOMEM;
+	}
 
     down(&ptp_devices_mutex);
 	
@@ -650,6 +819,8 @@ static long ptp_fill_super(struct super_block *sb, void *data, int silent)
         goto error;
 	}
 	PTPFSSB(sb)->usb_device->fs_already_mount = 1; 
+	ptp_event_start(PTPFSSB(sb));
+	ptpfs_crawl_start(PTPFSSB(sb));
     up(&ptp_devices_mutex);
 	
 	
@@ -705,12 +876,26 @@ static int init_ptp_driver(void)
 	int fs_result;
 	printk("<ptp module> insert ptp module ST B\n");
 
+	ptp_container_cachep = kmem_cache_create("ptp_container", PTP_CONTAINER_SIZE,
+	                                         PTP_CONTAINER_SIZE, 0, NULL, NULL);
+	if (ptp_container_cachep == NULL)
+	{
+		printk("kmem_cache_create failed for the ptpfs driver.\n");
+		return -ENOMEM;
+	}
+
+	// before usb_register, probe adds the per device directories
+	ptp_debugfs_root = debugfs_create_dir("ptpfs", NULL);
+
     /* register this driver with the USB subsystem */
 
 	driver_result = usb_register(&ptpfs_usb_driver);
 	if (driver_result < 0)
 	{
 		printk("usb_register failed for the ptpfs driver. Error number %d\n", driver_result);
+		kmem_cache_destroy(ptp_container_cachep);
+		if (ptp_debugfs_root && !IS_ERR(ptp_debugfs_root))
+			debugfs_remove(ptp_debugfs_root);
 		return -1;
 	}
 
@@ -729,6 +914,9 @@ static void exit_ptp_driver(void)
 	printk("<ptp module> remove ptp module ST\n");
 	unregister_filesystem(&ptpfs_fs_type);
 	usb_deregister(&ptpfs_usb_driver);
+	kmem_cache_destroy(ptp_container_cachep);
+	if (ptp_debugfs_root && !IS_ERR(ptp_debugfs_root))
+		debugfs_remove(ptp_debugfs_root);
 	printk("<ptp module> remove ptp module SP\n");
 }
 
@@ -20,6 +20,98 @@ struct ptpfs_input
 	char *kobj_name;
 };
 
+/*
+ * bulk-in URBs kept in flight while the GetObject data phase is streaming,
+ * so the next segments are already on the wire while readpage copies the
+ * current one.
+ */
+#define PTP_RING_DEPTH_MAX	8
+
+struct ptp_urb_ring
+{
+	int depth;								// URBs allocated, 0 : ring not allocated
+	struct urb *urb[PTP_RING_DEPTH_MAX];
+	unsigned char *buf[PTP_RING_DEPTH_MAX];
+	struct completion done[PTP_RING_DEPTH_MAX];
+	int head;								// next URB to be handed to the reader
+	int inflight;							// URBs submitted but not consumed yet
+	int to_submit;							// segments of the data phase not submitted yet
+	int seg_size;							// size of every URB buffer
+};
+
+#define PTP_EVENT_RING	16
+
+struct ptp_event
+{
+	__u16 code;
+	__u32 param1;
+	__u32 param2;
+	__u32 param3;
+};
+
+//	interrupt endpoint listener, filled in the URB completion and emptied by the worker
+struct ptp_event_queue
+{
+	struct urb *urb;						// NULL : listener not running
+	unsigned char *buf;
+	spinlock_t lock;
+	struct ptp_event ev[PTP_EVENT_RING];
+	int head;								// next event for the worker
+	int tail;								// next free slot
+	int overflow;							// events were dropped, caches must be re-listed
+	__u32 added;							// handle of the last ObjectAdded, see ptp_event_added()
+	struct workqueue_struct *wq;
+	struct work_struct work;
+};
+
+#define PTP_STATS_OPCODES	48
+#define PTP_STATS_BUCKETS	24		// log2(usec), the last one collects 2^22 usec and above
+#define PTP_PHASE_CMD		0
+#define PTP_PHASE_DATA		1
+#define PTP_PHASE_RESP		2
+#define PTP_PHASES			3
+
+struct ptp_opcode_stats
+{
+	__u16 code;
+	unsigned long count;
+	unsigned long errors;
+	__u64 bytes_in;
+	__u64 bytes_out;
+};
+
+//	debugfs counters, see ptp_stats_register()
+struct ptp_stats
+{
+	struct ptp_opcode_stats op[PTP_STATS_OPCODES];
+	int nr_op;
+	struct ptp_opcode_stats *cur;			// the transaction bulk transfers are charged to
+	__u64 bytes_in;
+	__u64 bytes_out;
+	unsigned long urbs_out;					// bulk-out transfers, kBps_out = bytes_out / time in them
+	__u64 usec_out;
+	unsigned long stalls;					// usb_clear_halt calls
+	__u64 drained;							// data phase bytes read and thrown away
+	unsigned long cancels;					// GetObject streams cancelled
+	unsigned long latency[PTP_PHASES][PTP_STATS_BUCKETS];
+	struct dentry *dir;
+	struct dentry *files[3];
+};
+
+#define PTP_CRAWL_IDLE		0
+#define PTP_CRAWL_RUNNING	1
+#define PTP_CRAWL_DONE		2
+
+//	metadata crawler progress, shown in the crawl attribute of the interface
+struct ptp_crawl_progress
+{
+	int state;
+	int folders;					// folders listed
+	int pending;					// folders still to list
+	int objects;					// ObjectInfos put in the cache
+	int errors;
+};
+
 struct ptpfs_usb_device_info
 {
     /* stucture lock */
@@ -32,6 +124,12 @@ struct ptpfs_usb_device_info
     int inep;
     int outep;
     int intep;
+    int intep_interval;
+    int inep_maxpacket;
+    int outep_maxpacket;
+
+    /* interface number, for class specific requests */
+    int ifnum;
 
     /*	the usb device */
     struct usb_device *udev;
@@ -49,6 +147,17 @@ struct ptpfs_usb_device_info
 	/*	check if the system be mounted or not */
 	int fs_already_mount;  //add by evan
 
+	/*	bulk-in read ahead for the GetObject data phase */
+	struct ptp_urb_ring ring;
+
+	/*	ObjectAdded, ObjectRemoved, ... from the interrupt endpoint while mounted */
+	struct ptp_event_queue events;
+
+	/*	transaction statistics */
+	struct ptp_stats stats;
+
+	/*	crawler of the mounted fs, mount option crawl= */
+	struct ptp_crawl_progress crawl;
 
 
 
@@ -66,9 +175,58 @@ struct ptpfs_sb_info
     /* data layer byteorder */
     __u8  byteorder;
 
+    /* bytes read per data phase segment, mount option segsize= */
+    int seg_size;
+
     struct ptpfs_usb_device_info *usb_device;
+    struct super_block *sb;
+
+    /* directories with a loaded dircache, patched by device events */
+    struct list_head dir_list;
+
+    /* handle -> ObjectInfo, filled by readdir and used by lookup */
+    struct rb_root oi_cache;
+    struct semaphore oi_sem;
+    int oi_count;
+
+    /* storage table of the root directory, see ptpfs_storage_get() */
+    struct semaphore storage_sem;
+    struct ptpfs_storage *storages;
+    int num_storages;
+    unsigned long storage_jiffies;		// when the free space figures were read
+    int storage_ttl;				// seconds, mount option statttl=
+    struct work_struct storage_work;		// refreshes the free space for statfs
+    int storage_stop;
+
+    /* whole tree snapshot, mount option snapshot= */
+    int snapshot;
+    int snap_state;
+    struct semaphore snap_sem;
+    struct ptpfs_snap_entry *snap;		// sorted by parent, storage, handle
+    int snap_n;
+
+    /* metadata crawler, see ptpfs_crawl() */
+    int crawl;					// mount option crawl=
+    struct task_struct *crawl_task;
+
+    /* unlink and rmdir, see ptpfs_delete_work() */
+    struct semaphore delete_sem;
+    struct list_head delete_list;
+    struct work_struct delete_work;
+
+    /* the one object being replaced, see ptpfs_upload_flush() */
+    struct semaphore upload_sem;
+    struct ptp_upload *upload;
+
+    /* readdir/lookup/readpage/put_inode serialization, see ptpfs_passport_get() */
+    spinlock_t passport_lock;
+    wait_queue_head_t passport_wait;
+    int passport;
 
     struct ptp_device_info *deviceinfo;
+
+    /* command, response and data header containers */
+    mempool_t *container_pool;
 //=======================
 	struct ptp_data_buffer *private_data;
 	int read_condition; 			// before reading: 0, in the middle of data stream: 1, read over: 2.
@@ -83,35 +241,134 @@ struct ptpfs_sb_info
 
 
 
+struct ptpfs_storage
+{
+    __u32 id;
+    __u16 storage_type;
+    __u64 max_capability;
+    __u64 free_space_in_bytes;
+    char name[32];				// root directory entry, from get_root_dir_name()
+};
+
+//	one object of the whole tree snapshot, see ptpfs_snapshot_load()
+struct ptpfs_snap_entry
+{
+    __u32 parent;				// parent_object, 0 in the root of the storage
+    __u32 storage;
+    __u32 handle;
+    int mode;					// DT_DIR or DT_REG
+    char *filename;
+};
+
+#define PTPFS_SNAP_NONE		0		// not loaded yet
+#define PTPFS_SNAP_LOADED	1
+#define PTPFS_SNAP_DROPPED	2		// outdated by an event or failed, list folders one by one
+
+//	the object of one file being replaced, see ptpfs_upload_flush()
+struct ptp_upload
+{
+    struct inode *inode;
+    __u32 handle;				// new object, 0 if the responder did not tell
+    __u32 old;					// object replaced by the upload, 0 once deleted
+    __u32 old_size;
+    __u32 storage;
+    __u64 size;					// announced in SendObjectInfo
+    __u64 sent;					// bytes of the page cache sent so far
+    int streaming;				// SendObject data phase open, see ptp_upload_start()
+    struct ptp_container ptp;
+    unsigned char *buf;				// staging segment, starts with the container header
+    int len;
+};
+
+struct ptpfs_oi_node
+{
+    struct rb_node node;
+    __u32 handle;
+    struct ptp_object_info info;		// filename is owned, keywords are not kept
+};
+
+//	a DeleteObject queued by unlink
+struct ptpfs_delete
+{
+    struct list_head list;
+    __u32 handle;
+    __u32 parent;		// inode number and type of the directory it was in
+    int parent_type;
+    __u32 storage;
+    int dir;			// an association, its content goes with it
+    loff_t size;		// given back to the free space, with the content it took along
+};
+
 struct ptpfs_dirinode_fileinfo
 {
     char *filename;
     int handle;
     int mode;
+    unsigned int name_hash;		// full_name_hash of filename, set when the name index is built
+    int name_len;
 };
 struct ptpfs_inode_data
 {
     int type;
     __u32 storage;
     struct inode *parent;
+    struct inode *inode;
+    struct list_head dir_list;		// on ptpfs_sb_info.dir_list while the dircache is loaded
 
     union
 	{
 		struct
 		{
 			int num_files;
+			int max_files;
 			struct ptpfs_dirinode_fileinfo *file_info;
+			int *name_index;		// open addressed, slots hold file_info index + 1
+			int name_mask;
 		} dircache;
+		struct
+		{
+			loff_t size;		// set by ftruncate(), lets writeback stream before close
+			loff_t written;		// end of the furthest write
+			loff_t on_device;	// object size on the device, pages past it are zeroes
+			int dirty;		// the object has to be replaced
+			loff_t streamed;	// sent by the upload in progress
+			int rewound;		// a page was written again after it was sent
+			int lost;		// a stream failed after its pages were cleaned, until truncated to 0
+		} file;
 	} data;
 };
 
 
 
-#define MAX_SEG_SIZE	 (4096*4)		
+#define MAX_SEG_SIZE	 (4096*4)			// default segment size
 #define MAX_SEG_NUM 	 6				
+#define PTP_SEG_KMALLOC_MAX	(128*1024)		// bigger segments are vmalloc'd and read with usb_sg_init
+#define PTP_SEG_SIZE_MAX	(16*1024*1024)
+#define PTP_CONTAINER_SIZE	512				// one high speed bulk packet, slab size of the container pool
+#define PTP_CONTAINER_POOL_MIN	4
+
+#define PASSPORT_FREE		0xff
+#define PTPFS_OI_CACHE_MAX	65536		// ObjectInfos kept per mount
+#define PTPFS_NAME_INDEX_MIN	16
+// readdir position of a dircache entry: 0 and 1 are . and .., handles are stable across re-listing
+#define PTPFS_DIR_COOKIE(handle)	((loff_t)(__u32)(handle) + 2)
+#define PTPFS_STORAGE_TTL	5		// seconds statfs trusts the cached free space
+#define PTPFS_STORAGE_RETRY	(HZ/5)		// the bus was busy, try the refresh again
+#define PTPFS_CRAWL_BACKOFF_MS	50		// crawler sleep while the VFS is using the device
+#define PTPFS_DELETE_DELAY	(HZ/10)		// unlinks of one rm -r gathered before the first DeleteObject
 
 #define INO_TYPE_DIR        1
 #define INO_TYPE_STGDIR     2
+#define INO_TYPE_THUMBS     3		// .thumbs in the root, lists the storages again
+
+#define PTPFS_THUMBS_NAME	".thumbs"
+#define PTPFS_THUMBS_INO	0xfffffffe
+#define PTPFS_THUMB_SUFFIX	".jpg"		// appended to the object name in the thumbnail tree
+
+// ioctl(dest, PTPFS_IOC_CLONE, src_fd) copies on the device, same number as FICLONE
+#define PTPFS_IOC_CLONE		_IOW(0x94, 9, int)
+// ioctl(dir, PTPFS_IOC_EMPTY, 0) deletes the content of a folder, on the root arg is the format to wipe
+#define PTPFS_IOC_EMPTY		_IOW('p', 1, __u32)
 
 //#define PTPFSSB(x) ((struct ptpfs_sb_info*)(x->u.generic_sbp))
 #define PTPFSSB(x) ((struct ptpfs_sb_info *)(x->s_fs_info))
@@ -125,6 +382,7 @@ extern void ptp_free_storage_ids(struct ptp_storage_ids* storageids);
 extern void ptp_free_object_handles(struct ptp_object_handles *objects);
 extern void ptp_free_object_info(struct ptp_object_info *object);
 extern void ptp_free_data_buffer(struct ptp_data_buffer *buffer);
+extern void ptp_free_data_blocks(struct ptp_data_buffer *buffer);
 extern void ptp_free_device_info(struct ptp_device_info *di);
 
 extern __u16 ptp_getdeviceinfo(struct ptpfs_sb_info *sb, struct ptp_device_info* deviceinfo);
@@ -142,27 +400,85 @@ extern __u16 ptp_getobjecthandles (struct ptpfs_sb_info *sb, __u32 storage,
                                    struct ptp_object_handles* objecthandles);
 extern __u16 ptp_getobjectinfo (struct ptpfs_sb_info *sb, __u32 handle,
                                 struct ptp_object_info* objectinfo);
+extern __u16 ptp_getobjectproplist (struct ptpfs_sb_info *sb, __u32 handle, __u32 depth,
+                                    struct ptp_object_list *list);
+extern void ptp_free_object_list(struct ptp_object_list *list);
 extern __u16 ptp_getobject (struct ptpfs_sb_info *sb, __u32 handle, struct ptp_data_buffer *data);
+extern __u16 ptp_getpartialobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 offset,
+                                  __u32 maxbytes, struct ptp_data_buffer *data);
+extern __u16 ptp_getpartialobject_pages(struct ptpfs_sb_info *sb, __u32 handle, struct page **pages,
+                                        int nr_pages, __u32 offset, __u32 length, __u32 *got);
+extern int ptp_pages_bias(struct ptpfs_sb_info *sb);
+extern __u16 ptp_getthumb(struct ptpfs_sb_info *sb, __u32 handle, struct ptp_data_buffer *data);
 
 extern __u16 ptp_sendobjectinfo (struct ptpfs_sb_info *sb, __u32* store, 
                                  __u32* parenthandle, __u32* handle,
                                  struct ptp_object_info* objectinfo);
 extern __u16 ptp_sendobject(struct ptpfs_sb_info *sb, struct ptp_data_buffer* object, __u32 size);
 extern __u16 ptp_deleteobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 ofc);
+extern __u16 ptp_moveobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 storage, __u32 parent);
+extern __u16 ptp_copyobject(struct ptpfs_sb_info *sb, __u32 handle, __u32 storage, __u32 parent, __u32 *newhandle);
+extern __u16 ptp_setobjectfilename(struct ptpfs_sb_info *sb, __u32 handle, char *filename);
+extern __u16 ptp_upload_start(struct ptpfs_sb_info *sb, struct ptp_upload *upload);
+extern ssize_t ptp_upload_write(struct ptpfs_sb_info *sb, struct ptp_upload *upload, const unsigned char *buf, size_t count);
+extern __u16 ptp_upload_finish(struct ptpfs_sb_info *sb, struct ptp_upload *upload);
+extern void __ptp_upload_abort(struct ptpfs_sb_info *sb);
+extern void ptp_upload_cancel(struct ptpfs_sb_info *sb);
 
 extern struct inode *ptpfs_get_inode(struct super_block *sb, int mode, int dev, int ino);
 extern void ptpfs_set_inode_info(struct inode *ino, struct ptp_object_info *object);
+extern void ptpfs_refresh_inode(struct inode *inode, struct ptp_object_info *object);
 extern void ptpfs_free_inode_data(struct inode *ino);
+extern void ptpfs_event_work(void *data);
+extern __u16 ptpfs_getobjectinfo(struct ptpfs_sb_info *sb_info, __u32 handle, struct ptp_object_info *object);
+extern void ptpfs_oi_insert(struct ptpfs_sb_info *sb_info, __u32 handle, struct ptp_object_info *object);
+extern void ptpfs_oi_forget(struct ptpfs_sb_info *sb_info, __u32 handle);
+extern void ptpfs_oi_clear(struct ptpfs_sb_info *sb_info);
+extern void ptpfs_passport_get(struct ptpfs_sb_info *sb_info, int flag);
+extern void ptpfs_passport_put(struct ptpfs_sb_info *sb_info);
 //========================
 extern void force_delete(struct inode *inode);
+extern struct inode *ptpfs_iget(struct super_block *sb, __u32 handle, struct ptp_object_info *object);
 extern int ptp_io_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size);
+extern unsigned char *ptp_seg_alloc(struct ptpfs_sb_info *sb);
+extern void ptp_seg_free(unsigned char *block);
+extern int ptp_seg_size_align(struct ptpfs_usb_device_info *dev, int size);
+extern int ptp_stream_read(struct ptpfs_sb_info *sb, unsigned char *bytes, unsigned int size);
+extern void ptp_ring_stop(struct ptpfs_sb_info *sb);
+extern int __ptp_stream_abort(struct ptpfs_sb_info *sb);
+extern int ptp_stream_abort(struct ptpfs_sb_info *sb);
+extern void ptp_ring_free(struct ptpfs_usb_device_info *dev);
+extern kmem_cache_t *ptp_container_cachep;
+extern int ptp_container_pool_create(struct ptpfs_sb_info *sb, struct ptpfs_usb_device_info *dev);
+extern void ptp_container_pool_destroy(struct ptpfs_sb_info *sb);
+extern int ptp_event_start(struct ptpfs_sb_info *sb);
+extern void ptp_event_stop(struct ptpfs_sb_info *sb);
+extern int ptp_event_get(struct ptpfs_sb_info *sb, struct ptp_event *ev);
+extern __u32 ptp_event_added(struct ptpfs_sb_info *sb);
+extern struct dentry *ptp_debugfs_root;
+extern void ptp_stats_register(struct ptpfs_usb_device_info *dev);
+extern void ptp_stats_unregister(struct ptpfs_usb_device_info *dev);
 //========================
 extern struct super_operations ptpfs_ops;
 extern struct file_operations ptpfs_file_operations;
 extern struct file_operations ptpfs_dir_operations;
 extern struct address_space_operations ptpfs_fs_aops;
 extern struct inode_operations ptpfs_dir_inode_operations;
+extern struct inode_operations ptpfs_file_inode_operations;
+extern int ptpfs_storage_get(struct ptpfs_sb_info *sb_info, int space);
+extern void ptpfs_storage_forget(struct ptpfs_sb_info *sb_info);
+extern void ptpfs_storage_account(struct ptpfs_sb_info *sb_info, __u32 storage, __s64 delta);
+extern void ptpfs_storage_work(void *data);
+extern void ptpfs_delete_work(void *data);
+extern void ptpfs_delete_flush(struct ptpfs_sb_info *sb_info);
+extern int ptpfs_dir_ioctl(struct inode *ino, struct file *filp, unsigned int cmd, unsigned long arg);
+extern int ptpfs_passport_tryget(struct ptpfs_sb_info *sb_info, int flag);
+extern int ptpfs_bus_busy(struct ptpfs_sb_info *sb_info);
+extern void ptpfs_snapshot_drop(struct ptpfs_sb_info *sb_info, int state);
+extern int ptpfs_crawl_start(struct ptpfs_sb_info *sb_info);
+extern void ptpfs_crawl_stop(struct ptpfs_sb_info *sb_info);
 extern struct file_operations ptpfs_rootdir_operations;
+extern struct inode *ptpfs_thumbs_inode(struct inode *dir);
 extern struct inode_operations ptpfs_rootdir_inode_operations;
 
 #endif
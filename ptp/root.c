@@ -21,6 +21,10 @@
 // #include <linux/smp_lock.h>
 #include <linux/string.h>
 //#include <linux/locks.h>
+#include <linux/completion.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
 #include <asm/uaccess.h>
 // #include <asm-mips/types.h>
 
@@ -86,19 +90,173 @@ static void get_root_dir_name(struct ptp_storage_info *storageinfo, char *fsname
         sprintf(fsname,base);
     }
 }
+//=========================================================================
+//	storage table
+//=========================================================================
+void ptpfs_storage_forget(struct ptpfs_sb_info *sb_info)
+{
+	kfree(sb_info->storages);
+	sb_info->storages = NULL;
+	sb_info->num_storages = 0;
+}
+
+static int ptpfs_storage_load(struct ptpfs_sb_info *sb_info)
+{
+	struct ptp_storage_ids storageids;
+	struct ptp_storage_info storageinfo;
+	struct ptpfs_storage *st;
+	int typeCount[5];
+	int x;
+
+	memset(typeCount,0,sizeof(typeCount));
+	memset(&storageids,0,sizeof(storageids));
+	if (ptp_getstorageids(sb_info, &storageids)!=PTP_RC_OK)
+	{
+		printk(KERN_INFO "Error getting storage ids\n");
+		return -EIO;
+	}
+	sb_info->storages = (struct ptpfs_storage *)kmalloc((storageids.n ? storageids.n : 1)*sizeof(struct ptpfs_storage), GFP_KERNEL);
+	if (sb_info->storages == NULL)
+	{
+		ptp_free_storage_ids(&storageids);
+		return -ENOMEM;
+	}
+	sb_info->num_storages = 0;
+	for (x = 0; x < storageids.n; x++)
+	{
+		if ((storageids.storage[x]&0x0000ffff)==0) continue;	// no media in the slot
+
+		memset(&storageinfo,0,sizeof(storageinfo));
+		if (ptp_getstorageinfo(sb_info, storageids.storage[x],&storageinfo)!=PTP_RC_OK)
+		{
+			printk(KERN_INFO "Error getting storage info\n");
+			continue;
+		}
+		st = &sb_info->storages[sb_info->num_storages++];
+		st->id = storageids.storage[x];
+		st->storage_type = storageinfo.storage_type;
+		st->max_capability = storageinfo.max_capability;
+		st->free_space_in_bytes = storageinfo.free_space_in_bytes;
+		get_root_dir_name(&storageinfo, st->name, typeCount);
+		ptp_free_storage_info(&storageinfo);
+	}
+	ptp_free_storage_ids(&storageids);
+	sb_info->storage_jiffies = jiffies;
+	return 0;
+}
+
+//	re-read the free space of the known storages, 0 if one went away
+static int ptpfs_storage_refresh(struct ptpfs_sb_info *sb_info)
+{
+	struct ptp_storage_info storageinfo;
+	int x;
+
+	for (x = 0; x < sb_info->num_storages; x++)
+	{
+		memset(&storageinfo,0,sizeof(storageinfo));
+		if (ptp_getstorageinfo(sb_info, sb_info->storages[x].id,&storageinfo)!=PTP_RC_OK)
+			return 0;
+		sb_info->storages[x].max_capability = storageinfo.max_capability;
+		sb_info->storages[x].free_space_in_bytes = storageinfo.free_space_in_bytes;
+		ptp_free_storage_info(&storageinfo);
+	}
+	sb_info->storage_jiffies = jiffies;
+	return 1;
+}
+
+/*
+ * ptpfs_storage_work:
+ * statfs refresh.  Waits for the bus to be idle: a transaction now would
+ * queue behind a download, or abort the stream of an open file or of a
+ * streamed upload.
+ */
+void ptpfs_storage_work(void *data)
+{
+	struct ptpfs_sb_info *sb_info = data;
+	int flag = 22;	// ptpfs_storage_work
+
+	if (sb_info->storage_stop)
+		return;
+	if (!ptpfs_passport_tryget(sb_info, flag))
+	{
+		schedule_delayed_work(&sb_info->storage_work, PTPFS_STORAGE_RETRY);
+		return;
+	}
+	if (ptpfs_bus_busy(sb_info))
+	{
+		ptpfs_passport_put(sb_info);
+		schedule_delayed_work(&sb_info->storage_work, PTPFS_STORAGE_RETRY);
+		return;
+	}
+
+	down(&sb_info->storage_sem);
+	if (sb_info->storages && !ptpfs_storage_refresh(sb_info))
+		ptpfs_storage_forget(sb_info);
+	up(&sb_info->storage_sem);
+	ptpfs_passport_put(sb_info);
+}
+
+//	free space bookkeeping for our own create/unlink until the next refresh
+void ptpfs_storage_account(struct ptpfs_sb_info *sb_info, __u32 storage, __s64 delta)
+{
+	struct ptpfs_storage *st;
+	int x;
+
+	down(&sb_info->storage_sem);
+	for (x = 0; x < sb_info->num_storages; x++)
+	{
+		st = &sb_info->storages[x];
+		if (st->id != storage)
+			continue;
+		if (delta < 0 && st->free_space_in_bytes < (__u64)-delta)
+			st->free_space_in_bytes = 0;
+		else
+			st->free_space_in_bytes += delta;
+		if (st->free_space_in_bytes > st->max_capability)
+			st->free_space_in_bytes = st->max_capability;
+		break;
+	}
+	up(&sb_info->storage_sem);
+}
+
+/*
+ * ptpfs_storage_get:
+ * make sure sb_info->storages is loaded and return the number of entries.
+ * The caller holds storage_sem for as long as it uses the table.  With space
+ * set, free space figures older than statttl= seconds are handed to
+ * ptpfs_storage_work(); the caller gets the old ones and never waits on the
+ * device unless nothing is loaded yet.  Names and ids only change with
+ * StoreAdded/StoreRemoved events, which call ptpfs_storage_forget().
+ */
+int ptpfs_storage_get(struct ptpfs_sb_info *sb_info, int space)
+{
+	int ret;
+
+	if (sb_info->storages && space && !sb_info->storage_stop &&
+	    time_after_eq(jiffies, sb_info->storage_jiffies + sb_info->storage_ttl*HZ))
+		schedule_work(&sb_info->storage_work);
+
+	if (sb_info->storages == NULL)
+	{
+		ret = ptpfs_storage_load(sb_info);
+		if (ret)
+			return ret;
+	}
+	return sb_info->num_storages;
+}
+//=========================================================================
+
 static int ptpfs_root_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 //	printk(KERN_INFO "%s\n",  __FUNCTION__);
   
     struct inode *inode = filp->f_dentry->d_inode;
     struct dentry *dentry = filp->f_dentry;
-    struct ptp_storage_ids storageids;
+    struct ptpfs_sb_info *sb_info = PTPFSSB(inode->i_sb);
+    struct ptpfs_storage *st;
     int ino;
     int x;
-    char fsname[256];
-    int typeCount[5];
-    memset(typeCount,0,sizeof(typeCount));
-	memset(&storageids,0,sizeof(storageids)); 
+    int n;
 
     int offset = filp->f_pos;
 
@@ -124,36 +282,25 @@ static int ptpfs_root_readdir(struct file *filp, void *dirent, filldir_t filldir
 			filp->f_pos++;
 			offset++;
 		default:
-			if (ptp_getstorageids(PTPFSSB(inode->i_sb), &storageids)!=PTP_RC_OK)
-			{
-				printk(KERN_INFO "Error getting storage ids\n");
-				storageids.n = 0;
-				storageids.storage = NULL;
-			}
-			for (x = 0; x < storageids.n; x++)
+			down(&sb_info->storage_sem);
+			n = ptpfs_storage_get(sb_info, 0);
+			for (x = 0; x < n; x++)
 			{
-				struct ptp_storage_info storageinfo;
-				if ((storageids.storage[x]&0x0000ffff)==0) continue;
-
-				memset(&storageinfo,0,sizeof(storageinfo));
-				if (ptp_getstorageinfo(PTPFSSB(inode->i_sb), storageids.storage[x],&storageinfo)!=PTP_RC_OK)
-				{
-					printk(KERN_INFO "Error getting storage info\n");
-				}
-				else
+				st = &sb_info->storages[x];
+				if (filldir(dirent, st->name, strlen(st->name), filp->f_pos, st->id ,DT_DIR) < 0)
 				{
-					get_root_dir_name(&storageinfo, fsname, typeCount) ;
-					ino = storageids.storage[x];
-					ptp_free_storage_info(&storageinfo);
-					if (filldir(dirent, fsname, strlen(fsname), filp->f_pos, ino ,DT_DIR) < 0)
-					{
-						ptp_free_storage_ids(&storageids);
-						return 0;
-					}
-					filp->f_pos++;
+					up(&sb_info->storage_sem);
+					return 0;
 				}
+				filp->f_pos++;
+			}
+			up(&sb_info->storage_sem);
+			if (ptp_operation_issupported(sb_info, PTP_OC_GetThumb))
+			{
+				if (filldir(dirent, PTPFS_THUMBS_NAME, sizeof(PTPFS_THUMBS_NAME)-1, filp->f_pos, PTPFS_THUMBS_INO, DT_DIR) < 0)
+					return 0;
+				filp->f_pos++;
 			}
-			ptp_free_storage_ids(&storageids);
 			return 1;
 	}
 	return 0;
@@ -166,52 +313,38 @@ static struct dentry * ptpfs_root_lookup(struct inode *dir, struct dentry *dentr
 {
 //    printk(KERN_INFO "%s\n",  __FUNCTION__);
 
-    struct ptp_storage_ids storageids;
-    int x = 0;
-    char fsname[256];
-    int typeCount[5];
-    memset(&storageids,0,sizeof(storageids)); //add by evan
-    memset(typeCount,0,sizeof(typeCount));
+    struct ptpfs_sb_info *sb_info = PTPFSSB(dir->i_sb);
+    struct ptpfs_storage *st;
+    int x;
+    int n;
 
-    if (ptp_getstorageids(PTPFSSB(dir->i_sb), &storageids)!=PTP_RC_OK)
+    if (dentry->d_name.len == sizeof(PTPFS_THUMBS_NAME)-1 &&
+        !memcmp(dentry->d_name.name, PTPFS_THUMBS_NAME, dentry->d_name.len) &&
+        ptp_operation_issupported(sb_info, PTP_OC_GetThumb))
 	{
-        printk(KERN_INFO "Error getting storage ids\n");
-        storageids.n = 0;
-        storageids.storage = NULL;
+        d_add(dentry, ptpfs_thumbs_inode(dir));
+        return NULL;
 	}
 
-    int offset = 0;
-    for (; x < storageids.n; x++)
+    down(&sb_info->storage_sem);
+    n = ptpfs_storage_get(sb_info, 0);
+    for (x = 0; x < n; x++)
 	{
-        struct ptp_storage_info storageinfo;
-        if ((storageids.storage[x]&0x0000ffff)==0) continue;
-
-        memset(&storageinfo,0,sizeof(storageinfo));
-        if (ptp_getstorageinfo(PTPFSSB(dir->i_sb), storageids.storage[x],&storageinfo)!=PTP_RC_OK)
- 		{
-            printk(KERN_INFO "Error getting storage info\n");
- 		}
-        else
+        st = &sb_info->storages[x];
+        if (strlen(st->name) == dentry->d_name.len && !memcmp(st->name,dentry->d_name.name,dentry->d_name.len))
         	{
-            get_root_dir_name(&storageinfo,fsname,typeCount);
-            offset++;
-            if (!memcmp(fsname,dentry->d_name.name,dentry->d_name.len))
-            		{
-                struct inode *newi = ptpfs_get_inode(dir->i_sb, S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH , 0,storageids.storage[x]);
-              PTPFSINO(newi)->parent = dir; //dir should be root directory
-                //newi->i_fop = &ptpfs_stgdir_operations;
-                //newi->i_op = &ptpfs_stgdir_inode_operations;
+            struct inode *newi = ptpfs_get_inode(dir->i_sb, S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH , 0,st->id);
+            if (newi)
+            	{
+                PTPFSINO(newi)->parent = dir; //dir should be root directory
                 PTPFSINO(newi)->type = INO_TYPE_STGDIR;
-                PTPFSINO(newi)->storage = storageids.storage[x];
-                if (newi) d_add(dentry, newi);
-                ptp_free_storage_ids(&storageids);
-                ptp_free_storage_info(&storageinfo);
-                return NULL;
-            		}
-            ptp_free_storage_info(&storageinfo);
+                PTPFSINO(newi)->storage = st->id;
+                d_add(dentry, newi);
+            	}
+            break;
         	}
 	}
-    ptp_free_storage_ids(&storageids);
+    up(&sb_info->storage_sem);
     return NULL;
 
 }
@@ -229,6 +362,7 @@ struct inode_operations ptpfs_rootdir_inode_operations = {
 struct file_operations ptpfs_rootdir_operations = {
     read:       generic_read_dir,  
     readdir:    ptpfs_root_readdir,
+    ioctl:      ptpfs_dir_ioctl,
 };
 
 